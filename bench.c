@@ -0,0 +1,507 @@
+/*
+ * This file is part of The Lost Vikings Library/Tools
+ *
+ * Ryan Mallon, 2016, <rmallon@gmail.com>
+ *
+ * To the extent possible under law, the author(s) have dedicated all
+ * copyright and related and neighboring rights to this software to
+ * the public domain worldwide. This software is distributed without
+ * any warranty.  You should have received a copy of the CC0 Public
+ * Domain Dedication along with this software. If not, see
+ *
+ * <http://creativecommons.org/publicdomain/zero/1.0/>.
+ *
+ */
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <getopt.h>
+#include <time.h>
+
+#include <liblv/lv_compress.h>
+#include <liblv/lv_pack.h>
+#include <liblv/lv_workqueue.h>
+#include <liblv/common.h>
+
+/* Minimum time to spend timing each operation on each chunk */
+#define MIN_BENCH_TIME      0.01
+
+/* A chunk of test data */
+struct bench_chunk {
+    const char  *corpus;
+    unsigned    index;
+
+    /* Decompressed data */
+    uint8_t     *data;
+    size_t      size;
+
+    /* Original compressed data, or NULL for the synthetic corpus */
+    const uint8_t *orig;
+    size_t      orig_size;
+};
+
+/* Results for one chunk with one parser */
+struct bench_result {
+    size_t      compressed_size;
+    double      compress_time;
+    double      decompress_time;
+};
+
+/* Totals for a parser over a whole corpus */
+struct bench_totals {
+    size_t      size;
+    size_t      orig_size;
+    size_t      compressed_size;
+    double      compress_time;
+    double      decompress_time;
+
+    /* Worst chunks for compression speed, decompression speed and ratio */
+    struct bench_chunk *worst_compress, *worst_decompress, *worst_ratio;
+    double      worst_compress_rate, worst_decompress_rate, worst_ratio_val;
+};
+
+static const char *parser_names[] = {
+    [LV_COMPRESS_GREEDY]  = "greedy",
+    [LV_COMPRESS_LAZY]    = "lazy",
+    [LV_COMPRESS_OPTIMAL] = "optimal",
+};
+
+static struct bench_chunk *chunks;
+static size_t num_chunks;
+static bool csv_output;
+static unsigned num_threads;
+
+static void fatal_error(const char *msg)
+{
+    printf("Fatal error: %s\n", msg);
+    exit(EXIT_FAILURE);
+}
+
+static double get_time(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + (ts.tv_nsec / 1e9);
+}
+
+static double mb_per_sec(size_t size, double time)
+{
+    return time > 0 ? (size / time) / (1024 * 1024) : 0;
+}
+
+static struct bench_chunk *add_chunk(const char *corpus, unsigned index,
+                                     size_t size)
+{
+    struct bench_chunk *chunk;
+
+    chunks = realloc(chunks, (num_chunks + 1) * sizeof(*chunks));
+    if (!chunks)
+        fatal_error("Cannot allocate memory for chunks");
+
+    chunk = &chunks[num_chunks++];
+    memset(chunk, 0, sizeof(*chunk));
+    chunk->corpus = corpus;
+    chunk->index = index;
+    chunk->size = size;
+    chunk->data = malloc(size);
+    if (!chunk->data)
+        fatal_error("Cannot allocate memory for chunk");
+
+    return chunk;
+}
+
+/*
+ * Build a synthetic corpus which roughly resembles the kinds of data in
+ * the game's data files, so the benchmark can be run without them.
+ */
+static void load_synthetic_corpus(void)
+{
+    static const char *text = "The Lost Vikings. Erik the Swift, Baleog the "
+        "Fierce and Olaf the Stout have been kidnapped by Tomator. ";
+    struct bench_chunk *chunk;
+    unsigned seed = 1, i, j;
+    size_t text_len = strlen(text);
+
+    /* Random data, which does not compress */
+    chunk = add_chunk("synthetic", 0, 16384);
+    for (i = 0; i < chunk->size; i++) {
+        seed = seed * 1103515245 + 12345;
+        chunk->data[i] = seed >> 16;
+    }
+
+    /* All zeros, which compresses as well as possible */
+    chunk = add_chunk("synthetic", 1, 32768);
+    memset(chunk->data, 0, chunk->size);
+
+    /* Repeated text */
+    chunk = add_chunk("synthetic", 2, 20000);
+    for (i = 0; i < chunk->size; i++)
+        chunk->data[i] = text[i % text_len];
+
+    /* Tileset like data: 8x8 blocks of a few colors with some noise */
+    chunk = add_chunk("synthetic", 3, 65536);
+    for (i = 0; i < chunk->size; i++) {
+        seed = seed * 1103515245 + 12345;
+        j = (i / 64) % 7;
+        chunk->data[i] = ((seed >> 16) % 16 == 0) ? (seed >> 20) & 0xff :
+            0x20 + (j * 3) + ((i % 8) / 3);
+    }
+
+    /* Sprite like data: mask bytes followed by 8 mostly zero pixels */
+    chunk = add_chunk("synthetic", 4, 9 * 1024);
+    for (i = 0; i < chunk->size; i++) {
+        seed = seed * 1103515245 + 12345;
+        if (i % 9 == 0)
+            chunk->data[i] = (seed >> 16) & 0xff;
+        else
+            chunk->data[i] = ((seed >> 16) % 3 == 0) ? 0 : (seed >> 24) & 0x0f;
+    }
+
+    /* Level map like data: 16-bit tile indexes with runs */
+    chunk = add_chunk("synthetic", 5, 2 * 128 * 64);
+    for (i = 0; i < chunk->size; i += 2) {
+        seed = seed * 1103515245 + 12345;
+        j = ((i / 2) % 128 < 100) ? 0 : (seed >> 16) % 300;
+        chunk->data[i + 0] = j;
+        chunk->data[i + 1] = j >> 8;
+    }
+}
+
+/* Add every compressed chunk from a data file to the corpus */
+static void load_pack_corpus(struct lv_pack *pack)
+{
+    struct bench_chunk *chunk;
+    struct lv_chunk *lv_chunk;
+    unsigned i;
+
+    for (i = 0; i < pack->num_chunks; i++) {
+        lv_chunk = lv_pack_get_chunk(pack, i);
+        if (!lv_chunk || lv_chunk->storage != LV_CHUNK_STORAGE_COMPRESSED ||
+            lv_chunk->size <= lv_chunk->data_offset ||
+            lv_chunk->decompressed_size == 0)
+            continue;
+
+        chunk = add_chunk("pack", i, lv_decompress_chunk_size(lv_chunk));
+        if (lv_decompress_chunk_into(lv_chunk, chunk->data, chunk->size)) {
+            /* Not a valid compressed chunk */
+            free(chunk->data);
+            num_chunks--;
+            continue;
+        }
+
+        chunk->orig = (const uint8_t *)lv_chunk->data + lv_chunk->data_offset;
+        chunk->orig_size = lv_chunk->size - lv_chunk->data_offset;
+    }
+}
+
+static void bench_chunk(struct bench_chunk *chunk, unsigned parser,
+                        struct bench_result *result)
+{
+    struct lv_compress_params params = {
+        .parser      = parser,
+        .num_threads = num_threads,
+    };
+    size_t dst_max_size, count;
+    uint8_t *dst, *check;
+    double start, elapsed;
+
+    dst_max_size = chunk->size + (chunk->size / 8) + 1;
+    dst = malloc(dst_max_size);
+    check = malloc(chunk->size);
+    if (!dst || !check)
+        fatal_error("Cannot allocate memory for benchmark");
+
+    count = 0;
+    start = get_time();
+    do {
+        result->compressed_size = lv_compress_ex(chunk->data, chunk->size,
+                                                 dst, dst_max_size, &params);
+        count++;
+        elapsed = get_time() - start;
+    } while (elapsed < MIN_BENCH_TIME);
+    result->compress_time = elapsed / count;
+
+    if (result->compressed_size == 0)
+        fatal_error("Compression failed");
+
+    count = 0;
+    start = get_time();
+    do {
+        if (lv_decompress(dst, result->compressed_size, check, chunk->size))
+            fatal_error("Decompression failed");
+        count++;
+        elapsed = get_time() - start;
+    } while (elapsed < MIN_BENCH_TIME);
+    result->decompress_time = elapsed / count;
+
+    if (memcmp(check, chunk->data, chunk->size) != 0) {
+        printf("Round trip mismatch for %s chunk %.4x with %s parsing\n",
+               chunk->corpus, chunk->index, parser_names[parser]);
+        exit(EXIT_FAILURE);
+    }
+
+    free(dst);
+    free(check);
+}
+
+static void update_totals(struct bench_totals *totals,
+                          struct bench_chunk *chunk,
+                          const struct bench_result *result)
+{
+    double compress_rate, decompress_rate, ratio;
+
+    totals->size += chunk->size;
+    totals->orig_size += chunk->orig_size;
+    totals->compressed_size += result->compressed_size;
+    totals->compress_time += result->compress_time;
+    totals->decompress_time += result->decompress_time;
+
+    compress_rate = mb_per_sec(chunk->size, result->compress_time);
+    decompress_rate = mb_per_sec(chunk->size, result->decompress_time);
+    ratio = (double)result->compressed_size /
+        (chunk->orig ? chunk->orig_size : chunk->size);
+
+    if (!totals->worst_compress || compress_rate < totals->worst_compress_rate) {
+        totals->worst_compress = chunk;
+        totals->worst_compress_rate = compress_rate;
+    }
+    if (!totals->worst_decompress ||
+        decompress_rate < totals->worst_decompress_rate) {
+        totals->worst_decompress = chunk;
+        totals->worst_decompress_rate = decompress_rate;
+    }
+    if (!totals->worst_ratio || ratio > totals->worst_ratio_val) {
+        totals->worst_ratio = chunk;
+        totals->worst_ratio_val = ratio;
+    }
+}
+
+static void print_totals(const char *corpus, unsigned parser,
+                         const struct bench_totals *totals)
+{
+    if (csv_output) {
+        printf("total,%s,%s,%zu,%zu,%zu,%.2f,%.2f\n",
+               corpus, parser_names[parser], totals->size,
+               totals->orig_size, totals->compressed_size,
+               mb_per_sec(totals->size, totals->compress_time),
+               mb_per_sec(totals->size, totals->decompress_time));
+        printf("worst,%s,%s,compress,%.4x,%.2f\n", corpus,
+               parser_names[parser], totals->worst_compress->index,
+               totals->worst_compress_rate);
+        printf("worst,%s,%s,decompress,%.4x,%.2f\n", corpus,
+               parser_names[parser], totals->worst_decompress->index,
+               totals->worst_decompress_rate);
+        printf("worst,%s,%s,ratio,%.4x,%.4f\n", corpus,
+               parser_names[parser], totals->worst_ratio->index,
+               totals->worst_ratio_val);
+        return;
+    }
+
+    printf("%s corpus, %s parsing:\n", corpus, parser_names[parser]);
+    printf("  Size:              %zu -> %zu (%.1f%%)\n", totals->size,
+           totals->compressed_size,
+           100.0 * totals->compressed_size / totals->size);
+    if (totals->orig_size)
+        printf("  Original size:     %zu (ours is %.1f%% of the original)\n",
+               totals->orig_size,
+               100.0 * totals->compressed_size / totals->orig_size);
+    printf("  Compression:       %.2f MB/s\n",
+           mb_per_sec(totals->size, totals->compress_time));
+    printf("  Decompression:     %.2f MB/s\n",
+           mb_per_sec(totals->size, totals->decompress_time));
+    printf("  Worst compression:   chunk %.4x at %.2f MB/s\n",
+           totals->worst_compress->index, totals->worst_compress_rate);
+    printf("  Worst decompression: chunk %.4x at %.2f MB/s\n",
+           totals->worst_decompress->index, totals->worst_decompress_rate);
+    printf("  Worst ratio:         chunk %.4x at %.1f%%\n",
+           totals->worst_ratio->index, 100.0 * totals->worst_ratio_val);
+}
+
+static void bench_corpus(const char *corpus, unsigned parser)
+{
+    struct bench_totals totals;
+    struct bench_result result;
+    size_t i;
+
+    memset(&totals, 0, sizeof(totals));
+    for (i = 0; i < num_chunks; i++) {
+        if (strcmp(chunks[i].corpus, corpus) != 0)
+            continue;
+
+        bench_chunk(&chunks[i], parser, &result);
+        update_totals(&totals, &chunks[i], &result);
+
+        if (csv_output)
+            printf("chunk,%s,%s,%.4x,%zu,%zu,%zu,%.2f,%.2f\n",
+                   corpus, parser_names[parser], chunks[i].index,
+                   chunks[i].size, chunks[i].orig_size,
+                   result.compressed_size,
+                   mb_per_sec(chunks[i].size, result.compress_time),
+                   mb_per_sec(chunks[i].size, result.decompress_time));
+    }
+
+    if (totals.size)
+        print_totals(corpus, parser, &totals);
+}
+
+/* Time decompressing all of the original chunks, serially and batched */
+static void bench_pack_decompress(void)
+{
+    struct lv_decompress_job *jobs;
+    size_t i, num_jobs = 0, total = 0, count;
+    double start, serial_time, batch_time;
+
+    jobs = calloc(num_chunks, sizeof(*jobs));
+    if (!jobs)
+        fatal_error("Cannot allocate memory for jobs");
+
+    for (i = 0; i < num_chunks; i++) {
+        if (!chunks[i].orig)
+            continue;
+
+        jobs[num_jobs].src = chunks[i].orig;
+        jobs[num_jobs].src_size = chunks[i].orig_size;
+        jobs[num_jobs].dst = chunks[i].data;
+        jobs[num_jobs].dst_size = chunks[i].size;
+        total += chunks[i].size;
+        num_jobs++;
+    }
+    if (!num_jobs) {
+        free(jobs);
+        return;
+    }
+
+    count = 0;
+    start = get_time();
+    do {
+        for (i = 0; i < num_jobs; i++)
+            lv_decompress(jobs[i].src, jobs[i].src_size,
+                          jobs[i].dst, jobs[i].dst_size);
+        count++;
+    } while (get_time() - start < MIN_BENCH_TIME * 10);
+    serial_time = (get_time() - start) / count;
+
+    count = 0;
+    start = get_time();
+    do {
+        if (lv_decompress_batch(jobs, num_jobs, num_threads))
+            fatal_error("Batch decompression failed");
+        count++;
+    } while (get_time() - start < MIN_BENCH_TIME * 10);
+    batch_time = (get_time() - start) / count;
+
+    if (csv_output) {
+        printf("pack_decompress,serial,%zu,%zu,%.2f\n", num_jobs, total,
+               mb_per_sec(total, serial_time));
+        printf("pack_decompress,batch,%zu,%zu,%.2f\n", num_jobs, total,
+               mb_per_sec(total, batch_time));
+    } else {
+        printf("Whole pack decompression of original chunks (%zu chunks):\n",
+               num_jobs);
+        printf("  Serial:            %.2f MB/s\n",
+               mb_per_sec(total, serial_time));
+        printf("  Batch (%u threads):  %.2f MB/s\n",
+               num_threads ? num_threads : 1, mb_per_sec(total, batch_time));
+    }
+
+    free(jobs);
+}
+
+static void usage(const char *progname, int status)
+{
+    printf("Usage: %s [OPTIONS...] [DATA_FILE]\n", progname);
+    printf("\nBenchmark the liblv compressor and decompressor over the chunks in\n");
+    printf("DATA_FILE and over a built-in synthetic corpus.\n");
+    printf("\nOptions:\n");
+    printf("  -B, --blackthorne           Pack file is Blackthorne format\n");
+    printf("  -c, --compression=LEVEL     Only benchmark one parser: greedy, lazy\n");
+    printf("                              or optimal. Default is all of them\n");
+    printf("  -j, --jobs=N                Number of threads for compression and\n");
+    printf("                              batch decompression. Default is 1\n");
+    printf("  -C, --csv                   Machine readable CSV output\n");
+    printf("  -?, --help                  Help\n");
+    printf("\nCSV output has the following row types:\n");
+    printf("  chunk,CORPUS,PARSER,INDEX,SIZE,ORIG_SIZE,COMPRESSED_SIZE,COMPRESS_MBS,DECOMPRESS_MBS\n");
+    printf("  total,CORPUS,PARSER,SIZE,ORIG_SIZE,COMPRESSED_SIZE,COMPRESS_MBS,DECOMPRESS_MBS\n");
+    printf("  worst,CORPUS,PARSER,compress|decompress|ratio,INDEX,VALUE\n");
+    printf("  pack_decompress,serial|batch,NUM_CHUNKS,SIZE,MBS\n");
+
+    exit(status);
+}
+
+int main(int argc, char **argv)
+{
+    const struct option long_options[] = {
+        {"blackthorne", no_argument,       0, 'B'},
+        {"compression", required_argument, 0, 'c'},
+        {"jobs",        required_argument, 0, 'j'},
+        {"csv",         no_argument,       0, 'C'},
+        {"help",        no_argument,       0, '?'},
+        {NULL, 0, 0, 0},
+    };
+    const char *short_options = "Bc:j:C?";
+    unsigned parser, first_parser = 0, last_parser = LV_COMPRESS_OPTIMAL;
+    bool blackthorne = false;
+    struct lv_pack pack;
+    int option_index, c;
+
+    while (1) {
+        c = getopt_long(argc, argv, short_options, long_options, &option_index);
+        if (c == -1)
+            break;
+
+        switch (c) {
+        case 'B':
+            blackthorne = true;
+            break;
+
+        case 'c':
+            for (parser = 0; parser < ARRAY_SIZE(parser_names); parser++)
+                if (strcmp(optarg, parser_names[parser]) == 0)
+                    break;
+            if (parser == ARRAY_SIZE(parser_names))
+                fatal_error("Bad compression level");
+            first_parser = last_parser = parser;
+            break;
+
+        case 'j':
+            num_threads = strtoul(optarg, NULL, 0);
+            break;
+
+        case 'C':
+            csv_output = true;
+            break;
+
+        case '?':
+            usage(argv[0], EXIT_SUCCESS);
+            break;
+
+        default:
+            printf("Unknown argument %c\n", c);
+            usage(argv[0], EXIT_FAILURE);
+            break;
+        }
+    }
+
+    load_synthetic_corpus();
+
+    if (optind == argc - 1) {
+        if (lv_pack_load_flags(argv[optind], &pack, blackthorne,
+                               LV_PACK_LOAD_SEQUENTIAL))
+            fatal_error("Cannot load data file");
+        load_pack_corpus(&pack);
+    } else if (optind != argc) {
+        usage(argv[0], EXIT_FAILURE);
+    }
+
+    for (parser = first_parser; parser <= last_parser; parser++) {
+        bench_corpus("synthetic", parser);
+        bench_corpus("pack", parser);
+    }
+    bench_pack_decompress();
+
+    exit(EXIT_SUCCESS);
+}
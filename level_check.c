@@ -0,0 +1,301 @@
+/*
+ * This file is part of The Lost Vikings Library/Tools
+ *
+ * Ryan Mallon, 2016, <rmallon@gmail.com>
+ *
+ * To the extent possible under law, the author(s) have dedicated all
+ * copyright and related and neighboring rights to this software to
+ * the public domain worldwide. This software is distributed without
+ * any warranty.  You should have received a copy of the CC0 Public
+ * Domain Dedication along with this software. If not, see
+ *
+ * <http://creativecommons.org/publicdomain/zero/1.0/>.
+ *
+ */
+
+/*
+ * Load every level in a data file and report any problems, for example
+ * to check a modified DATA.DAT. Exits with a failure status if any level
+ * fails to load or has problems.
+ *
+ * Check the levels in The Lost Vikings using one thread per CPU:
+ *
+ *   ./level_check /path/to/vikings/DATA.DAT
+ *
+ * Only show Blackthorne levels with problems:
+ *
+ *   ./level_check --blackthorne --quiet /path/to/blackthorne/DATA.DAT
+ */
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <getopt.h>
+#include <time.h>
+
+#include <liblv/lv_pack.h>
+#include <liblv/lv_level.h>
+#include <liblv/lv_arena.h>
+#include <liblv/lv_workqueue.h>
+#include <liblv/common.h>
+
+/* Result of loading one level */
+struct level_result {
+    const struct lv_level_info *info;
+    bool        loaded;
+    unsigned    warnings;
+
+    unsigned    width, height;
+    size_t      num_objects;
+    size_t      num_sprite32_sets;
+    size_t      num_sprite_unpacked_sets;
+
+    double      load_time;
+    size_t      memory;
+};
+
+/* A range of levels loaded by one thread, using its own pack */
+struct check_job {
+    unsigned    first_level, last_level;
+    int         err;
+};
+
+static const struct {
+    unsigned    warning;
+    const char  *name;
+} warning_names[] = {
+    {LV_LEVEL_WARN_MAP_SIZE,    "map-size"},
+    {LV_LEVEL_WARN_OBJECTS,     "objects"},
+    {LV_LEVEL_WARN_SPRITE_SETS, "sprite-sets"},
+    {LV_LEVEL_WARN_PALETTES,    "palettes"},
+    {LV_LEVEL_WARN_CHUNKS,      "chunks"},
+};
+
+static const char *pack_filename;
+static bool blackthorne;
+static struct level_result *results;
+
+static void fatal_error(const char *msg)
+{
+    printf("Fatal error: %s\n", msg);
+    exit(EXIT_FAILURE);
+}
+
+static double get_time(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + (ts.tv_nsec / 1e9);
+}
+
+static void check_levels(void *arg)
+{
+    struct check_job *job = arg;
+    struct level_result *result;
+    struct lv_level level;
+    struct lv_arena arena;
+    struct lv_pack pack;
+    unsigned level_num;
+    double start;
+
+    /*
+     * Packs are not thread safe, so each thread opens its own. Consecutive
+     * levels are usually in the same world, so they share resources. The
+     * levels are already loaded in parallel, so each level's chunks are
+     * decompressed on this thread.
+     */
+    if (lv_pack_load_flags(pack_filename, &pack, blackthorne,
+                           LV_PACK_LOAD_RANDOM | LV_PACK_LOAD_LAZY |
+                           LV_PACK_LOAD_INDEX)) {
+        job->err = -1;
+        return;
+    }
+
+    lv_arena_init(&arena, 0);
+    for (level_num = job->first_level; level_num <= job->last_level;
+         level_num++) {
+        result = &results[level_num - 1];
+        result->info = lv_level_get_info(&pack, level_num);
+
+        start = get_time();
+        if (lv_level_load_arena(&pack, &level, &arena,
+                                result->info->chunk_level_header,
+                                result->info->chunk_object_db, 1)) {
+            result->load_time = get_time() - start;
+            continue;
+        }
+        result->load_time = get_time() - start;
+
+        result->loaded = true;
+        result->warnings = level.warnings;
+        result->width = level.width;
+        result->height = level.height;
+        result->num_objects = level.num_objects;
+        result->num_sprite32_sets = level.num_sprite32_sets;
+        result->num_sprite_unpacked_sets = level.num_sprite_unpacked_sets;
+        result->memory = arena.used;
+
+        lv_level_free(&pack, &level);
+    }
+
+    lv_arena_free(&arena);
+    lv_pack_free(&pack);
+}
+
+static void print_warnings(unsigned warnings)
+{
+    const char *sep = "";
+    int i;
+
+    for (i = 0; i < ARRAY_SIZE(warning_names); i++) {
+        if (warnings & warning_names[i].warning) {
+            printf("%s%s", sep, warning_names[i].name);
+            sep = ",";
+        }
+    }
+}
+
+static void usage(const char *progname, int status)
+{
+    printf("Usage: %s [OPTIONS...] DATA_FILE\n", progname);
+    printf("\nLoad every level in DATA_FILE and report the levels which fail to\n");
+    printf("load or have problems. Exits with a failure status if there are any.\n");
+    printf("\nOptions:\n");
+    printf("  -B, --blackthorne           Pack file is Blackthorne format\n");
+    printf("  -j, --jobs=N                Number of levels to load at once.\n");
+    printf("                              Default is one per CPU\n");
+    printf("  -q, --quiet                 Only show levels with problems\n");
+    printf("  -?, --help                  Help\n");
+    printf("\nProblems:\n");
+    printf("  map-size     Map data is smaller than the level\n");
+    printf("  objects      Too many objects\n");
+    printf("  sprite-sets  Too many sprite sets\n");
+    printf("  palettes     Too many palettes\n");
+    printf("  chunks       Missing or corrupt chunks\n");
+
+    exit(status);
+}
+
+int main(int argc, char **argv)
+{
+    const struct option long_options[] = {
+        {"blackthorne", no_argument,       0, 'B'},
+        {"jobs",        required_argument, 0, 'j'},
+        {"quiet",       no_argument,       0, 'q'},
+        {"help",        no_argument,       0, '?'},
+        {NULL, 0, 0, 0},
+    };
+    const char *short_options = "Bj:q?";
+    struct level_result *result;
+    struct check_job *jobs;
+    struct lv_workqueue wq;
+    struct lv_pack pack;
+    size_t num_levels;
+    unsigned num_jobs = 0, num_failed = 0, i;
+    bool quiet = false;
+    double start, total_time;
+    int option_index, c;
+
+    while (1) {
+        c = getopt_long(argc, argv, short_options, long_options, &option_index);
+        if (c == -1)
+            break;
+
+        switch (c) {
+        case 'B':
+            blackthorne = true;
+            break;
+
+        case 'j':
+            num_jobs = strtoul(optarg, NULL, 0);
+            break;
+
+        case 'q':
+            quiet = true;
+            break;
+
+        case '?':
+            usage(argv[0], EXIT_SUCCESS);
+            break;
+
+        default:
+            printf("Unknown argument %c\n", c);
+            usage(argv[0], EXIT_FAILURE);
+            break;
+        }
+    }
+
+    if (optind != argc - 1)
+        usage(argv[0], EXIT_FAILURE);
+    pack_filename = argv[optind];
+
+    start = get_time();
+
+    /* Only used to count the levels. Each thread opens the pack itself */
+    if (lv_pack_load_flags(pack_filename, &pack, blackthorne,
+                           LV_PACK_LOAD_LAZY | LV_PACK_LOAD_INDEX))
+        fatal_error("Cannot load data file");
+    num_levels = lv_level_get_num_levels(&pack);
+    lv_pack_free(&pack);
+
+    if (num_jobs == 0)
+        num_jobs = lv_workqueue_num_cpus();
+    num_jobs = min((size_t)num_jobs, num_levels);
+
+    results = calloc(num_levels, sizeof(*results));
+    jobs = calloc(num_jobs, sizeof(*jobs));
+    if (!results || !jobs)
+        fatal_error("Cannot allocate memory");
+
+    if (lv_workqueue_init(&wq, num_jobs))
+        fatal_error("Cannot create work queue");
+    for (i = 0; i < num_jobs; i++) {
+        jobs[i].first_level = (i * num_levels) / num_jobs + 1;
+        jobs[i].last_level = ((i + 1) * num_levels) / num_jobs;
+        if (lv_workqueue_add(&wq, check_levels, &jobs[i]))
+            check_levels(&jobs[i]);
+    }
+    lv_workqueue_free(&wq);
+
+    for (i = 0; i < num_jobs; i++)
+        if (jobs[i].err)
+            fatal_error("Cannot load data file");
+
+    total_time = get_time() - start;
+
+    if (!quiet)
+        printf("Level  Header  ObjDB  Size     Objs  S32  Unp  Time(ms)  Memory  Problems\n");
+    for (i = 0; i < num_levels; i++) {
+        result = &results[i];
+        if (!result->loaded || result->warnings)
+            num_failed++;
+        else if (quiet)
+            continue;
+
+        printf("%5u   %.4x   %.4x  ", i + 1,
+               result->info->chunk_level_header,
+               result->info->chunk_object_db);
+        if (!result->loaded) {
+            printf("%-39s  load-failed\n", "");
+            continue;
+        }
+
+        printf("%3ux%-3u  %4zu  %3zu  %3zu  %8.2f  %5zuK  ",
+               result->width, result->height, result->num_objects,
+               result->num_sprite32_sets, result->num_sprite_unpacked_sets,
+               result->load_time * 1000, (result->memory + 1023) / 1024);
+        print_warnings(result->warnings);
+        printf("\n");
+    }
+
+    printf("%zu levels, %u with problems, checked in %.2f ms using %u thread%s\n",
+           num_levels, num_failed, total_time * 1000, num_jobs,
+           num_jobs == 1 ? "" : "s");
+
+    free(jobs);
+    free(results);
+    exit(num_failed ? EXIT_FAILURE : EXIT_SUCCESS);
+}
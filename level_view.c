@@ -58,6 +58,10 @@ static const unsigned viking_pal_base[]    = {0xf0, 0xb0, 0xf0};
 
 static struct lv_pack pack;
 static struct lv_level level;
+static unsigned level_num;
+
+static SDL_Surface *surf_map, *surf_tileset;
+static unsigned surf_tileset_chunk;
 
 static void rgb555_to_sdl_color(uint16_t color, SDL_Color *sdl_color)
 {
@@ -167,16 +171,20 @@ static void draw_sprite32(struct lv_sprite_set *set, unsigned frame,
 static SDL_Surface *load_tileset(unsigned chunk_index)
 {
     SDL_Surface *surf;
-    struct lv_chunk *chunk;
-    size_t num_tiles;
-    uint8_t *data, *pixels;
+    const uint8_t *data;
+    size_t num_tiles, size;
+    uint8_t *pixels;
     int i;
 
-    chunk = lv_pack_get_chunk(&pack, chunk_index);
-    lv_decompress_chunk(chunk, &data);
+    /* Tilesets are shared between levels, so borrow the cached copy */
+    data = lv_pack_cache_get(&pack, chunk_index, &size);
+    if (!data) {
+        printf("Failed to load tileset chunk %.4x\n", chunk_index);
+        exit(EXIT_FAILURE);
+    }
 
     /* Tilesets are 8x8 */
-    num_tiles = chunk->decompressed_size / TILE_SIZE;
+    num_tiles = size / TILE_SIZE;
 
     surf = sdl_create_surf(screen, num_tiles * TILE_WIDTH, TILE_HEIGHT);
 
@@ -188,7 +196,7 @@ static SDL_Surface *load_tileset(unsigned chunk_index)
 			   false, false, pixels, i * TILE_WIDTH, 0, surf->w);
     SDL_UnlockSurface(surf);
 
-    free(data);
+    lv_pack_cache_put(&pack, chunk_index);
     return surf;
 }
 
@@ -381,7 +389,65 @@ static void draw_level(SDL_Surface *surf, SDL_Surface *surf_tileset)
         draw_level_objects(surf);
 }
 
-static void main_loop(SDL_Surface *surf_map, SDL_Surface *surf_tileset)
+static void load_level(unsigned chunk_level_header, unsigned chunk_object_db)
+{
+    /*
+     * The previous level's prefabs, sprite sets and chunk data stay in the
+     * pack's caches after it is freed, so switching to another level in
+     * the same world does not load them again.
+     */
+    lv_level_free(&pack, &level);
+    if (lv_level_load(&pack, &level, chunk_level_header, chunk_object_db)) {
+        printf("Failed to load level header chunk %.4x\n",
+               chunk_level_header);
+        exit(EXIT_FAILURE);
+    }
+
+    printf("%s level %d:\n",
+           pack.blackthorne ? "Blackthorne" : "The Lost Vikings",
+           level_num + 1);
+    printf("    Chunk header:   %4d (%.4x)\n",
+           chunk_level_header, chunk_level_header);
+    printf("    Chunk objectdb: %4d (%.4x)\n",
+           chunk_object_db, chunk_object_db);
+    if (pack.blackthorne)
+        printf("    Level size:     %dx%d (%dx%d rooms)\n",
+               level.width, level.height, level.width / 16, level.height / 14);
+    else
+        printf("    Level size:     %dx%d\n", level.width, level.height);
+
+    sdl_load_palette(screen, level.palette, 256);
+
+    /* Keep the rendered tileset and map surface if they still fit */
+    if (!surf_tileset || surf_tileset_chunk != level.chunk_tileset) {
+        if (surf_tileset)
+            SDL_FreeSurface(surf_tileset);
+        surf_tileset = load_tileset(level.chunk_tileset);
+        surf_tileset_chunk = level.chunk_tileset;
+    }
+
+    if (!surf_map || surf_map->w != level.width * PREFAB_WIDTH ||
+        surf_map->h != level.height * PREFAB_HEIGHT) {
+        if (surf_map)
+            SDL_FreeSurface(surf_map);
+        surf_map = create_level_surface(&level);
+    }
+}
+
+static bool switch_level(int delta)
+{
+    const struct lv_level_info *level_info;
+
+    level_info = lv_level_get_info(&pack, level_num + delta);
+    if (!level_info)
+        return false;
+
+    level_num += delta;
+    load_level(level_info->chunk_level_header, level_info->chunk_object_db);
+    return true;
+}
+
+static void main_loop(void)
 {
     unsigned xoff = 0, yoff = 0, tx, ty, tile, flags;
     int mouse_x = 0, mouse_y = 0, i;
@@ -466,6 +532,16 @@ static void main_loop(SDL_Surface *surf_map, SDL_Surface *surf_tileset)
                     draw_pal_animations = !draw_pal_animations;
                     break;
 
+                case SDLK_PAGEUP:
+                case SDLK_PAGEDOWN:
+                    if (switch_level(event.key.keysym.sym == SDLK_PAGEUP ?
+                                     -1 : 1)) {
+                        xoff = 0;
+                        yoff = 0;
+                        needs_redraw = true;
+                    }
+                    break;
+
                 default:
                     break;
                 }
@@ -563,6 +639,7 @@ static void usage(const char *progname, int status)
     printf("  -d, --debug=FLAGS            Enable debugging\n");
     printf("  -h, --chunk-header=CHUNK     Level header chunk (overrides level)\n");
     printf("  -D, --chunk-object-db=CHUNK  Level object DB chunk (overrides level)\n");
+    printf("\nPage Up and Page Down switch to the previous and next level.\n");
     exit(status);
 }
 
@@ -576,9 +653,8 @@ int main(int argc, char **argv)
     };
     const char *short_options = "Bd:h:D:";
     const char *pack_filename;
-    SDL_Surface *surf_tileset, *surf_map;
     unsigned debug_flags = 0, chunk_level_header = 0xffff,
-        chunk_object_db = 0xffff, level_num;
+        chunk_object_db = 0xffff;
     const struct lv_level_info *level_info;
     bool blackthorne = false;
     int c, option_index;
@@ -622,7 +698,9 @@ int main(int argc, char **argv)
     if (debug_flags)
         lv_debug_toggle(debug_flags);
 
-    lv_pack_load(pack_filename, &pack, blackthorne);
+    lv_pack_load_flags(pack_filename, &pack, blackthorne,
+                       LV_PACK_LOAD_RANDOM | LV_PACK_LOAD_LAZY |
+                       LV_PACK_LOAD_INDEX);
 
     /*
      * Get the chunk indexes for this level. These are hardcoded in the
@@ -638,31 +716,12 @@ int main(int argc, char **argv)
     if (chunk_object_db == 0xffff)
         chunk_object_db = level_info->chunk_object_db;
 
-    lv_level_load(&pack, &level, chunk_level_header, chunk_object_db);
-
-    printf("%s level %d:\n",
-           pack.blackthorne ? "Blackthorne" : "The Lost Vikings",
-           level_num + 1);
-    printf("    Chunk header:   %4d (%.4x)\n",
-           chunk_level_header, chunk_level_header);
-    printf("    Chunk objectdb: %4d (%.4x)\n",
-           chunk_object_db, chunk_object_db);
-    if (pack.blackthorne)
-        printf("    Level size:     %dx%d (%dx%d rooms)\n",
-               level.width, level.height, level.width / 16, level.height / 14);
-    else
-        printf("    Level size:     %dx%d\n", level.width, level.height);
-
     screen = sdl_init(640, 480);
 
     SDL_EnableKeyRepeat(250, 50);
 
-    sdl_load_palette(screen, level.palette, 256);
-
-    surf_tileset = load_tileset(level.chunk_tileset);
-
-    surf_map = create_level_surface(&level);
-    main_loop(surf_map, surf_tileset);
+    load_level(chunk_level_header, chunk_object_db);
+    main_loop();
 
     exit(EXIT_SUCCESS);
 }
@@ -27,7 +27,7 @@ int buffer_init(struct buffer *buf, size_t size)
 {
 	buf->size = size;
 	buf->data = malloc(buf->size);
-	if (!buf->size)
+	if (!buf->data)
 		return -ENOMEM;
 
 	buf->p = buf->data;
@@ -69,7 +69,7 @@ static inline void buffer_peek_u8(struct buffer *buf, off_t offset,
                                          var_type *val)         \
     {                                                           \
         buffer_get(buf, val, sizeof(*val));                     \
-        type##toh(val);                                         \
+        *val = type##toh(*val);                                 \
     }
 
 #define __DEFINE_BUFFER_PEEKER(type, var_type)                  \
@@ -78,13 +78,46 @@ static inline void buffer_peek_u8(struct buffer *buf, off_t offset,
                                           var_type *val)        \
     {                                                           \
         buffer_peek(buf, offset, val, sizeof(*val));            \
-        type##toh(val);                                         \
+        *val = type##toh(*val);                                 \
     }
 
+__DEFINE_BUFFER_GETTER(le64, uint64_t);
 __DEFINE_BUFFER_GETTER(le32, uint32_t);
 __DEFINE_BUFFER_GETTER(le16, uint16_t);
 
 __DEFINE_BUFFER_PEEKER(le32, uint32_t);
 __DEFINE_BUFFER_PEEKER(le16, uint16_t);
 
+/*
+ * Read and write little endian values at unaligned pointers, for file
+ * headers which are built or parsed in place.
+ */
+static inline void put_le32(uint8_t *p, uint32_t val)
+{
+    val = htole32(val);
+    memcpy(p, &val, sizeof(val));
+}
+
+static inline void put_le64(uint8_t *p, uint64_t val)
+{
+    val = htole64(val);
+    memcpy(p, &val, sizeof(val));
+}
+
+static inline uint32_t get_le32(const uint8_t *p)
+{
+    uint32_t val;
+
+    memcpy(&val, p, sizeof(val));
+    return le32toh(val);
+}
+
+static inline uint64_t get_le64(const uint8_t *p)
+{
+    uint64_t val;
+
+    memcpy(&val, p, sizeof(val));
+    return le64toh(val);
+}
+
 #endif /* _BUFFER_H */
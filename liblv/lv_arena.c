@@ -0,0 +1,138 @@
+/*
+ * This file is part of The Lost Vikings Library/Tools
+ *
+ * Ryan Mallon, 2016, <rmallon@gmail.com>
+ *
+ * To the extent possible under law, the author(s) have dedicated all
+ * copyright and related and neighboring rights to this software to
+ * the public domain worldwide. This software is distributed without
+ * any warranty.  You should have received a copy of the CC0 Public
+ * Domain Dedication along with this software. If not, see
+ *
+ * <http://creativecommons.org/publicdomain/zero/1.0/>.
+ *
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+#include "lv_arena.h"
+
+#define ARENA_ALIGN  _Alignof(max_align_t)
+
+struct lv_arena_block {
+    struct lv_arena_block *next;
+    size_t                size;
+    size_t                used;
+    max_align_t           data[];
+};
+
+static struct lv_arena_block *alloc_block(size_t size)
+{
+    struct lv_arena_block *block;
+
+    block = malloc(sizeof(*block) + size);
+    if (!block)
+        return NULL;
+
+    block->next = NULL;
+    block->size = size;
+    block->used = 0;
+    return block;
+}
+
+void lv_arena_init(struct lv_arena *arena, size_t block_size)
+{
+    memset(arena, 0, sizeof(*arena));
+    arena->block_size = block_size;
+}
+
+void *lv_arena_alloc(struct lv_arena *arena, size_t size)
+{
+    struct lv_arena_block *block = arena->blocks;
+    size_t block_size, offset;
+
+    /* Round up so that every allocation stays aligned */
+    if (size > SIZE_MAX - ARENA_ALIGN)
+        return NULL;
+    size = (size + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1);
+
+    if (!block || block->size - block->used < size) {
+        /*
+         * Start a new block. Whatever is left of the current block is
+         * wasted until the arena is reset.
+         */
+        block_size = arena->block_size ? arena->block_size :
+            LV_ARENA_DEFAULT_BLOCK_SIZE;
+        if (block_size < size)
+            block_size = size;
+
+        block = alloc_block(block_size);
+        if (!block)
+            return NULL;
+
+        block->next = arena->blocks;
+        arena->blocks = block;
+        arena->capacity += block_size;
+    }
+
+    offset = block->used;
+    block->used += size;
+    arena->used += size;
+    return (uint8_t *)block->data + offset;
+}
+
+void *lv_arena_calloc(struct lv_arena *arena, size_t count, size_t size)
+{
+    void *ptr;
+
+    if (size && count > SIZE_MAX / size)
+        return NULL;
+
+    ptr = lv_arena_alloc(arena, count * size);
+    if (ptr)
+        memset(ptr, 0, count * size);
+    return ptr;
+}
+
+void lv_arena_reset(struct lv_arena *arena)
+{
+    struct lv_arena_block *block;
+    size_t capacity = arena->capacity;
+
+    arena->used = 0;
+    if (!arena->blocks)
+        return;
+
+    if (!arena->blocks->next) {
+        arena->blocks->used = 0;
+        return;
+    }
+
+    /*
+     * Coalesce the blocks into one, so that the next round of allocations
+     * of the same total size fit without growing the arena.
+     */
+    lv_arena_free(arena);
+    block = alloc_block(capacity);
+    if (block) {
+        arena->blocks = block;
+        arena->capacity = capacity;
+    }
+}
+
+void lv_arena_free(struct lv_arena *arena)
+{
+    struct lv_arena_block *block, *next;
+
+    for (block = arena->blocks; block; block = next) {
+        next = block->next;
+        free(block);
+    }
+
+    arena->blocks = NULL;
+    arena->capacity = 0;
+    arena->used = 0;
+}
@@ -0,0 +1,104 @@
+/*
+ * This file is part of The Lost Vikings Library/Tools
+ *
+ * Ryan Mallon, 2016, <rmallon@gmail.com>
+ *
+ * To the extent possible under law, the author(s) have dedicated all
+ * copyright and related and neighboring rights to this software to
+ * the public domain worldwide. This software is distributed without
+ * any warranty.  You should have received a copy of the CC0 Public
+ * Domain Dedication along with this software. If not, see
+ *
+ * <http://creativecommons.org/publicdomain/zero/1.0/>.
+ *
+ */
+
+#ifndef _LV_ARENA_H
+#define _LV_ARENA_H
+
+#include <stddef.h>
+
+/**
+ * \defgroup lv_arena Arena allocator
+ * \{
+ *
+ * An arena hands out memory from large blocks and frees it all at once.
+ * It is used for data which lives exactly as long as something else, such
+ * as everything allocated when loading a level. Individual allocations
+ * cannot be freed.
+ *
+ * Resetting an arena releases all of its allocations but keeps its memory,
+ * so loading a series of levels into one arena reaches a steady size.
+ */
+
+struct lv_arena_block;
+
+/** Default minimum size of each block allocated by an arena. */
+#define LV_ARENA_DEFAULT_BLOCK_SIZE  (64 * 1024)
+
+/**
+ * An arena. A zeroed arena is empty and uses the default block size.
+ */
+struct lv_arena {
+    /** Blocks, most recently allocated first. */
+    struct lv_arena_block *blocks;
+
+    /** Minimum size of a new block, or zero for the default. */
+    size_t                block_size;
+
+    /** Total size of all of the blocks. */
+    size_t                capacity;
+
+    /** Number of bytes allocated since the arena was last reset. */
+    size_t                used;
+};
+
+/**
+ * Initialise an empty arena. No memory is allocated until it is needed.
+ *
+ * \param arena       Arena to initialise.
+ * \param block_size  Minimum size of each block, or zero for
+ *                    \ref LV_ARENA_DEFAULT_BLOCK_SIZE.
+ */
+void lv_arena_init(struct lv_arena *arena, size_t block_size);
+
+/**
+ * Allocate memory from an arena. The memory is suitably aligned for any
+ * type and is not initialised.
+ *
+ * \param arena       Arena.
+ * \param size        Number of bytes.
+ * \returns           Allocated memory, or NULL on failure.
+ */
+void *lv_arena_alloc(struct lv_arena *arena, size_t size);
+
+/**
+ * Allocate zeroed memory for an array from an arena.
+ *
+ * \param arena       Arena.
+ * \param count       Number of elements.
+ * \param size        Size of each element.
+ * \returns           Allocated memory, or NULL on failure.
+ */
+void *lv_arena_calloc(struct lv_arena *arena, size_t count, size_t size);
+
+/**
+ * Release every allocation made from an arena, keeping its memory for
+ * reuse. If the arena had grown to several blocks they are replaced with a
+ * single block of the same total size.
+ *
+ * \param arena       Arena.
+ */
+void lv_arena_reset(struct lv_arena *arena);
+
+/**
+ * Free an arena and all of its memory. The arena is left empty and can be
+ * used again.
+ *
+ * \param arena       Arena.
+ */
+void lv_arena_free(struct lv_arena *arena);
+
+/** \} */
+
+#endif /* _LV_ARENA_H */
@@ -15,155 +15,910 @@
 
 #include <stdbool.h>
 #include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
 #include <stdio.h>
 
 #include "lv_compress.h"
+#include "lv_workqueue.h"
 #include "common.h"
 
 #define RLE_MIN_LENGTH	3
 #define RLE_MAX_LENGTH	18
 
-static uint8_t rle_table_read(const uint8_t *table, unsigned *index)
+/*
+ * The decompressor's table is a 4K ring buffer of the most recently output
+ * bytes, initially zeroed. A match's table index therefore refers to the
+ * output byte at a distance of 1 to 4096 bytes back, or to a zero if that
+ * is before the start of the output. When the whole output is available
+ * matches are copied directly from it, rather than through the table.
+ */
+#define WINDOW_SIZE     0x1000
+#define WINDOW_MASK     (WINDOW_SIZE - 1)
+
+/*
+ * Worst case input and output sizes for a group of 8 tokens, including
+ * the slack needed for wide copies.
+ */
+#define GROUP_MAX_SRC   (1 + (8 * 2))
+#define MATCH_COPY_SIZE (3 * sizeof(uint64_t))
+#define GROUP_MAX_DST   ((8 * RLE_MAX_LENGTH) + MATCH_COPY_SIZE)
+
+/* Number of jobs in a batch handed to a thread at once */
+#define BATCH_JOBS_PER_WORK 16
+
+static inline void copy8(uint8_t *dst, const uint8_t *src)
 {
-    uint8_t byte;
+    uint64_t val;
+
+    memcpy(&val, src, sizeof(val));
+    memcpy(dst, &val, sizeof(val));
+}
 
-    byte = table[*index];
-    (*index)++;
-    (*index) &= 0xfff;
+/*
+ * Copy a match byte by byte. Handles overlapping matches and matches
+ * which refer to the zeroed table before the start of the output.
+ */
+static void copy_match_slow(uint8_t *dst, size_t dst_offset,
+                            size_t dist, size_t count)
+{
+    size_t i;
 
-    return byte;
+    for (i = 0; i < count; i++, dst_offset++) {
+        if (dist > dst_offset)
+            dst[dst_offset] = 0;
+        else
+            dst[dst_offset] = dst[dst_offset - dist];
+    }
 }
 
-static bool rle_table_find(const uint8_t *table, unsigned table_index,
-                           const uint8_t *data, size_t data_size,
-                           unsigned *index, size_t *length)
+static inline size_t match_distance(size_t dst_offset, unsigned index)
 {
-    int i, seq_len, offset;
+    size_t dist;
 
-    for (i = 0; i < 0x1000; i++) {
-        for (seq_len = 0; seq_len < data_size; seq_len++) {
-            offset = i + seq_len;
-            if (table[offset % 0xfff] != data[seq_len])
-                break;
+    dist = (dst_offset - index) & WINDOW_MASK;
+    return dist ? dist : WINDOW_SIZE;
+}
+
+/*
+ * Decode a group of 8 tokens when there is enough input and output left
+ * for any group, so no bounds checks are needed.
+ */
+static inline void decompress_group_fast(const uint8_t *src,
+                                         size_t *src_offset, uint8_t *dst,
+                                         size_t *dst_offset)
+{
+    size_t s = *src_offset, d = *dst_offset, dist, count;
+    unsigned bit, word;
+    uint8_t ctrl_byte;
+
+    ctrl_byte = src[s++];
+    if (ctrl_byte == 0xff) {
+        /* Run of 8 literals */
+        copy8(&dst[d], &src[s]);
+        *src_offset = s + 8;
+        *dst_offset = d + 8;
+        return;
+    }
+
+    for (bit = 0; bit < 8; bit++) {
+        if (ctrl_byte & (1 << bit)) {
+            dst[d++] = src[s++];
+            continue;
+        }
+
+        word = src[s] | (src[s + 1] << 8);
+        s += 2;
 
+        count = (word >> 12) + RLE_MIN_LENGTH;
+        dist = match_distance(d, word & WINDOW_MASK);
+
+        if (dist >= sizeof(uint64_t) && dist <= d) {
             /*
-             * Don't return RLE runs that are in the area of the table that
-             * will be written to, since the values will change.
+             * The source is at least 8 bytes back, so each 8 byte block
+             * only reads output that has already been written. Always
+             * copy the maximum match length. Anything past the end of
+             * the match is overwritten by the following tokens.
              */
-            if ((i >= table_index && i <= table_index + seq_len) ||
-                (offset >= table_index && offset <= table_index + seq_len)) {
-                seq_len = 0;
-                break;
+            copy8(&dst[d +  0], &dst[d +  0 - dist]);
+            copy8(&dst[d +  8], &dst[d +  8 - dist]);
+            copy8(&dst[d + 16], &dst[d + 16 - dist]);
+        } else {
+            copy_match_slow(dst, d, dist, count);
+        }
+        d += count;
+    }
+
+    *src_offset = s;
+    *dst_offset = d;
+}
+
+/* Decompress starting part way through the source and destination */
+static int decompress_from(const uint8_t *src, size_t src_size,
+                           size_t src_offset, uint8_t *dst, size_t dst_size,
+                           size_t dst_offset)
+{
+    size_t count, dist;
+    unsigned bit, word;
+    uint8_t ctrl_byte;
+
+    while (dst_offset < dst_size) {
+        if (src_offset + GROUP_MAX_SRC <= src_size &&
+            dst_offset + GROUP_MAX_DST <= dst_size) {
+            decompress_group_fast(src, &src_offset, dst, &dst_offset);
+            continue;
+        }
+
+        /* Near the end of the input or output, check every token */
+        if (src_offset >= src_size)
+            return -1;
+
+        ctrl_byte = src[src_offset++];
+        for (bit = 0; bit < 8 && dst_offset < dst_size; bit++) {
+            if (ctrl_byte & (1 << bit)) {
+                if (src_offset >= src_size)
+                    return -1;
+                dst[dst_offset++] = src[src_offset++];
+                continue;
+            }
+
+            if (src_offset + 2 > src_size)
+                return -1;
+            word = src[src_offset] | (src[src_offset + 1] << 8);
+            src_offset += 2;
+
+            count = (word >> 12) + RLE_MIN_LENGTH;
+            count = min(count, dst_size - dst_offset);
+            dist = match_distance(dst_offset, word & WINDOW_MASK);
+
+            copy_match_slow(dst, dst_offset, dist, count);
+            dst_offset += count;
+        }
+    }
+
+    return 0;
+}
+
+int lv_decompress(const uint8_t *src, size_t src_size,
+		  uint8_t *dst, size_t dst_size)
+{
+    return decompress_from(src, src_size, 0, dst, dst_size, 0);
+}
+
+/*
+ * Decode two jobs on one thread by alternately decoding a group of tokens
+ * from each. Decoding a single stream is a chain of dependent loads and
+ * branches, so working on two independent streams at once gives the CPU
+ * something else to do while each one waits. A job is finished with the
+ * bounds checked decoder once it nears the end of its input or output.
+ */
+static void decompress_interleaved(struct lv_decompress_job *jobs,
+                                   size_t num_jobs)
+{
+    struct lv_decompress_job *a = NULL, *b = NULL;
+    size_t a_src = 0, a_dst = 0, b_src = 0, b_dst = 0, next_job = 0;
+
+    while (1) {
+        if (!a && next_job < num_jobs) {
+            a = &jobs[next_job++];
+            a_src = a_dst = 0;
+        }
+        if (!b && next_job < num_jobs) {
+            b = &jobs[next_job++];
+            b_src = b_dst = 0;
+        }
+        if (!a && !b)
+            break;
+
+        if (a && b) {
+            while (a_src + GROUP_MAX_SRC <= a->src_size &&
+                   a_dst + GROUP_MAX_DST <= a->dst_size &&
+                   b_src + GROUP_MAX_SRC <= b->src_size &&
+                   b_dst + GROUP_MAX_DST <= b->dst_size) {
+                decompress_group_fast(a->src, &a_src, a->dst, &a_dst);
+                decompress_group_fast(b->src, &b_src, b->dst, &b_dst);
             }
         }
-        if (seq_len >= RLE_MIN_LENGTH) {
-            *index = i;
-            *length = seq_len;
-            return true;
+
+        if (a && (!b || a_src + GROUP_MAX_SRC > a->src_size ||
+                  a_dst + GROUP_MAX_DST > a->dst_size)) {
+            a->err = decompress_from(a->src, a->src_size, a_src,
+                                     a->dst, a->dst_size, a_dst);
+            a = NULL;
+        } else if (b) {
+            b->err = decompress_from(b->src, b->src_size, b_src,
+                                     b->dst, b->dst_size, b_dst);
+            b = NULL;
+        }
+    }
+}
+
+struct batch_work {
+    struct lv_decompress_job    *jobs;
+    size_t                      num_jobs;
+};
+
+static void decompress_batch_work(void *arg)
+{
+    struct batch_work *work = arg;
+
+    decompress_interleaved(work->jobs, work->num_jobs);
+}
+
+int lv_decompress_batch(struct lv_decompress_job *jobs, size_t num_jobs,
+                        unsigned num_threads)
+{
+    struct batch_work *works;
+    struct lv_workqueue wq;
+    size_t i, num_works;
+    int err = 0;
+
+    num_works = (num_jobs + BATCH_JOBS_PER_WORK - 1) / BATCH_JOBS_PER_WORK;
+    if (num_threads <= 1 || num_works <= 1) {
+        decompress_interleaved(jobs, num_jobs);
+    } else {
+        works = calloc(num_works, sizeof(*works));
+        if (!works)
+            return -1;
+        err = lv_workqueue_init(&wq, min((size_t)num_threads, num_works));
+        if (err) {
+            free(works);
+            return -1;
+        }
+
+        for (i = 0; i < num_works; i++) {
+            works[i].jobs = &jobs[i * BATCH_JOBS_PER_WORK];
+            works[i].num_jobs = min((size_t)BATCH_JOBS_PER_WORK,
+                                    num_jobs - (i * BATCH_JOBS_PER_WORK));
+            if (lv_workqueue_add(&wq, decompress_batch_work, &works[i]))
+                decompress_batch_work(&works[i]);
         }
+        lv_workqueue_free(&wq);
+        free(works);
     }
 
-    return false;
+    for (i = 0; i < num_jobs; i++)
+        if (jobs[i].err)
+            err = -1;
+
+    return err;
 }
 
-static void rle_table_write(uint8_t *table, unsigned *index, uint8_t byte)
+void lv_decompress_stream_init(struct lv_decompress_stream *stream)
 {
-    table[*index] = byte;
-    (*index)++;
-    (*index) &= 0xfff;
+    memset(stream, 0, sizeof(*stream));
+    stream->bit = 8;
 }
 
-void lv_decompress(const uint8_t *src, size_t src_size,
-		   uint8_t *dst, size_t dst_size)
+void lv_decompress_stream_input(struct lv_decompress_stream *stream,
+                                const uint8_t *src, size_t src_size)
 {
-    unsigned bit, i, count, src_offset = 0, dst_offset = 0, table_index = 0,
-        rle_index;
-    uint8_t table[0x1000] = {0};
-    uint16_t word;
-    uint8_t ctrl_byte, byte;
+    stream->src = src;
+    stream->src_size = src_size;
+}
+
+static inline void stream_output(struct lv_decompress_stream *stream,
+                                 uint8_t *dst, uint8_t val)
+{
+    stream->table[stream->table_index] = val;
+    stream->table_index = (stream->table_index + 1) & WINDOW_MASK;
+    *dst = val;
+}
+
+size_t lv_decompress_stream_read(struct lv_decompress_stream *stream,
+                                 uint8_t *dst, size_t dst_size)
+{
+    size_t dst_offset = 0;
+    unsigned word;
+    uint8_t val;
 
     while (dst_offset < dst_size) {
-        ctrl_byte = src[src_offset++];
-        for (bit = 0; bit < 8; bit++) {
-            if (dst_offset >= dst_size)
+        /* Finish any match left over from the previous read */
+        if (stream->match_count) {
+            val = stream->table[stream->match_index];
+            stream->match_index = (stream->match_index + 1) & WINDOW_MASK;
+            stream->match_count--;
+            stream_output(stream, &dst[dst_offset++], val);
+            continue;
+        }
+
+        if (stream->bit == 8) {
+            if (stream->src_size == 0)
                 break;
+            stream->ctrl_byte = *stream->src++;
+            stream->src_size--;
+            stream->bit = 0;
+        }
 
-            if (ctrl_byte & (1 << bit)) {
-                /* Output the next byte and store it in the table */
-                byte = src[src_offset++];
-
-                dst[dst_offset++] = byte;
-                rle_table_write(table, &table_index, byte);
-
-            } else {
-                /*
-                 *
-                 */
-                word = (src[src_offset + 0] << 0) | (src[src_offset + 1] << 8);
-                src_offset += 2;
-
-                count = ((word & 0xf000) >> 12) + 3;
-                rle_index = word & 0xfff;
-
-                for (i = 0; i < count; i++) {
-                    byte = rle_table_read(table, &rle_index);
-                    rle_table_write(table, &table_index, byte);
-                    dst[dst_offset++] = byte;
-                }
+        if (stream->ctrl_byte & (1 << stream->bit)) {
+            if (stream->src_size == 0)
+                break;
+            stream_output(stream, &dst[dst_offset++], *stream->src++);
+            stream->src_size--;
+            stream->bit++;
+            continue;
+        }
+
+        /* A match token may be split across two pieces of input */
+        if (!stream->have_partial) {
+            if (stream->src_size == 0)
+                break;
+            stream->partial_byte = *stream->src++;
+            stream->src_size--;
+            stream->have_partial = true;
+        }
+        if (stream->src_size == 0)
+            break;
+        word = stream->partial_byte | (*stream->src++ << 8);
+        stream->src_size--;
+        stream->have_partial = false;
+
+        stream->match_index = word & WINDOW_MASK;
+        stream->match_count = (word >> 12) + RLE_MIN_LENGTH;
+        stream->bit++;
+    }
+
+    stream->total_out += dst_offset;
+    return dst_offset;
+}
+
+/* Decode and discard output, for example to skip to a checkpoint */
+static int stream_skip(struct lv_decompress_stream *stream, size_t count)
+{
+    uint8_t buf[256];
+    size_t n;
+
+    while (count) {
+        n = lv_decompress_stream_read(stream, buf, min(count, sizeof(buf)));
+        if (n == 0)
+            return -1;
+        count -= n;
+    }
+
+    return 0;
+}
+
+int lv_decompress_index_build(struct lv_decompress_index *index,
+                              const uint8_t *src, size_t src_size,
+                              size_t dst_size, size_t interval)
+{
+    struct lv_decompress_stream stream;
+    struct lv_decompress_checkpoint *cp;
+    size_t i;
+
+    memset(index, 0, sizeof(*index));
+    if (interval == 0)
+        return -1;
+
+    index->interval = interval;
+    index->dst_size = dst_size;
+    index->num_checkpoints = dst_size ? ((dst_size - 1) / interval) + 1 : 1;
+    index->checkpoints = calloc(index->num_checkpoints,
+                                sizeof(*index->checkpoints));
+    if (!index->checkpoints)
+        return -1;
+
+    lv_decompress_stream_init(&stream);
+    lv_decompress_stream_input(&stream, src, src_size);
+    for (i = 0; i < index->num_checkpoints; i++) {
+        if (i != 0 && stream_skip(&stream, interval)) {
+            lv_decompress_index_free(index);
+            return -1;
+        }
+
+        cp = &index->checkpoints[i];
+        cp->src_offset = stream.src - src;
+        cp->stream = stream;
+        cp->stream.src = NULL;
+        cp->stream.src_size = 0;
+    }
+
+    return 0;
+}
+
+void lv_decompress_index_free(struct lv_decompress_index *index)
+{
+    free(index->checkpoints);
+    memset(index, 0, sizeof(*index));
+}
+
+int lv_decompress_range(const struct lv_decompress_index *index,
+                        const uint8_t *src, size_t src_size, size_t offset,
+                        uint8_t *dst, size_t dst_size)
+{
+    const struct lv_decompress_checkpoint *cp;
+    struct lv_decompress_stream stream;
+
+    if (offset > index->dst_size || dst_size > index->dst_size - offset)
+        return -1;
+    if (dst_size == 0)
+        return 0;
+
+    cp = &index->checkpoints[offset / index->interval];
+    if (cp->src_offset > src_size)
+        return -1;
+
+    stream = cp->stream;
+    lv_decompress_stream_input(&stream, src + cp->src_offset,
+                               src_size - cp->src_offset);
+    if (stream_skip(&stream, offset - stream.total_out))
+        return -1;
+    if (lv_decompress_stream_read(&stream, dst, dst_size) != dst_size)
+        return -1;
+
+    return 0;
+}
+
+/*
+ * The match finder works on a copy of the source data preceeded by a
+ * window's worth of zero bytes, which is what the decompressor's table is
+ * initialised to. A position in this data is at the same table index as
+ * the source byte it refers to.
+ *
+ * Positions with the same three byte hash are chained together, most
+ * recent first, so only positions that can possibly match are compared.
+ */
+#define HASH_BITS       12
+#define HASH_SIZE       (1 << HASH_BITS)
+
+/* Default number of chain entries to compare for each position */
+#define DEFAULT_MAX_CHAIN   256
+
+/*
+ * Minimum number of positions each thread finds matches for. Each thread
+ * has to insert the preceeding window's positions before it can start,
+ * so small slices are not worthwhile. Lost Vikings chunks are at most 64K,
+ * so this is small enough for the largest of them to be split four ways.
+ */
+#define MIN_SLICE_SIZE      (16 * 1024)
+
+/* Minimum number of threads to find matches in parallel for greedy/lazy */
+#define MIN_THREADS_SKIPPING_PARSE  4
+
+/* Token costs in bits, including the control byte bit */
+#define LITERAL_COST    9
+#define MATCH_COST      17
+
+struct match_finder {
+    uint8_t         *data;
+    size_t          size;
+    size_t          next_insert;
+    unsigned        max_chain;
+    int32_t         head[HASH_SIZE];
+    int32_t         prev[WINDOW_SIZE];
+
+    /* Precomputed longest matches for each source position, or NULL */
+    uint8_t         *lengths;
+    uint16_t        *indexes;
+};
+
+struct lzss_writer {
+    uint8_t         *dst;
+    size_t          dst_size;
+    size_t          offset;
+    size_t          ctrl_offset;
+    unsigned        bit;
+    bool            overflow;
+};
+
+static inline unsigned match_hash(const uint8_t *p)
+{
+    return ((p[0] << 8) ^ (p[1] << 4) ^ p[2]) & (HASH_SIZE - 1);
+}
+
+static int match_finder_init(struct match_finder *mf,
+                             const uint8_t *src, size_t src_size,
+                             unsigned max_chain)
+{
+    mf->max_chain = max_chain;
+    mf->size = WINDOW_SIZE + src_size;
+    mf->data = malloc(mf->size);
+    if (!mf->data)
+        return -1;
+
+    memset(mf->data, 0, WINDOW_SIZE);
+    memcpy(mf->data + WINDOW_SIZE, src, src_size);
+
+    memset(mf->head, 0xff, sizeof(mf->head));
+    mf->next_insert = 0;
+    mf->lengths = NULL;
+    mf->indexes = NULL;
+    return 0;
+}
+
+static void match_finder_free(struct match_finder *mf)
+{
+    free(mf->data);
+    free(mf->lengths);
+    free(mf->indexes);
+}
+
+/* Add all positions before pos to the hash chains */
+static void match_finder_insert(struct match_finder *mf, size_t pos)
+{
+    unsigned hash;
+    size_t i;
+
+    for (i = mf->next_insert; i < pos && i + RLE_MIN_LENGTH <= mf->size; i++) {
+        hash = match_hash(&mf->data[i]);
+        mf->prev[i & WINDOW_MASK] = mf->head[hash];
+        mf->head[hash] = i;
+    }
+    mf->next_insert = max(mf->next_insert, pos);
+}
+
+/*
+ * Find the longest match for the data at pos. Matches may not read from
+ * the region of the table that the match itself will be written to,
+ * since the values there will change. That is, for a match of length
+ * len at distance dist both len <= dist and len <= WINDOW_SIZE - dist
+ * must hold.
+ */
+static size_t match_finder_find(struct match_finder *mf, size_t pos,
+                                unsigned *index)
+{
+    size_t dist, len, limit, max_len, best_len = 0;
+    const uint8_t *cur = &mf->data[pos], *cand;
+    int32_t candidate;
+    unsigned chain;
+
+    max_len = min(mf->size - pos, (size_t)RLE_MAX_LENGTH);
+    if (max_len < RLE_MIN_LENGTH)
+        return 0;
+
+    if (mf->lengths) {
+        *index = mf->indexes[pos - WINDOW_SIZE];
+        return mf->lengths[pos - WINDOW_SIZE];
+    }
+
+    match_finder_insert(mf, pos);
+
+    candidate = mf->head[match_hash(cur)];
+    for (chain = 0; candidate >= 0 && chain < mf->max_chain; chain++) {
+        dist = pos - candidate;
+        if (dist > WINDOW_SIZE - RLE_MIN_LENGTH)
+            break;
+
+        limit = min(max_len, min(dist, WINDOW_SIZE - dist));
+        cand = &mf->data[candidate];
+
+        /* Only compare candidates which could be longer than the best */
+        if (limit > best_len && cand[best_len] == cur[best_len]) {
+            for (len = 0; len < limit; len++)
+                if (cand[len] != cur[len])
+                    break;
+
+            if (len > best_len) {
+                best_len = len;
+                *index = candidate & WINDOW_MASK;
+                if (best_len == max_len)
+                    break;
             }
         }
+
+        candidate = mf->prev[candidate & WINDOW_MASK];
     }
+
+    return best_len >= RLE_MIN_LENGTH ? best_len : 0;
 }
 
-size_t lv_compress(const uint8_t *src, size_t src_size,
-		   uint8_t *dst, size_t dst_size)
+struct find_matches_work {
+    const struct match_finder *mf;
+    size_t                    start, end;
+    int                       err;
+};
+
+/*
+ * Find the longest match for each position in a slice of the data. The
+ * search from a position only visits positions up to a window behind it,
+ * so starting a private match finder a window before the slice gives the
+ * same matches as a single match finder run over all of the data.
+ */
+static void find_matches_slice(void *arg)
 {
-    uint8_t table[0x1000] = {0}, byte;
-    unsigned i, bit, src_offset = 0, dst_offset = 0, table_index = 0,
-        rle_index, ctrl_byte_offset;
-    size_t rle_len;
-    uint16_t word;
-    bool found;
+    struct find_matches_work *work = arg;
+    const struct match_finder *shared = work->mf;
+    struct match_finder *mf;
+    size_t pos;
+    unsigned index;
+
+    mf = malloc(sizeof(*mf));
+    if (!mf) {
+        work->err = -1;
+        return;
+    }
+
+    mf->data = shared->data;
+    mf->size = shared->size;
+    mf->max_chain = shared->max_chain;
+    mf->next_insert = work->start - WINDOW_SIZE;
+    mf->lengths = NULL;
+    mf->indexes = NULL;
+    memset(mf->head, 0xff, sizeof(mf->head));
+
+    for (pos = work->start; pos < work->end; pos++) {
+        index = 0;
+        shared->lengths[pos - WINDOW_SIZE] = match_finder_find(mf, pos, &index);
+        shared->indexes[pos - WINDOW_SIZE] = index;
+    }
 
-    while (src_offset < src_size) {
+    free(mf);
+}
+
+/* Precompute the longest match for every position using multiple threads */
+static int find_matches_parallel(struct match_finder *mf, unsigned num_threads)
+{
+    struct find_matches_work *works;
+    struct lv_workqueue wq;
+    size_t src_size, slice_size, num_slices, i;
+    int err = 0;
+
+    src_size = mf->size - WINDOW_SIZE;
+    slice_size = max((src_size + num_threads - 1) / num_threads,
+                     (size_t)MIN_SLICE_SIZE);
+    num_slices = (src_size + slice_size - 1) / slice_size;
+
+    mf->lengths = malloc(src_size * sizeof(*mf->lengths));
+    mf->indexes = malloc(src_size * sizeof(*mf->indexes));
+    works = calloc(num_slices, sizeof(*works));
+    if (!mf->lengths || !mf->indexes || !works) {
+        free(works);
+        return -1;
+    }
+
+    if (lv_workqueue_init(&wq, min((size_t)num_threads, num_slices))) {
+        free(works);
+        return -1;
+    }
+
+    for (i = 0; i < num_slices; i++) {
+        works[i].mf = mf;
+        works[i].start = WINDOW_SIZE + (i * slice_size);
+        works[i].end = min(works[i].start + slice_size, mf->size);
+        if (lv_workqueue_add(&wq, find_matches_slice, &works[i]))
+            find_matches_slice(&works[i]);
+    }
+    lv_workqueue_free(&wq);
+
+    for (i = 0; i < num_slices; i++)
+        if (works[i].err)
+            err = -1;
+
+    free(works);
+    return err;
+}
+
+static void lzss_write_token(struct lzss_writer *w, bool literal,
+                             const uint8_t *data, size_t size)
+{
+    if (w->bit == 0) {
         /* Write a place-holder control byte */
-        ctrl_byte_offset = dst_offset++;
-        dst[ctrl_byte_offset] = 0;
+        if (w->offset >= w->dst_size) {
+            w->overflow = true;
+            return;
+        }
 
-        for (bit = 0; bit < 8; bit++) {
-            if (src_offset >= src_size)
-                break;
+        w->ctrl_offset = w->offset++;
+        w->dst[w->ctrl_offset] = 0;
+    }
+
+    if (w->offset + size > w->dst_size) {
+        w->overflow = true;
+        return;
+    }
+
+    if (literal)
+        w->dst[w->ctrl_offset] |= (1 << w->bit);
+    memcpy(&w->dst[w->offset], data, size);
+    w->offset += size;
+    w->bit = (w->bit + 1) & 7;
+}
+
+static void lzss_write_literal(struct lzss_writer *w, uint8_t byte)
+{
+    /* Literal bytes are encoded directly. Control byte flag is set. */
+    lzss_write_token(w, true, &byte, 1);
+}
+
+static void lzss_write_match(struct lzss_writer *w, unsigned index,
+                             size_t len)
+{
+    uint16_t word;
+    uint8_t bytes[2];
+
+    /*
+     * Matches are encoded as a 16-bit word for length and table index.
+     * Control byte flag is not set.
+     */
+    word  = ((len - RLE_MIN_LENGTH) & 0xf) << 12;
+    word |= index & 0xfff;
+
+    bytes[0] = word;
+    bytes[1] = word >> 8;
+    lzss_write_token(w, false, bytes, sizeof(bytes));
+}
+
+/* Take the longest match at each position */
+static void parse_greedy(struct match_finder *mf, struct lzss_writer *w)
+{
+    size_t pos, len;
+    unsigned index;
+
+    pos = WINDOW_SIZE;
+    while (pos < mf->size && !w->overflow) {
+        len = match_finder_find(mf, pos, &index);
+        if (len) {
+            lzss_write_match(w, index, len);
+            pos += len;
+        } else {
+            lzss_write_literal(w, mf->data[pos]);
+            pos++;
+        }
+    }
+}
+
+/*
+ * Like greedy parsing, but emit a literal instead of a match if there is
+ * a longer match at the next position.
+ */
+static void parse_lazy(struct match_finder *mf, struct lzss_writer *w)
+{
+    size_t pos, len, next_len;
+    unsigned index, next_index;
+
+    pos = WINDOW_SIZE;
+    len = match_finder_find(mf, pos, &index);
+    while (pos < mf->size && !w->overflow) {
+        if (!len) {
+            lzss_write_literal(w, mf->data[pos]);
+            pos++;
+            len = match_finder_find(mf, pos, &index);
+            continue;
+        }
 
-            /* Try to find an repeated sequence */
-            found = rle_table_find(table, table_index, &src[src_offset],
-                                   min(src_size - src_offset, RLE_MAX_LENGTH),
-                                   &rle_index, &rle_len);
-            if (found) {
-                /*
-                 * RLE sequence found. Encode a 16-bit word for length
-                 * and index. Control byte flag is not set.
-                 */
-                word  = ((rle_len - 3) & 0xf) << 12;
-                word |= rle_index & 0xfff;
-
-                dst[dst_offset++] = word;
-                dst[dst_offset++] = word >> 8;
-
-                for (i = 0; i < rle_len; i++)
-                    rle_table_write(table, &table_index, src[src_offset++]);
-
-            } else {
-                /*
-                 * No sequence found. Encode the byte directly.
-                 * Control byte flag is set.
-                 */
-                dst[ctrl_byte_offset] |= (1 << bit);
-                byte = src[src_offset++];
-                dst[dst_offset++] = byte;
-                rle_table_write(table, &table_index, byte);
+        if (len < RLE_MAX_LENGTH) {
+            next_len = match_finder_find(mf, pos + 1, &next_index);
+            if (next_len > len) {
+                lzss_write_literal(w, mf->data[pos]);
+                pos++;
+                len = next_len;
+                index = next_index;
+                continue;
             }
         }
+
+        lzss_write_match(w, index, len);
+        pos += len;
+        len = match_finder_find(mf, pos, &index);
     }
+}
 
-    return dst_offset;
+/*
+ * Find the encoding with the fewest bits. The longest match is found for
+ * every position, then the cheapest path from each position to the end
+ * of the data is calculated working backwards. Any length up to the
+ * longest match at a position can be used with the same table index.
+ */
+static int parse_optimal(struct match_finder *mf, struct lzss_writer *w)
+{
+    size_t src_size, i, len, best_len, *cost;
+    uint16_t *indexes;
+    uint8_t *lengths;
+    unsigned index;
+    int err = -1;
+
+    src_size = mf->size - WINDOW_SIZE;
+    cost = malloc((src_size + 1) * sizeof(*cost));
+    indexes = malloc(src_size * sizeof(*indexes));
+    lengths = malloc(src_size * sizeof(*lengths));
+    if (!cost || !indexes || !lengths)
+        goto out;
+
+    for (i = 0; i < src_size; i++) {
+        lengths[i] = match_finder_find(mf, WINDOW_SIZE + i, &index);
+        indexes[i] = index;
+    }
+
+    cost[src_size] = 0;
+    for (i = src_size; i-- > 0; ) {
+        cost[i] = cost[i + 1] + LITERAL_COST;
+        best_len = 1;
+
+        for (len = RLE_MIN_LENGTH; len <= lengths[i]; len++) {
+            if (cost[i + len] + MATCH_COST < cost[i]) {
+                cost[i] = cost[i + len] + MATCH_COST;
+                best_len = len;
+            }
+        }
+
+        /* Reuse the lengths array for the chosen token length */
+        lengths[i] = best_len;
+    }
+
+    for (i = 0; i < src_size && !w->overflow; i += lengths[i]) {
+        if (lengths[i] == 1)
+            lzss_write_literal(w, mf->data[WINDOW_SIZE + i]);
+        else
+            lzss_write_match(w, indexes[i], lengths[i]);
+    }
+
+    err = 0;
+out:
+    free(cost);
+    free(indexes);
+    free(lengths);
+    return err;
+}
+
+size_t lv_compress_ex(const uint8_t *src, size_t src_size,
+                      uint8_t *dst, size_t dst_size,
+                      const struct lv_compress_params *params)
+{
+    struct match_finder *mf;
+    struct lzss_writer w = {
+        .dst      = dst,
+        .dst_size = dst_size,
+    };
+    unsigned max_chain;
+    int err = 0;
+
+    /* Optimal parsing searches the whole window by default */
+    max_chain = params->max_chain;
+    if (!max_chain && params->parser == LV_COMPRESS_OPTIMAL)
+        max_chain = WINDOW_SIZE;
+    else if (!max_chain)
+        max_chain = DEFAULT_MAX_CHAIN;
+
+    mf = malloc(sizeof(*mf));
+    if (!mf)
+        return 0;
+    if (match_finder_init(mf, src, src_size, max_chain)) {
+        free(mf);
+        return 0;
+    }
+
+    /*
+     * Finding matches is the slow part. For large inputs find the matches
+     * for every position up front in parallel, and then parse serially.
+     * Greedy and lazy parsing skip the positions covered by each match,
+     * so finding matches everywhere is two to three times the work for
+     * them, which is only worth it with several threads.
+     */
+    if (src_size > MIN_SLICE_SIZE &&
+        ((params->parser == LV_COMPRESS_OPTIMAL && params->num_threads > 1) ||
+         params->num_threads >= MIN_THREADS_SKIPPING_PARSE))
+        err = find_matches_parallel(mf, params->num_threads);
+    if (err)
+        goto out;
+
+    switch (params->parser) {
+    case LV_COMPRESS_LAZY:
+        parse_lazy(mf, &w);
+        break;
+
+    case LV_COMPRESS_OPTIMAL:
+        err = parse_optimal(mf, &w);
+        break;
+
+    case LV_COMPRESS_GREEDY:
+    default:
+        parse_greedy(mf, &w);
+        break;
+    }
+
+out:
+    match_finder_free(mf);
+    free(mf);
+
+    return (err || w.overflow) ? 0 : w.offset;
+}
+
+size_t lv_compress(const uint8_t *src, size_t src_size,
+		   uint8_t *dst, size_t dst_size)
+{
+    const struct lv_compress_params params = {
+        .parser = LV_COMPRESS_GREEDY,
+    };
+
+    return lv_compress_ex(src, src_size, dst, dst_size, &params);
 }
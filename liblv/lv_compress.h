@@ -16,6 +16,7 @@
 #ifndef _LV_COMPRESS_H
 #define _LV_COMPRESS_H
 
+#include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 
@@ -28,6 +29,47 @@
  * using this scheme.
  */
 
+/** Compression parsing strategies. */
+enum {
+    /** Use the longest match at each position. */
+    LV_COMPRESS_GREEDY,
+
+    /**
+     * Use a literal instead of a match if the next position has a longer
+     * match. Slightly slower than greedy parsing, but usually smaller.
+     */
+    LV_COMPRESS_LAZY,
+
+    /**
+     * Choose the sequence of literals and matches with the smallest
+     * compressed size. This is the slowest strategy.
+     */
+    LV_COMPRESS_OPTIMAL,
+};
+
+/** Compression parameters. See \ref lv_compress_ex. */
+struct lv_compress_params {
+    /** Parsing strategy (LV_COMPRESS_*). */
+    unsigned    parser;
+
+    /**
+     * Maximum number of earlier positions to compare when searching for
+     * a match. Zero uses the default, which is the whole window for
+     * optimal parsing and 256 otherwise. Larger values may find longer
+     * matches at the cost of speed. The window is 4096 bytes, so values
+     * above that have no effect.
+     */
+    unsigned    max_chain;
+
+    /**
+     * Number of threads used to find matches. Zero or one compresses on
+     * the calling thread only. Multiple threads are only used for inputs
+     * over 16K, and for greedy or lazy parsing only with four or more
+     * threads. The output is the same regardless of the thread count.
+     */
+    unsigned    num_threads;
+};
+
 /**
  * Compress data using the LZSS compression scheme.
  *
@@ -35,21 +77,219 @@
  * \param src_size  Size of the source data to compress.
  * \param dst       Destination buffer to write compressed data to.
  * \param dst_size  Size of the destination buffer.
- * \returns         Size of the compressed data.
+ * \returns         Size of the compressed data, or 0 if the destination
+ *                  buffer is too small.
  */
 size_t lv_compress(const uint8_t *src, size_t src_size,
 		   uint8_t *dst, size_t dst_size);
 
 /**
- * Decompress LZSS encoded data.
+ * Compress data using the LZSS compression scheme with the given
+ * parameters. The compressed data is decompressed by \ref lv_decompress
+ * the same way regardless of the parameters.
+ *
+ * \param src       Source data to compress.
+ * \param src_size  Size of the source data to compress.
+ * \param dst       Destination buffer to write compressed data to.
+ * \param dst_size  Size of the destination buffer.
+ * \param params    Compression parameters.
+ * \returns         Size of the compressed data, or 0 if the destination
+ *                  buffer is too small.
+ */
+size_t lv_compress_ex(const uint8_t *src, size_t src_size,
+                      uint8_t *dst, size_t dst_size,
+                      const struct lv_compress_params *params);
+
+/**
+ * Decompress LZSS encoded data. Decompression stops once the destination
+ * buffer is full. The source data is bounds checked, so corrupt data
+ * cannot cause reads past the end of the source buffer.
  *
  * \param src      Compressed source data.
  * \param src_size Size of the compressed source data.
  * \param dst      Destination buffer to decompress into.
  * \param dst_size Size of the destination buffer.
+ * \returns        0 for success, or -1 if the source data ends before the
+ *                 destination buffer is full.
  */
-void lv_decompress(const uint8_t *src, size_t src_size,
-		   uint8_t *dst, size_t dst_size);
+int lv_decompress(const uint8_t *src, size_t src_size,
+		  uint8_t *dst, size_t dst_size);
+
+/** A single decompression in a batch. See \ref lv_decompress_batch. */
+struct lv_decompress_job {
+    /** Compressed source data. */
+    const uint8_t   *src;
+
+    /** Size of the compressed source data. */
+    size_t          src_size;
+
+    /** Destination buffer to decompress into. */
+    uint8_t         *dst;
+
+    /** Size of the destination buffer. */
+    size_t          dst_size;
+
+    /** Result of the decompression, as returned by \ref lv_decompress. */
+    int             err;
+};
+
+/**
+ * Decompress a batch of independent LZSS encoded buffers. Each thread
+ * decodes several of the buffers at once, interleaving them, which is
+ * faster than decompressing them one after another. This is intended for
+ * decompressing many small chunks.
+ *
+ * \param jobs        Decompressions to do. Each job's err field is set.
+ * \param num_jobs    Number of jobs.
+ * \param num_threads Number of threads to use. Zero or one decompresses
+ *                    on the calling thread only.
+ * \returns           0 if all of the jobs succeeded, or -1 if any failed.
+ */
+int lv_decompress_batch(struct lv_decompress_job *jobs, size_t num_jobs,
+                        unsigned num_threads);
+
+/**
+ * Incremental LZSS decoder state. This allows compressed data to be
+ * decompressed in pieces, without needing the whole of either the
+ * compressed or decompressed data in memory at once.
+ *
+ * Input is provided with \ref lv_decompress_stream_input and output is
+ * read with \ref lv_decompress_stream_read. Both may be done in any
+ * sized pieces. The stream does not know the decompressed size, so the
+ * caller is responsible for not reading past the end of the data.
+ */
+struct lv_decompress_stream {
+    /** Remaining unconsumed input. */
+    const uint8_t   *src;
+
+    /** Size of the remaining unconsumed input. */
+    size_t          src_size;
+
+    /** Total number of bytes output so far. */
+    size_t          total_out;
+
+    /** Ring buffer of the most recently output bytes. */
+    uint8_t         table[0x1000];
+
+    /** Table index the next output byte is written to. */
+    unsigned        table_index;
+
+    /** Current control byte. */
+    uint8_t         ctrl_byte;
+
+    /** Next bit of the control byte. 8 if a new control byte is needed. */
+    unsigned        bit;
+
+    /** First byte of a match token split across two input pieces. */
+    uint8_t         partial_byte;
+    bool            have_partial;
+
+    /** Table index and remaining length of a partially output match. */
+    unsigned        match_index;
+    unsigned        match_count;
+};
+
+/**
+ * Initialise an incremental decoder.
+ *
+ * \param stream   Decoder to initialise.
+ */
+void lv_decompress_stream_init(struct lv_decompress_stream *stream);
+
+/**
+ * Provide the next piece of compressed input to an incremental decoder.
+ * The data must remain valid until it has been consumed, which is when
+ * stream->src_size reaches zero.
+ *
+ * \param stream   Decoder.
+ * \param src      Compressed input data.
+ * \param src_size Size of the compressed input data.
+ */
+void lv_decompress_stream_input(struct lv_decompress_stream *stream,
+                                const uint8_t *src, size_t src_size);
+
+/**
+ * Read decompressed data from an incremental decoder. Decoding stops
+ * when either the destination buffer is full or the input runs out.
+ *
+ * \param stream   Decoder.
+ * \param dst      Destination buffer to decompress into.
+ * \param dst_size Size of the destination buffer.
+ * \returns        Number of bytes decompressed. This is less than dst_size
+ *                 only if more input is needed.
+ */
+size_t lv_decompress_stream_read(struct lv_decompress_stream *stream,
+                                 uint8_t *dst, size_t dst_size);
+
+/** A saved decoder state. See \ref lv_decompress_index. */
+struct lv_decompress_checkpoint {
+    /** Offset of the decoder's next input byte in the compressed data. */
+    size_t                      src_offset;
+
+    /** Decoder state. The stream's input pointer is not used. */
+    struct lv_decompress_stream stream;
+};
+
+/**
+ * Checkpoint index for random access into compressed data. The decoder
+ * state is saved every interval bytes of output, so a range of the
+ * decompressed data can be decoded starting from the nearest checkpoint
+ * rather than from the beginning. Each checkpoint holds a copy of the 4K
+ * decoder table, so the interval should be a good deal larger than that.
+ */
+struct lv_decompress_index {
+    /** Number of output bytes between checkpoints. */
+    size_t                          interval;
+
+    /** Total decompressed size covered by the index. */
+    size_t                          dst_size;
+
+    /** Checkpoints at output offsets 0, interval, 2 * interval, etc. */
+    struct lv_decompress_checkpoint *checkpoints;
+
+    /** Number of checkpoints. */
+    size_t                          num_checkpoints;
+};
+
+/**
+ * Build a checkpoint index for compressed data. This decompresses the
+ * whole of the data once.
+ *
+ * \param index    Index to build. Must be freed with
+ *                 \ref lv_decompress_index_free.
+ * \param src      Compressed source data.
+ * \param src_size Size of the compressed source data.
+ * \param dst_size Decompressed size of the data.
+ * \param interval Number of output bytes between checkpoints.
+ * \returns        0 for success, or -1 on failure.
+ */
+int lv_decompress_index_build(struct lv_decompress_index *index,
+                              const uint8_t *src, size_t src_size,
+                              size_t dst_size, size_t interval);
+
+/**
+ * Free a checkpoint index.
+ *
+ * \param index    Index to free.
+ */
+void lv_decompress_index_free(struct lv_decompress_index *index);
+
+/**
+ * Decompress a range of LZSS encoded data using a checkpoint index. Only
+ * the data from the nearest checkpoint before the range is decoded.
+ *
+ * \param index    Checkpoint index for the compressed data.
+ * \param src      Compressed source data the index was built from.
+ * \param src_size Size of the compressed source data.
+ * \param offset   Offset in the decompressed data to start at.
+ * \param dst      Destination buffer to decompress into.
+ * \param dst_size Number of bytes to decompress.
+ * \returns        0 for success, or -1 if the range is out of bounds or
+ *                 the source data ends early.
+ */
+int lv_decompress_range(const struct lv_decompress_index *index,
+                        const uint8_t *src, size_t src_size, size_t offset,
+                        uint8_t *dst, size_t dst_size);
 
 /** \} */
 
@@ -0,0 +1,60 @@
+/*
+ * This file is part of The Lost Vikings Library/Tools
+ *
+ * Ryan Mallon, 2016, <rmallon@gmail.com>
+ *
+ * To the extent possible under law, the author(s) have dedicated all
+ * copyright and related and neighboring rights to this software to
+ * the public domain worldwide. This software is distributed without
+ * any warranty.  You should have received a copy of the CC0 Public
+ * Domain Dedication along with this software. If not, see
+ *
+ * <http://creativecommons.org/publicdomain/zero/1.0/>.
+ *
+ */
+
+#include <sys/types.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "lv_hash.h"
+
+/*
+ * MurmurHash64A by Austin Appleby (public domain), reading the data as
+ * little endian so that the hash does not depend on the host.
+ */
+#define HASH_M      0xc6a4a7935bd1e995ULL
+#define HASH_R      47
+#define HASH_SEED   0x4c6f737456696b69ULL
+
+uint64_t lv_hash(const void *data, size_t size)
+{
+    const uint8_t *p = data, *end = p + (size & ~7);
+    uint64_t h = HASH_SEED ^ (size * HASH_M);
+    uint64_t k;
+    size_t i;
+
+    for (; p != end; p += 8) {
+        memcpy(&k, p, sizeof(k));
+        k = le64toh(k);
+
+        k *= HASH_M;
+        k ^= k >> HASH_R;
+        k *= HASH_M;
+
+        h ^= k;
+        h *= HASH_M;
+    }
+
+    /* Remaining bytes */
+    if (size & 7) {
+        for (i = 0; i < (size & 7); i++)
+            h ^= (uint64_t)p[i] << (i * 8);
+        h *= HASH_M;
+    }
+
+    h ^= h >> HASH_R;
+    h *= HASH_M;
+    h ^= h >> HASH_R;
+    return h;
+}
@@ -0,0 +1,40 @@
+/*
+ * This file is part of The Lost Vikings Library/Tools
+ *
+ * Ryan Mallon, 2016, <rmallon@gmail.com>
+ *
+ * To the extent possible under law, the author(s) have dedicated all
+ * copyright and related and neighboring rights to this software to
+ * the public domain worldwide. This software is distributed without
+ * any warranty.  You should have received a copy of the CC0 Public
+ * Domain Dedication along with this software. If not, see
+ *
+ * <http://creativecommons.org/publicdomain/zero/1.0/>.
+ *
+ */
+
+#ifndef _LV_HASH_H
+#define _LV_HASH_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * \defgroup lv_hash Content hashing
+ * \{
+ */
+
+/**
+ * Compute a fast 64-bit hash of some data. This is not a cryptographic
+ * hash, but is good enough to identify identical chunks. The result is the
+ * same on all hosts.
+ *
+ * \param data    Data to hash.
+ * \param size    Size of the data.
+ * \returns       Hash value.
+ */
+uint64_t lv_hash(const void *data, size_t size);
+
+/** \} */
+
+#endif /* _LV_HASH_H */
@@ -0,0 +1,403 @@
+/*
+ * This file is part of The Lost Vikings Library/Tools
+ *
+ * Ryan Mallon, 2016, <rmallon@gmail.com>
+ *
+ * To the extent possible under law, the author(s) have dedicated all
+ * copyright and related and neighboring rights to this software to
+ * the public domain worldwide. This software is distributed without
+ * any warranty.  You should have received a copy of the CC0 Public
+ * Domain Dedication along with this software. If not, see
+ *
+ * <http://creativecommons.org/publicdomain/zero/1.0/>.
+ *
+ */
+
+#define _GNU_SOURCE
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <endian.h>
+#include <errno.h>
+
+#include "lv_index.h"
+#include "lv_pack.h"
+#include "lv_hash.h"
+#include "buffer.h"
+
+/*
+ * Index file layout. All values are little endian.
+ *
+ *   header, with a hash of everything after it
+ *   one entry per chunk
+ *   hash index order, as one le32 chunk index per hash index entry
+ */
+#define INDEX_MAGIC         0x5849564c /* "LVIX" */
+#define INDEX_VERSION       1
+
+/* Header flags */
+#define INDEX_BLACKTHORNE   (1 << 0)
+#define INDEX_HASHES        (1 << 1)
+
+/* Entry flags */
+#define ENTRY_FLAG          (1 << 0)
+#define ENTRY_STORED        (1 << 1)
+
+struct index_header {
+    uint32_t    magic;
+    uint32_t    version;
+    uint32_t    flags;
+    uint32_t    num_chunks;
+    uint32_t    num_hash_entries;
+    uint32_t    mtime_nsec;
+    uint64_t    pack_size;
+    uint64_t    mtime_sec;
+    uint64_t    checksum;
+};
+
+struct index_entry {
+    uint32_t    start;
+    uint32_t    size;
+    uint32_t    decompressed_size;
+    uint32_t    flags;
+    uint64_t    raw_hash;
+    uint64_t    hash;
+    uint32_t    canonical;
+    uint32_t    reserved;
+};
+
+static char *index_filename(const char *filename)
+{
+    char *name;
+
+    name = malloc(strlen(filename) + sizeof(LV_INDEX_SUFFIX));
+    if (name)
+        sprintf(name, "%s%s", filename, LV_INDEX_SUFFIX);
+    return name;
+}
+
+static void put_header(uint8_t *p, const struct index_header *header)
+{
+    put_le32(&p[0], header->magic);
+    put_le32(&p[4], header->version);
+    put_le32(&p[8], header->flags);
+    put_le32(&p[12], header->num_chunks);
+    put_le32(&p[16], header->num_hash_entries);
+    put_le32(&p[20], header->mtime_nsec);
+    put_le64(&p[24], header->pack_size);
+    put_le64(&p[32], header->mtime_sec);
+    put_le64(&p[40], header->checksum);
+}
+
+static void get_header(const uint8_t *p, struct index_header *header)
+{
+    header->magic = get_le32(&p[0]);
+    header->version = get_le32(&p[4]);
+    header->flags = get_le32(&p[8]);
+    header->num_chunks = get_le32(&p[12]);
+    header->num_hash_entries = get_le32(&p[16]);
+    header->mtime_nsec = get_le32(&p[20]);
+    header->pack_size = get_le64(&p[24]);
+    header->mtime_sec = get_le64(&p[32]);
+    header->checksum = get_le64(&p[40]);
+}
+
+static void put_entry(uint8_t *p, const struct index_entry *entry)
+{
+    put_le32(&p[0], entry->start);
+    put_le32(&p[4], entry->size);
+    put_le32(&p[8], entry->decompressed_size);
+    put_le32(&p[12], entry->flags);
+    put_le64(&p[16], entry->raw_hash);
+    put_le64(&p[24], entry->hash);
+    put_le32(&p[32], entry->canonical);
+    put_le32(&p[36], 0);
+}
+
+static void get_entry(const uint8_t *p, struct index_entry *entry)
+{
+    entry->start = get_le32(&p[0]);
+    entry->size = get_le32(&p[4]);
+    entry->decompressed_size = get_le32(&p[8]);
+    entry->flags = get_le32(&p[12]);
+    entry->raw_hash = get_le64(&p[16]);
+    entry->hash = get_le64(&p[24]);
+    entry->canonical = get_le32(&p[32]);
+}
+
+static int fill_entry(struct lv_pack *pack, unsigned chunk_index,
+                      struct index_entry *entry)
+{
+    struct lv_chunk *chunk;
+    bool loaded;
+
+    /* Only load the chunk's header, and drop it again if it was unused */
+    loaded = pack->chunks[chunk_index].loaded;
+    chunk = lv_pack_get_chunk(pack, chunk_index);
+    if (!chunk)
+        return -EIO;
+
+    memset(entry, 0, sizeof(*entry));
+    entry->start = chunk->start;
+    entry->size = chunk->size;
+    entry->decompressed_size = chunk->decompressed_size;
+    if (chunk->flag)
+        entry->flags |= ENTRY_FLAG;
+    if (chunk->storage == LV_CHUNK_STORAGE_STORED)
+        entry->flags |= ENTRY_STORED;
+
+    if (pack->hash_index) {
+        entry->raw_hash = chunk->raw_hash;
+        entry->hash = chunk->hash;
+        entry->canonical = chunk->canonical;
+    }
+
+    if (!loaded)
+        lv_pack_release_chunk(pack, chunk);
+    return 0;
+}
+
+int lv_index_write(struct lv_pack *pack, const char *filename)
+{
+    struct index_header header;
+    struct index_entry entry;
+    struct stat s;
+    char *iname = NULL, *tmpname = NULL;
+    uint8_t *buf, *p;
+    size_t i, size;
+    FILE *fd;
+    int err;
+
+    if (!pack->fd_open)
+        return -EBADF;
+    if (fstat(pack->fd, &s) < 0)
+        return -errno;
+
+    /* The index must describe the pack file, not changes made in memory */
+    if ((size_t)s.st_size != pack->size)
+        return -ESTALE;
+    for (i = 0; i < pack->num_chunks; i++)
+        if (pack->chunks[i].replaced)
+            return -EINVAL;
+
+    memset(&header, 0, sizeof(header));
+    header.magic = INDEX_MAGIC;
+    header.version = INDEX_VERSION;
+    header.num_chunks = pack->num_chunks;
+    header.pack_size = pack->size;
+    header.mtime_sec = s.st_mtim.tv_sec;
+    header.mtime_nsec = s.st_mtim.tv_nsec;
+    if (pack->blackthorne)
+        header.flags |= INDEX_BLACKTHORNE;
+    if (pack->hash_index) {
+        header.flags |= INDEX_HASHES;
+        header.num_hash_entries = pack->num_hash_entries;
+    }
+
+    size = sizeof(struct index_header) +
+        pack->num_chunks * sizeof(struct index_entry) +
+        header.num_hash_entries * sizeof(uint32_t);
+    buf = malloc(size);
+    if (!buf)
+        return -ENOMEM;
+
+    p = buf + sizeof(struct index_header);
+    for (i = 0; i < pack->num_chunks; i++) {
+        err = fill_entry(pack, i, &entry);
+        if (err)
+            goto out;
+        put_entry(p, &entry);
+        p += sizeof(struct index_entry);
+    }
+
+    for (i = 0; i < header.num_hash_entries; i++) {
+        put_le32(p, pack->hash_index[i].chunk_index);
+        p += sizeof(uint32_t);
+    }
+
+    header.checksum = lv_hash(buf + sizeof(struct index_header),
+                              size - sizeof(struct index_header));
+    put_header(buf, &header);
+
+    /* Write a temporary file and rename it so readers never see half */
+    err = -ENOMEM;
+    iname = index_filename(filename);
+    if (!iname)
+        goto out;
+    tmpname = malloc(strlen(iname) + sizeof(".tmp"));
+    if (!tmpname)
+        goto out;
+    sprintf(tmpname, "%s.tmp", iname);
+
+    fd = fopen(tmpname, "wb");
+    if (!fd) {
+        err = -errno;
+        goto out;
+    }
+
+    err = 0;
+    if (fwrite(buf, size, 1, fd) != 1)
+        err = -EIO;
+    if (fclose(fd) != 0 && !err)
+        err = -EIO;
+    if (!err && rename(tmpname, iname) < 0)
+        err = -errno;
+    if (err)
+        unlink(tmpname);
+
+out:
+    free(tmpname);
+    free(iname);
+    free(buf);
+    return err;
+}
+
+static int parse_index(struct lv_pack *pack, const uint8_t *data, size_t size,
+                       const struct stat *s)
+{
+    struct index_header header;
+    struct index_entry entry;
+    struct lv_chunk_hash *hash_index = NULL;
+    struct lv_chunk *chunks, *chunk;
+    const uint8_t *p;
+    uint64_t end;
+    size_t i;
+    uint32_t chunk_index;
+
+    get_header(data, &header);
+    if (header.magic != INDEX_MAGIC || header.version != INDEX_VERSION ||
+        !!(header.flags & INDEX_BLACKTHORNE) != pack->blackthorne)
+        return -EINVAL;
+
+    if (header.pack_size != pack->size ||
+        header.mtime_sec != (uint64_t)s->st_mtim.tv_sec ||
+        header.mtime_nsec != (uint32_t)s->st_mtim.tv_nsec)
+        return -ESTALE;
+
+    if (header.num_chunks == 0 || header.num_hash_entries > header.num_chunks ||
+        (header.num_hash_entries && !(header.flags & INDEX_HASHES)))
+        return -EINVAL;
+    if (size != sizeof(struct index_header) +
+        (uint64_t)header.num_chunks * sizeof(struct index_entry) +
+        (uint64_t)header.num_hash_entries * sizeof(uint32_t))
+        return -EINVAL;
+    if (lv_hash(data + sizeof(struct index_header),
+                size - sizeof(struct index_header)) != header.checksum)
+        return -EINVAL;
+
+    chunks = calloc(header.num_chunks, sizeof(*chunks));
+    if (!chunks)
+        return -ENOMEM;
+
+    if (header.flags & INDEX_HASHES) {
+        /* A pack with no decompressible chunks has an empty hash index */
+        hash_index = malloc((header.num_hash_entries + 1) *
+                            sizeof(*hash_index));
+        if (!hash_index) {
+            free(chunks);
+            return -ENOMEM;
+        }
+    }
+
+    p = data + sizeof(struct index_header);
+    end = 0;
+    for (i = 0; i < header.num_chunks; i++) {
+        get_entry(p, &entry);
+        p += sizeof(struct index_entry);
+
+        /* Chunks must follow each other and cover the rest of the pack */
+        if ((i > 0 && entry.start != end) ||
+            (uint64_t)entry.start + entry.size > pack->size ||
+            (header.flags & INDEX_HASHES && entry.canonical > i))
+            goto fail;
+        end = (uint64_t)entry.start + entry.size;
+
+        chunk = &chunks[i];
+        chunk->index = i;
+        chunk->start = entry.start;
+        chunk->size = entry.size;
+        chunk->flag = !!(entry.flags & ENTRY_FLAG);
+        chunk->data_offset = pack->blackthorne ? 4 : 2;
+        chunk->decompressed_size = entry.decompressed_size;
+        chunk->storage = (entry.flags & ENTRY_STORED) ?
+            LV_CHUNK_STORAGE_STORED : LV_CHUNK_STORAGE_COMPRESSED;
+
+        if (header.flags & INDEX_HASHES) {
+            chunk->raw_hash = entry.raw_hash;
+            chunk->hash = entry.hash;
+            chunk->canonical = entry.canonical;
+            chunk->hashed = true;
+        }
+    }
+    if (end != pack->size)
+        goto fail;
+
+    for (i = 0; i < header.num_hash_entries; i++) {
+        chunk_index = get_le32(p);
+        p += sizeof(uint32_t);
+        if (chunk_index >= header.num_chunks)
+            goto fail;
+
+        hash_index[i].hash = chunks[chunk_index].hash;
+        hash_index[i].chunk_index = chunk_index;
+    }
+
+    pack->chunks = chunks;
+    pack->num_chunks = header.num_chunks;
+    pack->hash_index = hash_index;
+    pack->num_hash_entries = header.num_hash_entries;
+    pack->indexed = true;
+    return 0;
+
+fail:
+    free(hash_index);
+    free(chunks);
+    return -EINVAL;
+}
+
+int lv_index_load(struct lv_pack *pack, const char *filename)
+{
+    struct stat pack_stat, s;
+    void *data;
+    char *iname;
+    int fd, err;
+
+    if (fstat(pack->fd, &pack_stat) < 0)
+        return -errno;
+
+    iname = index_filename(filename);
+    if (!iname)
+        return -ENOMEM;
+    fd = open(iname, O_RDONLY);
+    free(iname);
+    if (fd < 0)
+        return -errno;
+
+    if (fstat(fd, &s) < 0) {
+        err = -errno;
+        close(fd);
+        return err;
+    }
+    if (s.st_size < sizeof(struct index_header)) {
+        close(fd);
+        return -EINVAL;
+    }
+
+    data = mmap(NULL, s.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    err = data == MAP_FAILED ? -errno : 0;
+    close(fd);
+    if (err)
+        return err;
+
+    err = parse_index(pack, data, s.st_size, &pack_stat);
+    munmap(data, s.st_size);
+    return err;
+}
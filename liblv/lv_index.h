@@ -0,0 +1,65 @@
+/*
+ * This file is part of The Lost Vikings Library/Tools
+ *
+ * Ryan Mallon, 2016, <rmallon@gmail.com>
+ *
+ * To the extent possible under law, the author(s) have dedicated all
+ * copyright and related and neighboring rights to this software to
+ * the public domain worldwide. This software is distributed without
+ * any warranty.  You should have received a copy of the CC0 Public
+ * Domain Dedication along with this software. If not, see
+ *
+ * <http://creativecommons.org/publicdomain/zero/1.0/>.
+ *
+ */
+
+#ifndef _LV_INDEX_H
+#define _LV_INDEX_H
+
+struct lv_pack;
+
+/**
+ * \defgroup lv_index Pack index
+ * \{
+ *
+ * A pack index is a sidecar file next to a pack file, named after the pack
+ * file with a ".lvidx" suffix. It records each chunk's offset, size,
+ * decompressed size and storage kind, and optionally the chunk content
+ * hashes. A pack loaded with \ref LV_PACK_LOAD_INDEX uses the index instead
+ * of reading the offset table and chunk headers, so no chunk data is read
+ * until a chunk is used.
+ *
+ * The index records the size and modification time of the pack file it
+ * describes, and is ignored if either has changed.
+ */
+
+/** Suffix added to the pack filename to get the index filename. */
+#define LV_INDEX_SUFFIX ".lvidx"
+
+/**
+ * Write the index for a pack. If the pack's chunks have been hashed with
+ * \ref lv_pack_hash_chunks the hashes are included. Chunks are loaded as
+ * needed to read their headers, and released again afterwards.
+ *
+ * \param pack        Pack file. No chunks may have been replaced.
+ * \param filename    Filename the pack was loaded from.
+ * \returns           0 for success, or a negative errno value.
+ */
+int lv_index_write(struct lv_pack *pack, const char *filename);
+
+/**
+ * Set up a pack's chunks from its index. This is used by
+ * \ref lv_pack_load_flags, and expects the pack file to be open but its
+ * chunks not yet set up.
+ *
+ * \param pack        Pack file.
+ * \param filename    Pack filename.
+ * \returns           0 for success, or a negative errno value if there is
+ *                    no usable index. -ESTALE is returned if the index is
+ *                    for a different version of the pack file.
+ */
+int lv_index_load(struct lv_pack *pack, const char *filename);
+
+/** \} */
+
+#endif /* _LV_INDEX_H */
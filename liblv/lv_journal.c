@@ -0,0 +1,526 @@
+/*
+ * This file is part of The Lost Vikings Library/Tools
+ *
+ * Ryan Mallon, 2016, <rmallon@gmail.com>
+ *
+ * To the extent possible under law, the author(s) have dedicated all
+ * copyright and related and neighboring rights to this software to
+ * the public domain worldwide. This software is distributed without
+ * any warranty.  You should have received a copy of the CC0 Public
+ * Domain Dedication along with this software. If not, see
+ *
+ * <http://creativecommons.org/publicdomain/zero/1.0/>.
+ *
+ */
+
+#include <sys/types.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include "lv_journal.h"
+#include "common.h"
+
+/*
+ * The journal is a machine local file, so it is written in native byte
+ * order. It is laid out as:
+ *
+ *   header
+ *   steps[num_steps]
+ *   payload[payload_size]
+ *   progress slot 0 (struct journal_progress + block data)
+ *   progress slot 1
+ *
+ * The header, steps and payload are written and synced before the file is
+ * changed. Each block of a move is written to a progress slot, and synced,
+ * before it is written to the file. The slots are used alternately so a
+ * torn progress write leaves the previous slot intact.
+ */
+#define JOURNAL_MAGIC       0x4a50564c /* "LVPJ" */
+#define PROGRESS_MAGIC      0x5250564c /* "LVPR" */
+#define JOURNAL_BLOCK_SIZE  (256 * 1024)
+
+struct journal_header {
+    uint32_t    magic;
+    uint32_t    num_steps;
+    uint64_t    final_size;
+    uint64_t    payload_size;
+    uint32_t    checksum;
+    uint32_t    reserved;
+};
+
+struct journal_progress {
+    uint32_t    magic;
+    uint32_t    step;
+    uint64_t    seq;
+
+    /* Bytes of the step which are done once this block is written */
+    uint64_t    done;
+
+    uint64_t    block_dst;
+    uint32_t    block_len;
+    uint32_t    checksum;
+};
+
+struct journal {
+    int         fd;
+    int         jfd;
+    const struct lv_journal_step *steps;
+    size_t      num_steps;
+    const uint8_t *payload;
+    uint64_t    final_size;
+    off_t       progress_offset;
+    uint64_t    seq;
+    uint8_t     *block;
+};
+
+/* FNV-1a, used to detect torn journal writes */
+static uint32_t checksum(uint32_t hash, const void *data, size_t size)
+{
+    const uint8_t *p = data;
+
+    while (size--) {
+        hash ^= *p++;
+        hash *= 16777619;
+    }
+    return hash;
+}
+
+#define CHECKSUM_INIT 2166136261u
+
+static int read_at(int fd, void *data, size_t size, off_t offset)
+{
+    ssize_t count;
+
+    while (size) {
+        count = pread(fd, data, size, offset);
+        if (count < 0 && errno == EINTR)
+            continue;
+        if (count < 0)
+            return -errno;
+        if (count == 0)
+            return -EIO;
+
+        data += count;
+        offset += count;
+        size -= count;
+    }
+
+    return 0;
+}
+
+static int write_at(int fd, const void *data, size_t size, off_t offset)
+{
+    ssize_t count;
+
+    while (size) {
+        count = pwrite(fd, data, size, offset);
+        if (count < 0 && errno == EINTR)
+            continue;
+        if (count < 0)
+            return -errno;
+
+        data += count;
+        offset += count;
+        size -= count;
+    }
+
+    return 0;
+}
+
+static int sync_fd(int fd)
+{
+    return fdatasync(fd) < 0 ? -errno : 0;
+}
+
+/* Sync the directory containing a file, so that creating or removing it is durable */
+static int sync_dir(const char *filename)
+{
+    char *dirname, *slash;
+    int fd, err = 0;
+
+    dirname = strdup(filename);
+    if (!dirname)
+        return -ENOMEM;
+
+    slash = strrchr(dirname, '/');
+    if (slash)
+        slash[slash == dirname ? 1 : 0] = '\0';
+    else
+        strcpy(dirname, ".");
+
+    fd = open(dirname, O_RDONLY | O_DIRECTORY);
+    if (fd >= 0) {
+        if (fsync(fd) < 0)
+            err = -errno;
+        close(fd);
+    }
+
+    free(dirname);
+    return err;
+}
+
+static char *journal_filename(const char *filename)
+{
+    char *name;
+
+    name = malloc(strlen(filename) + sizeof(".journal"));
+    if (name)
+        sprintf(name, "%s.journal", filename);
+    return name;
+}
+
+static uint32_t plan_checksum(const struct journal_header *header,
+                              const struct lv_journal_step *steps,
+                              const void *payload)
+{
+    struct journal_header h = *header;
+    uint32_t hash;
+
+    h.checksum = 0;
+    hash = checksum(CHECKSUM_INIT, &h, sizeof(h));
+    hash = checksum(hash, steps, header->num_steps * sizeof(*steps));
+    return checksum(hash, payload, header->payload_size);
+}
+
+static uint32_t progress_checksum(const struct journal_progress *progress,
+                                  const void *block)
+{
+    struct journal_progress p = *progress;
+
+    p.checksum = 0;
+    return checksum(checksum(CHECKSUM_INIT, &p, sizeof(p)), block,
+                    progress->block_len);
+}
+
+static off_t progress_slot_offset(struct journal *j, uint64_t seq)
+{
+    return j->progress_offset +
+        (seq & 1) * (sizeof(struct journal_progress) + JOURNAL_BLOCK_SIZE);
+}
+
+/*
+ * Move one block of a step. The block is journalled first, so that the
+ * move can be finished even if the block's source is partly overwritten.
+ */
+static int move_block(struct journal *j, size_t step_index, uint64_t offset,
+                      size_t len, uint64_t done)
+{
+    const struct lv_journal_step *step = &j->steps[step_index];
+    struct journal_progress progress;
+    off_t slot;
+    int err;
+
+    err = read_at(j->fd, j->block, len, step->src + offset);
+    if (err)
+        return err;
+
+    memset(&progress, 0, sizeof(progress));
+    progress.magic = PROGRESS_MAGIC;
+    progress.step = step_index;
+    progress.seq = ++j->seq;
+    progress.done = done;
+    progress.block_dst = step->dst + offset;
+    progress.block_len = len;
+    progress.checksum = progress_checksum(&progress, j->block);
+
+    slot = progress_slot_offset(j, progress.seq);
+    err = write_at(j->jfd, &progress, sizeof(progress), slot);
+    if (!err)
+        err = write_at(j->jfd, j->block, len, slot + sizeof(progress));
+    if (!err)
+        err = sync_fd(j->jfd);
+    if (err)
+        return err;
+
+    /* The file must be updated before the other slot can be reused */
+    err = write_at(j->fd, j->block, len, progress.block_dst);
+    if (!err)
+        err = sync_fd(j->fd);
+    return err;
+}
+
+/*
+ * Move a range of the file in blocks. Moves towards the end of the file go
+ * backwards so that the source is not overwritten before it is read.
+ */
+static int do_move(struct journal *j, size_t step_index, uint64_t done)
+{
+    const struct lv_journal_step *step = &j->steps[step_index];
+    uint64_t offset;
+    size_t len;
+    int err;
+
+    while (done < step->len) {
+        len = min(step->len - done, (uint64_t)JOURNAL_BLOCK_SIZE);
+        if (step->dst > step->src)
+            offset = step->len - done - len;
+        else
+            offset = done;
+
+        err = move_block(j, step_index, offset, len, done + len);
+        if (err)
+            return err;
+        done += len;
+    }
+
+    return 0;
+}
+
+/* Do the steps from the given step and progress through that step */
+static int do_steps(struct journal *j, size_t step_index, uint64_t done)
+{
+    const struct lv_journal_step *step;
+    int err;
+
+    for (; step_index < j->num_steps; step_index++, done = 0) {
+        step = &j->steps[step_index];
+
+        if (step->type == LV_JOURNAL_MOVE) {
+            if (step->src != step->dst) {
+                err = do_move(j, step_index, done);
+                if (err)
+                    return err;
+            }
+        } else {
+            err = write_at(j->fd, j->payload + step->src, step->len,
+                           step->dst);
+            if (err)
+                return err;
+        }
+    }
+
+    if (ftruncate(j->fd, j->final_size) < 0)
+        return -errno;
+    return fsync(j->fd) < 0 ? -errno : 0;
+}
+
+static int finish_journal(struct journal *j, const char *filename,
+                          const char *jname)
+{
+    int err;
+
+    close(j->jfd);
+    j->jfd = -1;
+
+    if (unlink(jname) < 0)
+        return -errno;
+
+    err = sync_dir(filename);
+    return err;
+}
+
+int lv_journal_apply(const char *filename, const struct lv_journal_step *steps,
+                     size_t num_steps, const void *payload,
+                     size_t payload_size, uint64_t final_size)
+{
+    struct journal_header header;
+    struct journal j;
+    char *jname;
+    int err;
+
+    memset(&j, 0, sizeof(j));
+    j.fd = -1;
+    j.jfd = -1;
+
+    jname = journal_filename(filename);
+    j.block = malloc(JOURNAL_BLOCK_SIZE);
+    if (!jname || !j.block) {
+        err = -ENOMEM;
+        goto out;
+    }
+
+    j.fd = open(filename, O_RDWR);
+    if (j.fd < 0) {
+        err = -errno;
+        goto out;
+    }
+
+    /* An existing journal is an unfinished update */
+    j.jfd = open(jname, O_RDWR | O_CREAT | O_EXCL, 0644);
+    if (j.jfd < 0) {
+        err = -errno;
+        goto out;
+    }
+
+    memset(&header, 0, sizeof(header));
+    header.magic = JOURNAL_MAGIC;
+    header.num_steps = num_steps;
+    header.final_size = final_size;
+    header.payload_size = payload_size;
+    header.checksum = plan_checksum(&header, steps, payload);
+
+    j.steps = steps;
+    j.num_steps = num_steps;
+    j.payload = payload;
+    j.final_size = final_size;
+    j.progress_offset = sizeof(header) + num_steps * sizeof(*steps) +
+        payload_size;
+
+    err = write_at(j.jfd, &header, sizeof(header), 0);
+    if (!err)
+        err = write_at(j.jfd, steps, num_steps * sizeof(*steps),
+                       sizeof(header));
+    if (!err)
+        err = write_at(j.jfd, payload, payload_size,
+                       sizeof(header) + num_steps * sizeof(*steps));
+    if (!err)
+        err = sync_fd(j.jfd);
+    if (!err)
+        err = sync_dir(filename);
+    if (err)
+        goto out;
+
+    err = do_steps(&j, 0, 0);
+    if (!err)
+        err = finish_journal(&j, filename, jname);
+
+out:
+    if (j.jfd >= 0)
+        close(j.jfd);
+    if (j.fd >= 0)
+        close(j.fd);
+    free(j.block);
+    free(jname);
+    return err;
+}
+
+/* Find the most recent valid progress slot, if any */
+static int read_progress(struct journal *j, struct journal_progress *r_progress)
+{
+    struct journal_progress progress;
+    bool found = false;
+    uint64_t seq;
+    int err;
+
+    for (seq = 0; seq < 2; seq++) {
+        err = read_at(j->jfd, &progress, sizeof(progress),
+                      progress_slot_offset(j, seq));
+        if (err || progress.magic != PROGRESS_MAGIC ||
+            progress.block_len > JOURNAL_BLOCK_SIZE ||
+            progress.step >= j->num_steps ||
+            (progress.seq & 1) != seq)
+            continue;
+
+        err = read_at(j->jfd, j->block, progress.block_len,
+                      progress_slot_offset(j, seq) + sizeof(progress));
+        if (err || progress_checksum(&progress, j->block) != progress.checksum)
+            continue;
+
+        if (!found || progress.seq > r_progress->seq) {
+            *r_progress = progress;
+            found = true;
+        }
+    }
+
+    if (!found)
+        return 0;
+
+    /* Reload the block for the chosen slot */
+    err = read_at(j->jfd, j->block, r_progress->block_len,
+                  progress_slot_offset(j, r_progress->seq) +
+                  sizeof(*r_progress));
+    return err ? err : 1;
+}
+
+int lv_journal_recover(const char *filename)
+{
+    struct journal_progress progress;
+    struct journal_header header;
+    struct lv_journal_step *steps = NULL;
+    uint8_t *payload = NULL;
+    struct journal j;
+    size_t step_index = 0;
+    uint64_t done = 0;
+    char *jname;
+    int err;
+
+    memset(&j, 0, sizeof(j));
+    j.fd = -1;
+
+    jname = journal_filename(filename);
+    if (!jname)
+        return -ENOMEM;
+
+    j.jfd = open(jname, O_RDWR);
+    if (j.jfd < 0) {
+        err = errno == ENOENT ? 0 : -errno;
+        goto out;
+    }
+
+    /*
+     * An incomplete plan means the file was never changed, so the update
+     * is simply discarded.
+     */
+    err = read_at(j.jfd, &header, sizeof(header), 0);
+    if (err || header.magic != JOURNAL_MAGIC ||
+        header.num_steps > SIZE_MAX / sizeof(*steps) ||
+        header.payload_size > SIZE_MAX)
+        goto discard;
+
+    steps = malloc(header.num_steps * sizeof(*steps) + 1);
+    payload = malloc(header.payload_size + 1);
+    j.block = malloc(JOURNAL_BLOCK_SIZE);
+    if (!steps || !payload || !j.block) {
+        err = -ENOMEM;
+        goto out;
+    }
+
+    if (read_at(j.jfd, steps, header.num_steps * sizeof(*steps),
+                sizeof(header)) ||
+        read_at(j.jfd, payload, header.payload_size,
+                sizeof(header) + header.num_steps * sizeof(*steps)) ||
+        plan_checksum(&header, steps, payload) != header.checksum)
+        goto discard;
+
+    j.fd = open(filename, O_RDWR);
+    if (j.fd < 0) {
+        err = -errno;
+        goto out;
+    }
+
+    j.steps = steps;
+    j.num_steps = header.num_steps;
+    j.payload = payload;
+    j.final_size = header.final_size;
+    j.progress_offset = sizeof(header) + header.num_steps * sizeof(*steps) +
+        header.payload_size;
+
+    err = read_progress(&j, &progress);
+    if (err < 0)
+        goto out;
+    if (err) {
+        /* Redo the last journalled block, then carry on after it */
+        err = write_at(j.fd, j.block, progress.block_len, progress.block_dst);
+        if (err)
+            goto out;
+        j.seq = progress.seq;
+        step_index = progress.step;
+        done = progress.done;
+    }
+
+    err = do_steps(&j, step_index, done);
+    if (err)
+        goto out;
+
+discard:
+    err = finish_journal(&j, filename, jname);
+    if (!err)
+        err = 1;
+
+out:
+    if (j.jfd >= 0)
+        close(j.jfd);
+    if (j.fd >= 0)
+        close(j.fd);
+    free(j.block);
+    free(payload);
+    free(steps);
+    free(jname);
+    return err;
+}
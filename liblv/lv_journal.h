@@ -0,0 +1,95 @@
+/*
+ * This file is part of The Lost Vikings Library/Tools
+ *
+ * Ryan Mallon, 2016, <rmallon@gmail.com>
+ *
+ * To the extent possible under law, the author(s) have dedicated all
+ * copyright and related and neighboring rights to this software to
+ * the public domain worldwide. This software is distributed without
+ * any warranty.  You should have received a copy of the CC0 Public
+ * Domain Dedication along with this software. If not, see
+ *
+ * <http://creativecommons.org/publicdomain/zero/1.0/>.
+ *
+ */
+
+#ifndef _LV_JOURNAL_H
+#define _LV_JOURNAL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * \defgroup lv_journal Journalled file updates
+ * \{
+ *
+ * Crash safe in-place updates of a file. An update is a list of steps
+ * which move ranges of the file or write new data into it. The steps are
+ * recorded in a journal file next to the file before the file is changed.
+ * If the update is interrupted it is finished by \ref lv_journal_recover.
+ *
+ * The journal holds the new data and the block currently being moved, so
+ * it stays small even when a large part of the file is moved.
+ */
+
+/** Step types. */
+enum {
+    /** Move len bytes of the file from offset src to offset dst. */
+    LV_JOURNAL_MOVE,
+
+    /** Write len bytes of the payload from offset src to file offset dst. */
+    LV_JOURNAL_WRITE,
+};
+
+/** A single step of a journalled update. */
+struct lv_journal_step {
+    /** Step type (LV_JOURNAL_*). */
+    uint32_t         type;
+
+    /** Unused, must be zero. */
+    uint32_t         reserved;
+
+    /** Source offset in the file for moves, or in the payload for writes. */
+    uint64_t         src;
+
+    /** Destination offset in the file. */
+    uint64_t         dst;
+
+    /** Number of bytes. */
+    uint64_t         len;
+};
+
+/**
+ * Apply an update to a file. The steps are done in order. A move's source
+ * must not have been overwritten by an earlier step, but a move's source
+ * and destination may overlap. The file is truncated to final_size once
+ * all of the steps are done.
+ *
+ * If this fails the journal is left in place so that the update can be
+ * finished by \ref lv_journal_recover.
+ *
+ * \param filename     File to update. It must not have an unfinished update.
+ * \param steps        Steps to do.
+ * \param num_steps    Number of steps.
+ * \param payload      Data for the write steps.
+ * \param payload_size Size of the payload.
+ * \param final_size   Size of the file after the update.
+ * \returns            0 for success, or a negative errno value.
+ */
+int lv_journal_apply(const char *filename, const struct lv_journal_step *steps,
+                     size_t num_steps, const void *payload,
+                     size_t payload_size, uint64_t final_size);
+
+/**
+ * Finish an interrupted update of a file. An update whose journal was not
+ * completely written is discarded, since the file was not changed yet.
+ *
+ * \param filename    File to recover.
+ * \returns           0 if there was nothing to recover, 1 if an update was
+ *                    finished or discarded, or a negative errno value.
+ */
+int lv_journal_recover(const char *filename);
+
+/** \} */
+
+#endif /* _LV_JOURNAL_H */
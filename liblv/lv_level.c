@@ -20,11 +20,56 @@
 #include "lv_level.h"
 #include "lv_sprite.h"
 #include "lv_pack.h"
+#include "lv_resource.h"
+#include "lv_workqueue.h"
 #include "lv_debug.h"
 
 #include "buffer.h"
 #include "common.h"
 
+/* Maximum number of palette chunks used by a level */
+#define MAX_LEVEL_PALETTES  16
+
+/* Default maximum number of threads used to decompress a level's chunks */
+#define LEVEL_LOAD_THREADS  4
+
+/* A map being decompressed directly into the level's arena */
+struct map_job {
+    struct lv_chunk *chunk;
+    uint8_t         *dst;
+    size_t          size;
+    uint16_t        **map;
+    int             err;
+};
+
+/*
+ * Chunks used by a level. The level header is parsed first to find them
+ * so that they can be decompressed in parallel before they are loaded.
+ */
+struct level_load {
+    unsigned        chunk_map, chunk_bg_map, chunk_prefabs, chunk_object_db;
+
+    uint16_t        palettes[MAX_LEVEL_PALETTES];
+    uint8_t         base_colors[MAX_LEVEL_PALETTES];
+    size_t          num_palettes;
+
+    uint16_t        unpacked_sets[LV_MAX_SPRITE16_SETS];
+    size_t          num_unpacked_sets;
+
+    uint16_t        sprite32_sets[LV_MAX_SPRITE32_SETS];
+    size_t          num_sprite32_sets;
+
+    /* Chunks referenced from the cache while the level is loaded */
+    unsigned        chunks[MAX_LEVEL_PALETTES + LV_MAX_SPRITE16_SETS +
+                           LV_MAX_SPRITE32_SETS + 2];
+    const uint8_t   *chunk_data[MAX_LEVEL_PALETTES + LV_MAX_SPRITE16_SETS +
+                                LV_MAX_SPRITE32_SETS + 2];
+    size_t          num_chunks;
+
+    struct map_job  map_jobs[2];
+    size_t          num_map_jobs;
+};
+
 /* These are hardcoded in VIKINGS.EXE */
 static const struct lv_level_info lv_level_info[] = {
     /* World 1 - Spaceship */
@@ -92,6 +137,13 @@ static const struct lv_level_info bt_level_info[] = {
     {0x075, 0xffff},
 };
 
+size_t lv_level_get_num_levels(struct lv_pack *pack)
+{
+    if (pack->blackthorne)
+        return ARRAY_SIZE(bt_level_info);
+    return ARRAY_SIZE(lv_level_info);
+}
+
 const struct lv_level_info *lv_level_get_info(struct lv_pack *pack,
                                               unsigned level_num)
 {
@@ -119,6 +171,11 @@ static int add_object(struct lv_level *level, unsigned type,
 {
     struct lv_object *obj;
 
+    if (level->num_objects == ARRAY_SIZE(level->objects)) {
+        level->warnings |= LV_LEVEL_WARN_OBJECTS;
+        return -1;
+    }
+
     obj = &level->objects[level->num_objects];
     obj->type   = type;
     obj->xoff   = xoff;
@@ -139,57 +196,74 @@ static int add_viking(struct lv_level *level, unsigned type,
     return add_object(level, type, xoff, yoff, 32, 36, flags, 0);
 }
 
-static int load_map(struct lv_pack *pack, struct lv_level *level,
-                    unsigned chunk_index, uint16_t width, uint16_t height,
-                    uint16_t **map)
+static void decompress_map(void *arg)
+{
+    struct map_job *job = arg;
+
+    job->err = lv_decompress_chunk_into(job->chunk, job->dst, job->size);
+}
+
+static int queue_map(struct lv_pack *pack, struct lv_level *level,
+                     struct level_load *ld, struct lv_workqueue *wq,
+                     unsigned chunk_index, uint16_t width, uint16_t height,
+                     uint16_t **map)
 {
     struct lv_chunk *chunk;
-    uint8_t *data;
-    uint16_t *tmp;
-    size_t map_size;
+    struct map_job *job;
+    size_t map_size, size;
+    uint8_t *dst;
 
     map_size = width * height * sizeof(uint16_t);
 
     chunk = lv_pack_get_chunk(pack, chunk_index);
-    lv_decompress_chunk(chunk, &data);
-    *map = (uint16_t *)data;
+    if (!chunk) {
+        level->warnings |= LV_LEVEL_WARN_CHUNKS;
+        return -1;
+    }
 
-    if (chunk->decompressed_size < map_size) {
+    /* Allocate the final map size up front and decompress directly to it */
+    size = lv_decompress_chunk_size(chunk);
+    dst = lv_arena_alloc(level->arena, max(map_size, size));
+    if (!dst)
+        return -1;
+
+    if (size < map_size) {
+        level->warnings |= LV_LEVEL_WARN_MAP_SIZE;
         /*
          * Some maps don't have the right size for some reason.
          * Try to fix it up.
          */
-        lv_debug(LV_DEBUG_LEVEL, "Warning: map data too small (%d < %d bytes)",
-                 chunk->decompressed_size, map_size);
-        tmp = realloc(*map, map_size);
-        if (!tmp) {
-            free(*map);
-            return -1;
-        }
-
-        memset((uint8_t *)tmp + chunk->decompressed_size, 0,
-               map_size - chunk->decompressed_size);
-        *map = tmp;
+        lv_debug(LV_DEBUG_LEVEL, "Warning: map data too small (%zd < %zd bytes)",
+                 size, map_size);
+        memset(dst + size, 0, map_size - size);
     }
 
+    job = &ld->map_jobs[ld->num_map_jobs++];
+    job->chunk = chunk;
+    job->dst = dst;
+    job->size = size;
+    job->map = map;
+    if (lv_workqueue_add(wq, decompress_map, job))
+        decompress_map(job);
+
     return 0;
 }
 
-int lv_load_tile_prefabs(struct lv_pack *pack,
+int lv_load_tile_prefabs(struct lv_pack *pack, struct lv_arena *arena,
 			 struct lv_tile_prefab **r_prefabs,
 			 size_t *r_num_prefabs, unsigned chunk_index)
 {
-    struct lv_chunk *chunk;
     struct lv_tile_prefab *prefabs;
-    size_t num_prefabs;
+    size_t num_prefabs, size;
     struct buffer buf;
-    uint8_t *data;
+    const uint8_t *data;
     uint16_t val;
     int i, j, base;
 
-    chunk = lv_pack_get_chunk(pack, chunk_index);
-    lv_decompress_chunk(chunk, &data);
-    buffer_init_from_data(&buf, data, chunk->decompressed_size);
+    data = lv_pack_cache_get(pack, chunk_index, &size);
+    if (!data)
+        return -1;
+    buffer_init_from_data(&buf, (void *)data, size);
 
     /*
      * Each prefab is 8 bytes long:
@@ -199,8 +273,12 @@ int lv_load_tile_prefabs(struct lv_pack *pack,
      *   [04] Lower left tile
      *   [08] Lower right tile
      */
-    num_prefabs = chunk->decompressed_size / 8;
-    prefabs = calloc(num_prefabs, sizeof(*prefabs));
+    num_prefabs = size / 8;
+    prefabs = lv_arena_calloc(arena, num_prefabs, sizeof(*prefabs));
+    if (!prefabs) {
+        lv_pack_cache_put(pack, chunk_index);
+        return -1;
+    }
 
     for (i = 0; i < num_prefabs; i++) {
         for (j = 0; j < 4; j++) {
@@ -217,7 +295,7 @@ int lv_load_tile_prefabs(struct lv_pack *pack,
         }
     }
 
-    free(data);
+    lv_pack_cache_put(pack, chunk_index);
 
     *r_prefabs = prefabs;
     *r_num_prefabs = num_prefabs;
@@ -225,8 +303,43 @@ int lv_load_tile_prefabs(struct lv_pack *pack,
     return 0;
 }
 
+/* Keep a reference to a shared resource until the level is freed */
+static struct lv_resource *borrow_resource(struct lv_pack *pack,
+                                           struct lv_level *level,
+                                           struct lv_resource *res)
+{
+    if (!res)
+        return NULL;
+
+    if (level->num_resources == ARRAY_SIZE(level->resources)) {
+        lv_resource_put(pack, res);
+        return NULL;
+    }
+
+    level->resources[level->num_resources++] = res;
+    return res;
+}
+
+static int load_prefabs(struct lv_pack *pack, struct lv_level *level,
+                        unsigned chunk_index)
+{
+    struct lv_resource *res;
+
+    /* Prefab tables are shared by every level in a world */
+    res = borrow_resource(pack, level,
+                          lv_resource_get_prefabs(pack, chunk_index));
+    if (!res) {
+        level->warnings |= LV_LEVEL_WARN_CHUNKS;
+        return -1;
+    }
+
+    level->prefabs = res->prefabs;
+    level->num_prefabs = res->num_prefabs;
+    return 0;
+}
+
 static int load_lv_header(struct lv_pack *pack, struct lv_level *level,
-                          struct buffer *buf)
+                          struct level_load *ld, struct buffer *buf)
 {
     uint16_t width, height, chunk_map, chunk_tileset, chunk_prefabs,
         vikings_xoff, vikings_yoff, vikings_flags, dummy_16;
@@ -286,9 +399,8 @@ static int load_lv_header(struct lv_pack *pack, struct lv_level *level,
     lv_debug(LV_DEBUG_LEVEL, "  Chunk tileset: %.4x", chunk_tileset);
     lv_debug(LV_DEBUG_LEVEL, "  Chunk prefabs: %.4x", chunk_prefabs);
 
-    load_map(pack, level, chunk_map, level->width, level->height, &level->map);
-    lv_load_tile_prefabs(pack, &level->prefabs, &level->num_prefabs,
-			 chunk_prefabs);
+    ld->chunk_map     = chunk_map;
+    ld->chunk_prefabs = chunk_prefabs;
 
     /*
      * The start position selector either selects from a bunch of
@@ -381,46 +493,61 @@ static int load_objects(struct lv_level *level, struct buffer *buf)
     return 0;
 }
 
-static int load_palette(struct lv_pack *pack, struct lv_level *level,
-                        struct buffer *buf)
+static int parse_palettes(struct lv_level *level, struct level_load *ld,
+                          struct buffer *buf)
 {
-    struct lv_chunk *chunk;
-    unsigned base, size;
     uint16_t chunk_index;
     uint8_t base_color;
-    uint8_t *data;
 
     /*
      * Entries are 3-bytes (Blackthorne limits to 8 entries)
      *   [00] u16: Palette chunk index - 0xffff ends
      *   [02]  u8: Base color
      */
-    lv_debug(LV_DEBUG_LEVEL, "Loading palettes:");
     while (1) {
         buffer_get_le16(buf, &chunk_index);
         if (chunk_index == 0xffff)
             break;
         buffer_get_u8(buf, &base_color);
-
-        chunk = lv_pack_get_chunk(pack, chunk_index);
-        if (!chunk)
+        if (ld->num_palettes == ARRAY_SIZE(ld->palettes)) {
+            level->warnings |= LV_LEVEL_WARN_PALETTES;
             continue;
+        }
 
-        lv_decompress_chunk(chunk, &data);
+        ld->palettes[ld->num_palettes] = chunk_index;
+        ld->base_colors[ld->num_palettes] = base_color;
+        ld->num_palettes++;
+    }
 
-        lv_debug(LV_DEBUG_LEVEL, "  Chunk %.4x, base_color=%02x (%3zd colors)",
-                 chunk_index, base_color, chunk->decompressed_size / 3);
+    return 0;
+}
 
-        chunk = lv_pack_get_chunk(pack, chunk_index);
-        lv_decompress_chunk(chunk, &data);
+static int load_palettes(struct lv_pack *pack, struct lv_level *level,
+                         struct level_load *ld)
+{
+    const uint8_t *data;
+    unsigned base;
+    size_t size;
+    int i;
 
-        base = base_color * 3;
-        size = chunk->decompressed_size;
+    lv_debug(LV_DEBUG_LEVEL, "Loading palettes:");
+    for (i = 0; i < ld->num_palettes; i++) {
+        /* Palettes are shared by every level in a world */
+        data = lv_pack_cache_get(pack, ld->palettes[i], &size);
+        if (!data) {
+            level->warnings |= LV_LEVEL_WARN_CHUNKS;
+            continue;
+        }
+
+        lv_debug(LV_DEBUG_LEVEL, "  Chunk %.4x, base_color=%02x (%3zd colors)",
+                 ld->palettes[i], ld->base_colors[i], size / 3);
+
+        base = ld->base_colors[i] * 3;
         if (base + size > sizeof(level->palette))
             size = sizeof(level->palette) - base;
 
         memcpy(&level->palette[base], data, size);
-        free(data);
+        lv_pack_cache_put(pack, ld->palettes[i]);
     }
 
     return 0;
@@ -517,11 +644,10 @@ static int load_raw_sprite_sets(struct lv_pack *pack, struct lv_level *level,
     return 0;
 }
 
-static int load_unpacked_sprite_sets(struct lv_pack *pack,
-                                     struct lv_level *level, struct buffer *buf)
+static int parse_unpacked_sprite_sets(struct lv_level *level,
+                                      struct level_load *ld,
+                                      struct buffer *buf)
 {
-    struct lv_sprite_set *set;
-    struct lv_chunk *chunk;
     uint16_t chunk_index, a, b;
 
     /*
@@ -532,41 +658,66 @@ static int load_unpacked_sprite_sets(struct lv_pack *pack,
      *
      * The maximum combined data size of all chunks is 0x7000 bytes.
      */
-    lv_debug(LV_DEBUG_LEVEL, "Loading unpacked sprite sets:");
+    lv_debug(LV_DEBUG_LEVEL, "Parsing unpacked sprite sets:");
     while (1) {
         buffer_get_le16(buf, &chunk_index);
         if (chunk_index == 0xffff)
             break;
         buffer_get_le16(buf, &a);
         buffer_get_le16(buf, &b);
+        if (ld->num_unpacked_sets == ARRAY_SIZE(ld->unpacked_sets)) {
+            level->warnings |= LV_LEVEL_WARN_SPRITE_SETS;
+            continue;
+        }
+
+        lv_debug(LV_DEBUG_LEVEL, "  [%.2zx] chunk %03x: %.4x:%.4x",
+                 ld->num_unpacked_sets, chunk_index, a, b);
 
-        /* Load the set */
+        ld->unpacked_sets[ld->num_unpacked_sets++] = chunk_index;
+    }
+
+    return 0;
+}
+
+static int load_unpacked_sprite_sets(struct lv_pack *pack,
+                                     struct lv_level *level,
+                                     struct level_load *ld)
+{
+    struct lv_sprite_set *set;
+    const uint8_t *data;
+    size_t size;
+    int i;
+
+    for (i = 0; i < ld->num_unpacked_sets; i++) {
+        /*
+         * Load the set. The data is shared by every level in the world,
+         * so borrow it from the pack's cache.
+         */
         set = &level->sprite_unpacked_sets[level->num_sprite_unpacked_sets];
-        chunk = lv_pack_get_chunk(pack, chunk_index);
-        lv_decompress_chunk(chunk, &set->planar_data);
+        data = lv_pack_cache_get(pack, ld->unpacked_sets[i], &size);
+        if (!data) {
+            level->warnings |= LV_LEVEL_WARN_CHUNKS;
+            continue;
+        }
+        set->planar_data = (uint8_t *)data;
 
         /*
          * Number of sprites is initialised later when the sprite
          * size is known.
          */
-        set->chunk_index = chunk_index;
-        set->data_size = chunk->decompressed_size;
+        set->chunk_index = ld->unpacked_sets[i];
+        set->data_size = size;
         set->num_sprites = 0;
 
-        lv_debug(LV_DEBUG_LEVEL, "  [%.2zx] chunk %03x: %.4x:%.4x",
-		 level->num_sprite_unpacked_sets, set->chunk_index, a, b);
-
         level->num_sprite_unpacked_sets++;
     }
 
     return 0;
 }
 
-static int load_sprite32_sets(struct lv_pack *pack, struct lv_level *level,
-                              struct buffer *buf)
+static int parse_sprite32_sets(struct lv_level *level, struct level_load *ld,
+                               struct buffer *buf)
 {
-    struct lv_sprite_set *set;
-    struct lv_chunk *chunk;
     uint16_t chunk_index;
     uint8_t a, b, c;
 
@@ -577,7 +728,7 @@ static int load_sprite32_sets(struct lv_pack *pack, struct lv_level *level,
      *   [03]  u8: Unknown
      *   [04]  u8: Unknown
      */
-    lv_debug(LV_DEBUG_LEVEL, "Loading 32x32 sprite sets:");
+    lv_debug(LV_DEBUG_LEVEL, "Parsing 32x32 sprite sets:");
     while (1) {
         buffer_get_le16(buf, &chunk_index);
         if (chunk_index == 0xffff)
@@ -585,16 +736,43 @@ static int load_sprite32_sets(struct lv_pack *pack, struct lv_level *level,
         buffer_get_u8(buf, &a);
         buffer_get_u8(buf, &b);
         buffer_get_u8(buf, &c);
+        if (ld->num_sprite32_sets == ARRAY_SIZE(ld->sprite32_sets)) {
+            level->warnings |= LV_LEVEL_WARN_SPRITE_SETS;
+            continue;
+        }
 
-        /* Load the set */
-        set = &level->sprite32_sets[level->num_sprite32_sets];
-        chunk = lv_pack_get_chunk(pack, chunk_index);
-        lv_sprite_load_set(set, LV_SPRITE_FORMAT_PACKED32, 32, 32, chunk);
+        lv_debug(LV_DEBUG_LEVEL, "  [%.2zx] Chunk=%.4d (%.4x), %.2x:%.2x:%.2x",
+                 ld->num_sprite32_sets, chunk_index, chunk_index, a, b, c);
 
-        lv_debug(LV_DEBUG_LEVEL,
-                 "  [%.2zx] Chunk=%.4d (%.4x), num_sprites=%2zd, %.2x:%.2x:%.2x",
-                 level->num_sprite32_sets, chunk_index, chunk_index,
-                 set->num_sprites, a, b, c);
+        ld->sprite32_sets[ld->num_sprite32_sets++] = chunk_index;
+    }
+
+    return 0;
+}
+
+static int load_sprite32_sets(struct lv_pack *pack, struct lv_level *level,
+                              struct level_load *ld)
+{
+    struct lv_resource *res;
+    int i;
+
+    lv_debug(LV_DEBUG_LEVEL, "Loading 32x32 sprite sets:");
+    for (i = 0; i < ld->num_sprite32_sets; i++) {
+        /* Sprite sets are shared by every level in a world */
+        res = borrow_resource(pack, level,
+                              lv_resource_get_sprite_set(pack,
+                                                         ld->sprite32_sets[i],
+                                                         LV_SPRITE_FORMAT_PACKED32,
+                                                         32, 32));
+        if (!res) {
+            level->warnings |= LV_LEVEL_WARN_CHUNKS;
+            continue;
+        }
+        level->sprite32_sets[level->num_sprite32_sets] = res->sprite_set;
+
+        lv_debug(LV_DEBUG_LEVEL, "  [%.2zx] Chunk=%.4d (%.4x), num_sprites=%2zd",
+                 level->num_sprite32_sets, ld->sprite32_sets[i],
+                 ld->sprite32_sets[i], res->sprite_set.num_sprites);
 
         level->num_sprite32_sets++;
     }
@@ -629,7 +807,7 @@ static void update_unpacked_sprite_sets(struct lv_level *level)
         }
 
         if (obj->sprite_set) {
-            if (set->num_sprites) {
+            if (set->sprites) {
                 /* Already processed this sprite set */
                 continue;
             }
@@ -644,9 +822,17 @@ static void update_unpacked_sprite_sets(struct lv_level *level)
             if (sprite_size == 0)
                 continue;
 
+            if (!set->planar_data)
+                continue;
+
             set->format = LV_SPRITE_FORMAT_UNPACKED;
             set->num_sprites = set->data_size / sprite_size;
-            set->sprites = calloc(set->data_size, sizeof(uint8_t *));
+            set->sprites = lv_arena_calloc(level->arena, set->num_sprites,
+                                           sizeof(uint8_t *));
+            if (!set->sprites) {
+                set->num_sprites = 0;
+                continue;
+            }
 
             for (j = 0; j < set->num_sprites; j++)
                 set->sprites[j] = &set->planar_data[j * sprite_size];
@@ -761,7 +947,7 @@ static void load_something3(struct lv_pack *pack, struct lv_level *level,
 }
 
 static int load_bt_level(struct lv_pack *pack, struct lv_level *level,
-                         struct buffer *buf)
+                         struct level_load *ld, struct buffer *buf)
 {
     uint16_t width, height, chunk_index_map, chunk_index_tileset,
         chunk_index_prefabs, bg_width, bg_height, chunk_index_bg_map,
@@ -815,22 +1001,17 @@ static int load_bt_level(struct lv_pack *pack, struct lv_level *level,
     level->height = height;
     level->chunk_tileset = chunk_index_tileset;
 
-    /* Load the main and optional background maps */
-    load_map(pack, level, chunk_index_map,
-             level->width, level->height, &level->map);
-    if (chunk_index_bg_map != 0xffff)
-        load_map(pack, level, chunk_index_bg_map,
-                 level->width, level->height, &level->bg_map);
-
-    lv_load_tile_prefabs(pack, &level->prefabs, &level->num_prefabs,
-                         chunk_index_prefabs);
+    /* The main and optional background maps */
+    ld->chunk_map     = chunk_index_map;
+    ld->chunk_bg_map  = chunk_index_bg_map;
+    ld->chunk_prefabs = chunk_index_prefabs;
 
     buffer_seek(buf, 0x36);
     load_objects(level, buf);
-    load_palette(pack, level, buf);
+    parse_palettes(level, ld, buf);
     load_palette_animations(pack, level, buf);
     load_something(pack, level, buf);
-    load_unpacked_sprite_sets(pack, level, buf);
+    parse_unpacked_sprite_sets(level, ld, buf);
     load_raw_sprite_sets(pack, level, buf);
     load_level_exit(pack, level, buf);
     load_something3(pack, level, buf);
@@ -839,42 +1020,163 @@ static int load_bt_level(struct lv_pack *pack, struct lv_level *level,
 }
 
 static int load_lv_level(struct lv_pack *pack, struct lv_level *level,
-                         struct buffer *buf, unsigned chunk_object_db)
+                         struct level_load *ld, struct buffer *buf,
+                         unsigned chunk_object_db)
 {
-    load_lv_header(pack, level, buf);
+    load_lv_header(pack, level, ld, buf);
     load_objects(level, buf);
-    load_palette(pack, level, buf);
+    parse_palettes(level, ld, buf);
     load_palette_animations(pack, level, buf);
-    load_unpacked_sprite_sets(pack, level, buf);
-    load_sprite32_sets(pack, level, buf);
+    parse_unpacked_sprite_sets(level, ld, buf);
+    parse_sprite32_sets(level, ld, buf);
+
+    ld->chunk_object_db = chunk_object_db;
+    return 0;
+}
+
+static void add_prefetch_chunk(struct level_load *ld, unsigned chunk_index)
+{
+    ld->chunks[ld->num_chunks++] = chunk_index;
+}
 
-    /* Load the object database */
-    if (chunk_object_db != 0xffff) {
-        lv_object_db_load(pack, &level->object_db, chunk_object_db);
-        update_unpacked_sprite_sets(level);
+/*
+ * Decompress the level's maps and every chunk it uses which is not already
+ * cached in parallel. The chunks stay referenced until the level has been
+ * loaded from them.
+ */
+static int prefetch_chunks(struct lv_pack *pack, struct lv_level *level,
+                           struct level_load *ld, unsigned num_threads)
+{
+    struct lv_workqueue wq;
+    struct map_job *job;
+    int i;
+
+    if (!lv_resource_find(pack, LV_RESOURCE_PREFABS, ld->chunk_prefabs))
+        add_prefetch_chunk(ld, ld->chunk_prefabs);
+    for (i = 0; i < ld->num_palettes; i++)
+        add_prefetch_chunk(ld, ld->palettes[i]);
+    for (i = 0; i < ld->num_unpacked_sets; i++)
+        add_prefetch_chunk(ld, ld->unpacked_sets[i]);
+    for (i = 0; i < ld->num_sprite32_sets; i++)
+        if (!lv_resource_find(pack, LV_RESOURCE_SPRITE_SET,
+                              ld->sprite32_sets[i]))
+            add_prefetch_chunk(ld, ld->sprite32_sets[i]);
+    if (ld->chunk_object_db != 0xffff)
+        add_prefetch_chunk(ld, ld->chunk_object_db);
+
+    /* A single thread work queue runs everything on the calling thread */
+    if (num_threads == 0)
+        num_threads = min(lv_workqueue_num_cpus(), LEVEL_LOAD_THREADS);
+    if (lv_workqueue_init(&wq, min(num_threads, ld->num_chunks + 2)))
+        return -1;
+
+    queue_map(pack, level, ld, &wq, ld->chunk_map,
+              level->width, level->height, &level->map);
+    if (ld->chunk_bg_map != 0xffff)
+        queue_map(pack, level, ld, &wq, ld->chunk_bg_map,
+                  level->width, level->height, &level->bg_map);
+
+    /* Chunks which fail to load are skipped when the level is loaded */
+    lv_pack_cache_get_many(pack, ld->chunks, ld->chunk_data, ld->num_chunks,
+                           &wq);
+    lv_workqueue_free(&wq);
+
+    for (i = 0; i < ld->num_map_jobs; i++) {
+        job = &ld->map_jobs[i];
+        *job->map = job->err ? NULL : (uint16_t *)job->dst;
+        if (job->err)
+            level->warnings |= LV_LEVEL_WARN_CHUNKS;
     }
 
     return 0;
 }
 
-int lv_level_load(struct lv_pack *pack, struct lv_level *level,
-                  unsigned chunk_header, unsigned chunk_object_db)
+static void release_prefetched_chunks(struct lv_pack *pack,
+                                      struct level_load *ld)
 {
+    int i;
+
+    for (i = 0; i < ld->num_chunks; i++)
+        if (ld->chunk_data[i])
+            lv_pack_cache_put(pack, ld->chunks[i]);
+}
+
+int lv_level_load_arena(struct lv_pack *pack, struct lv_level *level,
+                        struct lv_arena *arena, unsigned chunk_header,
+                        unsigned chunk_object_db, unsigned num_threads)
+{
+    struct level_load ld;
     struct buffer buf;
-    struct lv_chunk *chunk;
-    uint8_t *data;
+    const uint8_t *data;
+    size_t size;
+    int err;
 
     memset(level, 0, sizeof(*level));
+    level->arena = arena;
+
+    memset(&ld, 0, sizeof(ld));
+    ld.chunk_bg_map = 0xffff;
+    ld.chunk_object_db = 0xffff;
 
-    chunk = lv_pack_get_chunk(pack, chunk_header);
-    lv_decompress_chunk(chunk, &data);
-    buffer_init_from_data(&buf, data, chunk->decompressed_size);
+    data = lv_pack_cache_get(pack, chunk_header, &size);
+    if (!data)
+        return -1;
+    buffer_init_from_data(&buf, (void *)data, size);
 
+    /* Find the chunks the level uses */
     if (pack->blackthorne)
-        load_bt_level(pack, level, &buf);
+        load_bt_level(pack, level, &ld, &buf);
     else
-        load_lv_level(pack, level, &buf, chunk_object_db);
+        load_lv_level(pack, level, &ld, &buf, chunk_object_db);
+
+    lv_pack_cache_put(pack, chunk_header);
+
+    err = prefetch_chunks(pack, level, &ld, num_threads);
+    if (err)
+        return err;
+
+    /* Load everything else from the prefetched chunks */
+    load_prefabs(pack, level, ld.chunk_prefabs);
+    load_palettes(pack, level, &ld);
+    load_unpacked_sprite_sets(pack, level, &ld);
+    load_sprite32_sets(pack, level, &ld);
+    if (ld.chunk_object_db != 0xffff) {
+        if (lv_object_db_load(pack, &level->object_db, ld.chunk_object_db))
+            level->warnings |= LV_LEVEL_WARN_CHUNKS;
+        else
+            update_unpacked_sprite_sets(level);
+    }
+
+    /* The tileset is loaded by the caller, but check that it exists */
+    if (level->chunk_tileset >= pack->num_chunks)
+        level->warnings |= LV_LEVEL_WARN_CHUNKS;
 
-    free(data);
+    release_prefetched_chunks(pack, &ld);
     return 0;
 }
+
+int lv_level_load(struct lv_pack *pack, struct lv_level *level,
+                  unsigned chunk_header, unsigned chunk_object_db)
+{
+    /* A zeroed arena is empty, so the level's own arena needs no setup */
+    return lv_level_load_arena(pack, level, &level->own_arena, chunk_header,
+                               chunk_object_db, 0);
+}
+
+void lv_level_free(struct lv_pack *pack, struct lv_level *level)
+{
+    int i;
+
+    for (i = 0; i < level->num_resources; i++)
+        lv_resource_put(pack, level->resources[i]);
+    for (i = 0; i < level->num_sprite_unpacked_sets; i++)
+        lv_pack_cache_put(pack, level->sprite_unpacked_sets[i].chunk_index);
+    lv_object_db_free(pack, &level->object_db);
+
+    if (level->arena == &level->own_arena)
+        lv_arena_free(level->arena);
+    else if (level->arena)
+        lv_arena_reset(level->arena);
+
+    memset(level, 0, sizeof(*level));
+}
@@ -20,6 +20,7 @@
 
 #include "lv_sprite.h"
 #include "lv_object_db.h"
+#include "lv_arena.h"
 #include "common.h"
 
 /**
@@ -30,6 +31,13 @@
  * which are combined into 16x16 'prefabs' which are used for the level's
  * tile map. Each level has its own palette set, which may include palette
  * swap animations.
+ *
+ * Everything allocated when loading a level comes from a single arena, so
+ * a level is released in one go by \ref lv_level_free. Prefab tables and
+ * sprite sets are borrowed from the pack's shared resources (see
+ * \ref lv_resource), and chunk data such as palettes and the object
+ * database is borrowed from the pack's decompressed chunk cache, so
+ * loading another level from the same world does not load them again.
  */
 
 #define LV_PREFAB_INDEX_MASK        0x1ff
@@ -45,6 +53,16 @@
 #define LV_MAX_SPRITE32_SETS   0x10
 #define LV_MAX_SPRITE16_SETS   0x20
 
+/* Maximum number of shared resources used by a level */
+#define LV_MAX_LEVEL_RESOURCES (LV_MAX_SPRITE32_SETS + 1)
+
+/* Problems found while loading a level */
+#define LV_LEVEL_WARN_MAP_SIZE      0x0001 /* Map data smaller than the level */
+#define LV_LEVEL_WARN_OBJECTS       0x0002 /* Too many objects */
+#define LV_LEVEL_WARN_SPRITE_SETS   0x0004 /* Too many sprite sets */
+#define LV_LEVEL_WARN_PALETTES      0x0008 /* Too many palettes */
+#define LV_LEVEL_WARN_CHUNKS        0x0010 /* Missing or corrupt chunks */
+
 /* Viking object numbers */
 #define LV_OBJ_BALEOG          0
 #define LV_OBJ_ERIK            1
@@ -55,6 +73,7 @@
 #define LV_OBJ_FLAG_NO_DRAW      0x0800
 
 struct lv_pack;
+struct lv_resource;
 
 /**
  * Information about the chunks used for a given level. These are hardcoded
@@ -156,7 +175,7 @@ struct lv_level {
     struct lv_pal_animation pal_animation[16];
     size_t                  num_pal_animations;
 
-    /** Tile prefabs. */
+    /** Tile prefabs. These are shared and must not be modified. */
     struct lv_tile_prefab  *prefabs;
 
     /** Number of tile prefabs. */
@@ -174,7 +193,7 @@ struct lv_level {
     /** Number objects in the level. */
     size_t                 num_objects;
 
-    /** Packed 32x32 sprite sets. */
+    /** Packed 32x32 sprite sets. The sprite data is shared. */
     struct lv_sprite_set   sprite32_sets[LV_MAX_SPRITE32_SETS];
 
     /** Number of packed 32x32 sprite sets. */
@@ -182,12 +201,31 @@ struct lv_level {
 
     /**
      * Unpacked sprite sets. The size of the sprites is determined by the
-     * objects that refer to the sprite set.
+     * objects that refer to the sprite set. The planar data is borrowed
+     * from the pack's decompressed chunk cache.
      */
     struct lv_sprite_set   sprite_unpacked_sets[LV_MAX_SPRITE16_SETS];
 
     /** Number of unpacked sprite sets. */
     size_t                 num_sprite_unpacked_sets;
+
+    /** Shared resources borrowed by the level. */
+    struct lv_resource     *resources[LV_MAX_LEVEL_RESOURCES];
+
+    /** Number of shared resources borrowed by the level. */
+    size_t                 num_resources;
+
+    /** Arena which the level's data is allocated from. */
+    struct lv_arena        *arena;
+
+    /** Arena owned by the level if it was loaded by \ref lv_level_load. */
+    struct lv_arena        own_arena;
+
+    /**
+     * Problems found while loading the level (LV_LEVEL_WARN_*). Anything
+     * which could not be loaded, or did not fit, is left out of the level.
+     */
+    unsigned               warnings;
 };
 
 /**
@@ -201,9 +239,19 @@ struct lv_level {
 const struct lv_level_info *lv_level_get_info(struct lv_pack *pack,
 					      unsigned level_num);
 
+/**
+ * Get the number of levels hardcoded in the game's executable.
+ *
+ * \param pack       Pack file.
+ * \returns          Number of levels. Levels are numbered from 1.
+ */
+size_t lv_level_get_num_levels(struct lv_pack *pack);
+
 /**
  * Load a level. This loads and initialises all data associated with a single
- * level.
+ * level. The level header is parsed first to find the chunks the level
+ * uses, which are then decompressed in parallel on a small pool of threads.
+ * The pack must not be used by any other thread while a level is loading.
  *
  * \param pack            The data pack file.
  * \param level           Level structure to initialise.
@@ -214,6 +262,40 @@ const struct lv_level_info *lv_level_get_info(struct lv_pack *pack,
 int lv_level_load(struct lv_pack *pack, struct lv_level *level,
                   unsigned chunk_header, unsigned chunk_object_db);
 
+/**
+ * Load a level, allocating its data from a caller provided arena. Freeing
+ * the level resets the arena, keeping its memory for the next level. This
+ * lets a tool load every level in turn without its memory use growing.
+ * Only one level may use an arena at a time.
+ *
+ * Tools which load several levels at once on their own threads should
+ * use a single thread for each level, rather than starting a pool of
+ * threads for every level.
+ *
+ * \param pack            The data pack file.
+ * \param level           Level structure to initialise.
+ * \param arena           Arena to allocate the level's data from.
+ * \param chunk_header    Index of the level header chunk.
+ * \param chunk_object_db Index of the level object database chunk.
+ * \param num_threads     Number of threads to decompress the level's chunks
+ *                        on. One decompresses them on the calling thread,
+ *                        and zero uses the same small pool as
+ *                        \ref lv_level_load.
+ * \returns               0 for success.
+ */
+int lv_level_load_arena(struct lv_pack *pack, struct lv_level *level,
+                        struct lv_arena *arena, unsigned chunk_header,
+                        unsigned chunk_object_db, unsigned num_threads);
+
+/**
+ * Free a level. Everything allocated by loading the level is released
+ * at once, and its references to shared resources and chunks are dropped.
+ *
+ * \param pack            Pack file the level was loaded from.
+ * \param level           Level to free.
+ */
+void lv_level_free(struct lv_pack *pack, struct lv_level *level);
+
 /**
  * Get the prefab at the given map location in a level.
  *
@@ -269,12 +351,13 @@ lv_level_get_bg_prefab_at(struct lv_level *level, unsigned x, unsigned y,
  * be horizontally or vertically flipped when creating a tile.
  *
  * \param pack            Pack file.
- * \param r_prefabs       Returned allocated prefab array.
+ * \param arena           Arena to allocate the prefab array from.
+ * \param r_prefabs       Returned prefab array.
  * \param r_num_prefabs   Returned number of prefabs.
  * \param chunk_index     Index to load the prefabs from.
  * \returns               0 for success.
  */
-int lv_load_tile_prefabs(struct lv_pack *pack,
+int lv_load_tile_prefabs(struct lv_pack *pack, struct lv_arena *arena,
 			 struct lv_tile_prefab **r_prefabs,
 			 size_t *r_num_prefabs, unsigned chunk_index);
 
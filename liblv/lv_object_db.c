@@ -70,13 +70,24 @@ int lv_object_db_get_object(struct lv_object_db *db, uint16_t index,
 int lv_object_db_load(struct lv_pack *pack, struct lv_object_db *db,
 		      unsigned chunk_index)
 {
-    struct lv_chunk *chunk;
+    size_t size;
 
     memset(db, 0, sizeof(*db));
 
-    chunk = lv_pack_get_chunk(pack, chunk_index);
-    lv_decompress_chunk(chunk, &db->data);
-    buffer_init_from_data(&db->buf, db->data, chunk->decompressed_size);
+    /* Object databases are shared by every level in a world */
+    db->data = lv_pack_cache_get(pack, chunk_index, &size);
+    if (!db->data)
+        return -1;
+
+    db->chunk_index = chunk_index;
+    buffer_init_from_data(&db->buf, (void *)db->data, size);
 
     return 0;
 }
+
+void lv_object_db_free(struct lv_pack *pack, struct lv_object_db *db)
+{
+    if (db->data)
+        lv_pack_cache_put(pack, db->chunk_index);
+    memset(db, 0, sizeof(*db));
+}
@@ -36,8 +36,14 @@ struct lv_pack;
 
 /** Object database entry. */
 struct lv_object_db {
-    /** Pointer to the decompressed chunk data. */
-    uint8_t        *data;
+    /** Chunk index of the database. */
+    unsigned       chunk_index;
+
+    /**
+     * Pointer to the decompressed chunk data. This is borrowed from the
+     * pack's decompressed chunk cache.
+     */
+    const uint8_t  *data;
 
     /** Accessor buffer for the decompressed chunk data. */
     struct buffer  buf;
@@ -74,6 +80,14 @@ struct lv_object_db_entry {
 int lv_object_db_load(struct lv_pack *pack, struct lv_object_db *db,
 		      unsigned chunk_index);
 
+/**
+ * Free an object database.
+ *
+ * \param pack         Pack file the database was loaded from.
+ * \param db           Database to free.
+ */
+void lv_object_db_free(struct lv_pack *pack, struct lv_object_db *db);
+
 /**
  * Get an object entry from the database.
  *
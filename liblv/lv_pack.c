@@ -13,67 +13,238 @@
  *
  */
 
+#define _GNU_SOURCE
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/sendfile.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
 
 #include "lv_pack.h"
 #include "lv_compress.h"
+#include "lv_arena.h"
+#include "lv_journal.h"
+#include "lv_hash.h"
+#include "lv_index.h"
+#include "lv_resource.h"
+#include "lv_workqueue.h"
+#include "common.h"
 
 #include "buffer.h"
 
 /* Flag used by some Blackthorne chunks. Use unknown. */
 #define BT_CHUNK_FLAG 0x40000000
 
-int lv_pack_load(const char *filename, struct lv_pack *pack, bool blackthorne)
+static int read_at(int fd, void *data, size_t size, off_t offset)
 {
-    struct lv_chunk *chunk, *next_chunk;
-    struct buffer buf;
-    uint32_t num_chunks, chunk_start, val32;
-    uint16_t val16;
-    int i, err;
+    ssize_t count;
 
-    memset(pack, 0, sizeof(*pack));
-    pack->blackthorne = blackthorne;
+    while (size) {
+        count = pread(fd, data, size, offset);
+        if (count < 0 && errno == EINTR)
+            continue;
+        if (count < 0)
+            return -errno;
+        if (count == 0)
+            return -EIO;
 
-    err = buffer_init_from_file(&buf, filename);
-    if (err)
-        return err;
+        data += count;
+        offset += count;
+        size -= count;
+    }
+
+    return 0;
+}
+
+static int map_pack_file(struct lv_pack *pack, unsigned flags)
+{
+    int advice;
+
+    pack->data = mmap(NULL, pack->size, PROT_READ, MAP_PRIVATE, pack->fd, 0);
+    if (pack->data == MAP_FAILED) {
+        pack->data = NULL;
+        return -errno;
+    }
+
+    pack->mapped = true;
+
+    advice = MADV_NORMAL;
+    if (flags & LV_PACK_LOAD_SEQUENTIAL)
+        advice = MADV_SEQUENTIAL;
+    else if (flags & LV_PACK_LOAD_RANDOM)
+        advice = MADV_RANDOM;
+    madvise(pack->data, pack->size, advice);
+
+    return 0;
+}
+
+static int read_pack_file(struct lv_pack *pack)
+{
+    pack->data = malloc(pack->size);
+    if (!pack->data)
+        return -ENOMEM;
+
+    return read_at(pack->fd, pack->data, pack->size, 0);
+}
+
+/*
+ * Read the chunk offset table. If the pack data is not in memory (lazy
+ * loading without mmap) then only the table is read from the file.
+ */
+static int read_chunk_table(struct lv_pack *pack, uint32_t **r_table)
+{
+    uint32_t val32;
+    size_t table_size;
+    int err;
+
+    if (pack->data) {
+        memcpy(&val32, pack->data, sizeof(val32));
+    } else {
+        err = read_at(pack->fd, &val32, sizeof(val32), 0);
+        if (err)
+            return err;
+    }
+    val32 = le32toh(val32);
 
-    /* Get the number of chunks and allocate an array for them */
     if (pack->blackthorne) {
         /* Blackthorne stores the number of chunks as the first le32 value */
-        buffer_get_le32(&buf, &num_chunks);
-        pack->num_chunks = num_chunks;
+        pack->num_chunks = val32;
     } else {
         /*
          * Lost Vikings doesn't store the number of chunks in the pack file.
          * The number of chunks can be calculated using the offset for the
          * first chunk since the chunks are ordered.
          */
-        buffer_get_le32(&buf, &chunk_start);
-        pack->num_chunks = (chunk_start / 4) - 1;
+        pack->num_chunks = (val32 / 4) - 1;
     }
 
-    pack->chunks = calloc(pack->num_chunks, sizeof(*pack->chunks));
-    if (!pack->chunks)
-        return -1;
+    table_size = pack->num_chunks * sizeof(uint32_t);
+    if (pack->num_chunks == 0 || table_size > pack->size)
+        return -EINVAL;
 
-    /* Get the starting offset of each chunk */
-    buffer_seek(&buf, 0);
+    if (pack->data) {
+        *r_table = pack->data;
+        return 0;
+    }
 
-    for (i = 0; i < pack->num_chunks; i++) {
-        /*
-         * Blackthorne doesn't have a chunk zero because of the 4-byte
-         * pack header.
-         */
-        if (blackthorne && i == 0 ) {
-            buffer_get_le32(&buf, &val32);
-            continue;
+    *r_table = malloc(table_size);
+    if (!*r_table)
+        return -ENOMEM;
+
+    err = read_at(pack->fd, *r_table, table_size, 0);
+    if (err) {
+        free(*r_table);
+        return err;
+    }
+
+    return 0;
+}
+
+/* Check that a stored chunk has all of its data */
+static bool stored_chunk_valid(struct lv_chunk *chunk)
+{
+    return chunk->size >= chunk->data_offset &&
+        chunk->size - chunk->data_offset >= chunk->decompressed_size;
+}
+
+static void read_chunk_header(struct lv_pack *pack, struct lv_chunk *chunk)
+{
+    uint32_t val32;
+    uint16_t val16;
+
+    /*
+     * Chunks store their decompressed size at the beginning of the chunk
+     * data. The Lost Vikings stores the size as a 16-bit value,
+     * Blackthorne stores it as a 32-bit value.
+     */
+    if (pack->blackthorne) {
+        chunk->data_offset = 4;
+        if (chunk->size >= chunk->data_offset) {
+            memcpy(&val32, chunk->data, sizeof(val32));
+            chunk->decompressed_size = le32toh(val32);
+        }
+    } else {
+        chunk->data_offset = 2;
+        if (chunk->size >= chunk->data_offset) {
+            memcpy(&val16, chunk->data, sizeof(val16));
+            chunk->decompressed_size = le16toh(val16) + 1;
+        }
+    }
+
+    if (!chunk->storage_declared) {
+        if (chunk->size >= chunk->data_offset &&
+            chunk->size - chunk->data_offset == chunk->decompressed_size)
+            chunk->storage = LV_CHUNK_STORAGE_STORED;
+        else
+            chunk->storage = LV_CHUNK_STORAGE_COMPRESSED;
+    }
+}
+
+/*
+ * Read a chunk's decompressed size header and set up its data. The chunk
+ * data is not copied if the pack data is in memory.
+ */
+static int load_chunk(struct lv_pack *pack, struct lv_chunk *chunk)
+{
+    int err;
+
+    if (pack->data) {
+        chunk->data = pack->data + chunk->start;
+    } else {
+        chunk->data = malloc(chunk->size);
+        if (!chunk->data)
+            return -ENOMEM;
+
+        err = read_at(pack->fd, chunk->data, chunk->size, chunk->start);
+        if (err) {
+            free(chunk->data);
+            chunk->data = NULL;
+            return err;
         }
 
-        buffer_get_le32(&buf, &pack->chunks[i].start);
+        chunk->owned = true;
+    }
+
+    /* Indexed packs already have the header values */
+    if (!pack->indexed)
+        read_chunk_header(pack, chunk);
+    chunk->loaded = true;
+    return 0;
+}
+
+/* Set up the chunks from the pack's offset table */
+static int read_chunk_offsets(struct lv_pack *pack)
+{
+    struct lv_chunk *chunk;
+    uint32_t *table, chunk_start;
+    int i, err;
+
+    err = read_chunk_table(pack, &table);
+    if (err)
+        return err;
+
+    pack->chunks = calloc(pack->num_chunks, sizeof(*pack->chunks));
+    if (!pack->chunks) {
+        err = -ENOMEM;
+        goto out;
+    }
+
+    /*
+     * Get the starting offset of each chunk. Blackthorne doesn't have a
+     * chunk zero because of the 4-byte pack header.
+     */
+    for (i = pack->blackthorne ? 1 : 0; i < pack->num_chunks; i++) {
+        pack->chunks[i].start = le32toh(table[i]);
 
         if (pack->blackthorne) {
             /*
@@ -87,50 +258,1074 @@ int lv_pack_load(const char *filename, struct lv_pack *pack, bool blackthorne)
         }
     }
 
-    /* Get the chunk size and data */
+    /* Get the chunk sizes */
+    err = -EINVAL;
     for (i = 0; i < pack->num_chunks; i++) {
         chunk = &pack->chunks[i];
 
-        if (i < pack->num_chunks - 1) {
-            next_chunk = &pack->chunks[i + 1];
-            chunk->size = (next_chunk->start & ~BT_CHUNK_FLAG) - chunk->start;
-        } else {
-            chunk->size = buf.size - chunk->start;
-        }
+        if (i < pack->num_chunks - 1)
+            chunk_start = pack->chunks[i + 1].start;
+        else
+            chunk_start = pack->size;
+
+        /* Chunks must be ordered and within the pack file */
+        if (chunk_start < chunk->start || chunk_start > pack->size)
+            goto out;
 
+        chunk->size = chunk_start - chunk->start;
         chunk->index = i;
+    }
+    err = 0;
+
+out:
+    if (table != pack->data)
+        free(table);
+    return err;
+}
+
+int lv_pack_load_flags(const char *filename, struct lv_pack *pack,
+                       bool blackthorne, unsigned flags)
+{
+    struct stat s;
+    int i, err = 0;
+
+    memset(pack, 0, sizeof(*pack));
+    pack->blackthorne = blackthorne;
+    pack->cache_budget = LV_PACK_DEFAULT_CACHE_BUDGET;
+
+    pack->fd = open(filename, O_RDONLY);
+    if (pack->fd < 0)
+        return -errno;
+    pack->fd_open = true;
+
+    if (fstat(pack->fd, &s) < 0) {
+        err = -errno;
+        goto fail;
+    }
+
+    pack->size = s.st_size;
+    if (pack->size < sizeof(uint32_t)) {
+        err = -EINVAL;
+        goto fail;
+    }
+
+    if (!(flags & LV_PACK_LOAD_NO_MMAP))
+        err = map_pack_file(pack, flags);
+    else if (!(flags & LV_PACK_LOAD_LAZY))
+        err = read_pack_file(pack);
+    if (err)
+        goto fail;
 
+    /* The index avoids reading the table and every chunk's header */
+    if (!(flags & LV_PACK_LOAD_INDEX) || lv_index_load(pack, filename)) {
+        err = read_chunk_offsets(pack);
+        if (err)
+            goto fail;
+    }
+
+    /* Lazy packs load each chunk's header and data on first use */
+    if (!(flags & LV_PACK_LOAD_LAZY)) {
+        for (i = 0; i < pack->num_chunks; i++) {
+            err = load_chunk(pack, &pack->chunks[i]);
+            if (err)
+                goto fail;
+        }
+    }
+
+    /*
+     * The file is kept open to read lazily loaded chunks, and so that
+     * unchanged chunks can be copied directly by lv_pack_save.
+     */
+    return 0;
+
+fail:
+    lv_pack_free(pack);
+    return err;
+}
+
+int lv_pack_load(const char *filename, struct lv_pack *pack, bool blackthorne)
+{
+    return lv_pack_load_flags(filename, pack, blackthorne, 0);
+}
+
+static void free_chunk_index(struct lv_chunk *chunk)
+{
+    if (chunk->checkpoints) {
+        lv_decompress_index_free(chunk->checkpoints);
+        free(chunk->checkpoints);
+        chunk->checkpoints = NULL;
+    }
+}
+
+void lv_pack_free(struct lv_pack *pack)
+{
+    int i;
+
+    lv_resource_free_all(pack);
+    for (i = 0; pack->chunks && i < pack->num_chunks; i++) {
+        if (pack->chunks[i].owned)
+            free(pack->chunks[i].data);
+        free(pack->chunks[i].cache_data);
+        free_chunk_index(&pack->chunks[i]);
+    }
+    free(pack->chunks);
+    free(pack->hash_index);
+
+    if (pack->mapped)
+        munmap(pack->data, pack->size);
+    else
+        free(pack->data);
+
+    if (pack->fd_open)
+        close(pack->fd);
+
+    memset(pack, 0, sizeof(*pack));
+    pack->fd = -1;
+}
+
+struct lv_chunk *lv_pack_get_chunk(struct lv_pack *pack, unsigned chunk_index)
+{
+    struct lv_chunk *chunk;
+
+    if (chunk_index >= pack->num_chunks)
+        return NULL;
+
+    chunk = &pack->chunks[chunk_index];
+    if (!chunk->loaded && load_chunk(pack, chunk))
+        return NULL;
+
+    return chunk;
+}
+
+void lv_pack_release_chunk(struct lv_pack *pack, struct lv_chunk *chunk)
+{
+    uintptr_t start, end;
+    long page_size;
+
+    /*
+     * Replaced chunks only exist in memory. Referenced stored chunks are
+     * borrowed by the cache.
+     */
+    if (!chunk->loaded || chunk->replaced || chunk->cache_refs)
+        return;
+
+    if (chunk->owned) {
+        free(chunk->data);
+        chunk->owned = false;
+    } else if (pack->mapped) {
         /*
-         * Chunks store their decompressed size at the beginning of the chunk
-         * data. The Lost Vikings stores the size as a 16-bit value,
-         * Blackthorne stores it as a 32-bit value.
+         * Drop the pages covering the chunk. The mapping is read-only so
+         * the pages are simply faulted back in from the file if the chunk
+         * or a neighbouring chunk is used again.
          */
-        if (pack->blackthorne) {
-            buffer_peek_le32(&buf, chunk->start, &val32);
-            chunk->decompressed_size = val32;
-            chunk->data_offset = 4;
+        page_size = sysconf(_SC_PAGESIZE);
+        start = (uintptr_t)chunk->data & ~(page_size - 1);
+        end = (uintptr_t)chunk->data + chunk->size;
+        madvise((void *)start, end - start, MADV_DONTNEED);
+    }
+
+    chunk->data = NULL;
+    chunk->loaded = false;
+}
+
+static void cache_unlink(struct lv_pack *pack, struct lv_chunk *chunk)
+{
+    if (chunk->cache_prev)
+        chunk->cache_prev->cache_next = chunk->cache_next;
+    else
+        pack->cache_head = chunk->cache_next;
+
+    if (chunk->cache_next)
+        chunk->cache_next->cache_prev = chunk->cache_prev;
+    else
+        pack->cache_tail = chunk->cache_prev;
+
+    chunk->cache_prev = NULL;
+    chunk->cache_next = NULL;
+}
+
+static void cache_drop(struct lv_pack *pack, struct lv_chunk *chunk)
+{
+    cache_unlink(pack, chunk);
+    pack->cache_stats.size -= chunk->decompressed_size;
+    free(chunk->cache_data);
+    chunk->cache_data = NULL;
+}
+
+int lv_pack_set_chunk_storage(struct lv_pack *pack, unsigned chunk_index,
+                              unsigned storage)
+{
+    struct lv_chunk *chunk;
+
+    if (chunk_index >= pack->num_chunks)
+        return -EINVAL;
+
+    /*
+     * Stored chunk data is not counted in the cache, so the storage cannot
+     * change while the data is referenced. Resources may hold references
+     * to chunks nothing else is using, so drop them first.
+     */
+    chunk = &pack->chunks[chunk_index];
+    lv_resource_drop_chunk(pack, chunk->index);
+    if (chunk->cache_refs)
+        return -EBUSY;
+    if (chunk->cache_data)
+        cache_drop(pack, chunk);
+
+    chunk->storage = storage;
+    chunk->storage_declared = true;
+    return 0;
+}
+
+static void cache_evict(struct lv_pack *pack)
+{
+    /* Only unreferenced chunks are on the LRU list */
+    while (pack->cache_tail && pack->cache_stats.size > pack->cache_budget) {
+        cache_drop(pack, pack->cache_tail);
+        pack->cache_stats.evictions++;
+    }
+}
+
+void lv_pack_cache_set_budget(struct lv_pack *pack, size_t budget)
+{
+    pack->cache_budget = budget;
+    cache_evict(pack);
+}
+
+const uint8_t *lv_pack_cache_get(struct lv_pack *pack, unsigned chunk_index,
+                                 size_t *r_size)
+{
+    struct lv_chunk *chunk;
+    uint8_t *data;
+
+    chunk = lv_pack_get_chunk(pack, chunk_index);
+    if (!chunk)
+        return NULL;
+
+    if (chunk->storage == LV_CHUNK_STORAGE_STORED) {
+        /* Stored chunks are used in place */
+        if (!stored_chunk_valid(chunk))
+            return NULL;
+        pack->cache_stats.hits++;
+        chunk->cache_refs++;
+        if (r_size)
+            *r_size = chunk->decompressed_size;
+        return (const uint8_t *)chunk->data + chunk->data_offset;
+
+    } else if (chunk->cache_data) {
+        if (chunk->cache_refs == 0)
+            cache_unlink(pack, chunk);
+        pack->cache_stats.hits++;
+
+    } else {
+        if (lv_decompress_chunk(chunk, &data))
+            return NULL;
+
+        chunk->cache_data = data;
+        pack->cache_stats.size += chunk->decompressed_size;
+        pack->cache_stats.misses++;
+    }
+
+    chunk->cache_refs++;
+    if (r_size)
+        *r_size = chunk->decompressed_size;
+    return chunk->cache_data;
+}
+
+void lv_pack_cache_put(struct lv_pack *pack, unsigned chunk_index)
+{
+    struct lv_chunk *chunk;
+
+    /* Ignore unbalanced puts rather than corrupting the LRU list */
+    if (chunk_index >= pack->num_chunks)
+        return;
+    chunk = &pack->chunks[chunk_index];
+    if (chunk->cache_refs == 0)
+        return;
+
+    if (--chunk->cache_refs || chunk->storage == LV_CHUNK_STORAGE_STORED)
+        return;
+
+    /* Move to the most recently used end of the list */
+    chunk->cache_prev = NULL;
+    chunk->cache_next = pack->cache_head;
+    if (pack->cache_head)
+        pack->cache_head->cache_prev = chunk;
+    else
+        pack->cache_tail = chunk;
+    pack->cache_head = chunk;
+
+    cache_evict(pack);
+}
+
+struct cache_job {
+    struct lv_chunk *chunk;
+    uint8_t         *data;
+    int             err;
+};
+
+static void decompress_cache_job(void *arg)
+{
+    struct cache_job *job = arg;
+
+    job->err = lv_decompress_chunk_into(job->chunk, job->data,
+                                        job->chunk->decompressed_size);
+}
+
+int lv_pack_cache_get_many(struct lv_pack *pack, const unsigned *chunk_indices,
+                           const uint8_t **r_data, size_t count,
+                           struct lv_workqueue *wq)
+{
+    struct cache_job *jobs;
+    struct lv_chunk *chunk;
+    size_t i, j, num_jobs = 0;
+    int err = 0;
+
+    jobs = calloc(count, sizeof(*jobs));
+    if (!jobs)
+        return -1;
+
+    /*
+     * Loading chunks and updating the cache is not thread safe, so only
+     * the decompression is done on the work queue. Chunks which are
+     * already cached are referenced straight away.
+     */
+    for (i = 0; i < count; i++) {
+        r_data[i] = NULL;
+        chunk = lv_pack_get_chunk(pack, chunk_indices[i]);
+        if (!chunk)
+            continue;
+
+        if (chunk->storage == LV_CHUNK_STORAGE_STORED || chunk->cache_data) {
+            r_data[i] = lv_pack_cache_get(pack, chunk_indices[i], NULL);
+            continue;
+        }
+
+        for (j = 0; j < num_jobs; j++)
+            if (jobs[j].chunk == chunk)
+                break;
+        if (j < num_jobs)
+            continue;
+
+        jobs[num_jobs].chunk = chunk;
+        jobs[num_jobs].data = malloc(chunk->decompressed_size);
+        if (!jobs[num_jobs].data)
+            continue;
+        if (lv_workqueue_add(wq, decompress_cache_job, &jobs[num_jobs]))
+            decompress_cache_job(&jobs[num_jobs]);
+        num_jobs++;
+    }
+
+    lv_workqueue_wait(wq);
+
+    for (j = 0; j < num_jobs; j++) {
+        chunk = jobs[j].chunk;
+        if (jobs[j].err) {
+            free(jobs[j].data);
+            continue;
+        }
+
+        chunk->cache_data = jobs[j].data;
+        pack->cache_stats.size += chunk->decompressed_size;
+        pack->cache_stats.misses++;
+    }
+
+    /*
+     * Reference the newly cached chunks. Everything which was already
+     * cached has been referenced, so any chunk with cached data here was
+     * decompressed above.
+     */
+    for (i = 0; i < count; i++) {
+        if (r_data[i])
+            continue;
+
+        chunk = lv_pack_get_chunk(pack, chunk_indices[i]);
+        if (!chunk || !chunk->cache_data) {
+            err = -1;
+            continue;
+        }
+
+        chunk->cache_refs++;
+        r_data[i] = chunk->cache_data;
+    }
+
+    free(jobs);
+    return err;
+}
+
+int lv_pack_replace_chunk(struct lv_pack *pack, struct lv_chunk *chunk,
+                          void *data, size_t size)
+{
+    /*
+     * The new data may have a different decompressed size and storage, so
+     * referenced data cannot be replaced. Drop resources first, since they
+     * may hold references to chunks nothing else is using.
+     */
+    lv_resource_drop_chunk(pack, chunk->index);
+    if (chunk->cache_refs)
+        return -EBUSY;
+    if (chunk->cache_data)
+        cache_drop(pack, chunk);
+
+    if (chunk->owned)
+        free(chunk->data);
+    free_chunk_index(chunk);
+
+    chunk->data = data;
+    chunk->size = size;
+    chunk->owned = true;
+    chunk->loaded = true;
+    chunk->replaced = true;
+
+    /* The content hashes are no longer valid */
+    chunk->hashed = false;
+    free(pack->hash_index);
+    pack->hash_index = NULL;
+    pack->num_hash_entries = 0;
+
+    read_chunk_header(pack, chunk);
+    return 0;
+}
+
+/* Write out an array of buffers, handling short writes */
+static int write_iov(int fd, struct iovec *iov, int iov_count)
+{
+    ssize_t count;
+
+    while (iov_count) {
+        count = writev(fd, iov, min(iov_count, IOV_MAX));
+        if (count < 0 && errno == EINTR)
+            continue;
+        if (count < 0)
+            return -errno;
+
+        while (iov_count && count >= iov->iov_len) {
+            count -= iov->iov_len;
+            iov++;
+            iov_count--;
+        }
+        if (iov_count) {
+            iov->iov_base += count;
+            iov->iov_len -= count;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Copy part of the source pack file to the output file's current position.
+ * The copy is done in the kernel where possible, falling back from
+ * copy_file_range to sendfile to reading and writing through a buffer.
+ */
+static int copy_range(int out_fd, int in_fd, off_t offset, size_t size)
+{
+    bool use_copy_file_range = true, use_sendfile = true;
+    char buf[64 * 1024];
+    ssize_t count;
+    struct iovec iov;
+    int err;
+
+    while (size) {
+        if (use_copy_file_range) {
+            count = copy_file_range(in_fd, &offset, out_fd, NULL, size, 0);
+            if (count < 0 && (errno == ENOSYS || errno == EXDEV ||
+                              errno == EINVAL || errno == EOPNOTSUPP)) {
+                use_copy_file_range = false;
+                continue;
+            }
+        } else if (use_sendfile) {
+            count = sendfile(out_fd, in_fd, &offset, size);
+            if (count < 0 && (errno == ENOSYS || errno == EINVAL)) {
+                use_sendfile = false;
+                continue;
+            }
         } else {
-            buffer_peek_le16(&buf, chunk->start, &val16);
-            chunk->decompressed_size = val16 + 1;
-            chunk->data_offset = 2;
+            count = pread(in_fd, buf, min(size, sizeof(buf)), offset);
+            if (count > 0) {
+                iov.iov_base = buf;
+                iov.iov_len = count;
+                err = write_iov(out_fd, &iov, 1);
+                if (err)
+                    return err;
+                offset += count;
+            }
         }
 
+        if (count < 0 && errno == EINTR)
+            continue;
+        if (count < 0)
+            return -errno;
+        if (count == 0)
+            return -EIO;
 
-        chunk->data = malloc(chunk->size);
-        if (!chunk->data)
+        size -= count;
+    }
+
+    return 0;
+}
+
+/*
+ * Build the chunk offset table for a pack being saved. Lost Vikings packs
+ * have an offset for each chunk followed by the end offset. Blackthorne
+ * packs have the number of chunks followed by an offset, with its flag,
+ * for each chunk other than chunk zero, which is the table itself.
+ */
+static int build_chunk_table(struct lv_pack *pack, uint32_t **r_table,
+                             size_t *r_table_size)
+{
+    uint32_t *table, offset;
+    size_t table_size, first, i;
+    uint64_t end;
+
+    if (pack->blackthorne) {
+        table_size = pack->num_chunks * sizeof(uint32_t);
+        first = 1;
+    } else {
+        table_size = (pack->num_chunks + 1) * sizeof(uint32_t);
+        first = 0;
+    }
+
+    table = malloc(table_size);
+    if (!table)
+        return -ENOMEM;
+
+    end = table_size;
+    if (pack->blackthorne) {
+        /* Keep anything that followed the table in the original header */
+        if (pack->chunks[0].size > table_size)
+            end = pack->chunks[0].size;
+        table[0] = htole32(pack->num_chunks);
+    }
+
+    for (i = first; i < pack->num_chunks; i++) {
+        if (end >= (pack->blackthorne ? BT_CHUNK_FLAG : UINT32_MAX))
+            goto too_big;
+
+        offset = end;
+        if (pack->chunks[i].flag)
+            offset |= BT_CHUNK_FLAG;
+        table[i] = htole32(offset);
+        end += pack->chunks[i].size;
+    }
+
+    if (!pack->blackthorne) {
+        if (end > UINT32_MAX)
+            goto too_big;
+        table[i] = htole32(end);
+    }
+
+    *r_table = table;
+    *r_table_size = table_size;
+    return 0;
+
+too_big:
+    free(table);
+    return -EFBIG;
+}
+
+/* Chunks which have not been replaced can be copied from the pack file */
+static bool chunk_in_file(struct lv_pack *pack, struct lv_chunk *chunk)
+{
+    return pack->fd_open && !chunk->replaced;
+}
+
+int lv_pack_save(struct lv_pack *pack, const char *filename)
+{
+    struct iovec *iov = NULL;
+    struct lv_chunk *chunk;
+    struct stat in_stat, out_stat;
+    uint32_t *table = NULL;
+    size_t table_size, i, run_size;
+    off_t run_start;
+    int fd, iov_count = 0, err;
+
+    err = build_chunk_table(pack, &table, &table_size);
+    if (err)
+        return err;
+
+    /* The offset table and every chunk */
+    iov = malloc((pack->num_chunks + 2) * sizeof(*iov));
+    if (!iov) {
+        err = -ENOMEM;
+        goto out;
+    }
+
+    fd = open(filename, O_WRONLY | O_CREAT, 0644);
+    if (fd < 0) {
+        err = -errno;
+        goto out;
+    }
+
+    /* Truncating the pack's own file would destroy the unchanged chunks */
+    if (pack->fd_open && fstat(pack->fd, &in_stat) == 0 &&
+        fstat(fd, &out_stat) == 0 && in_stat.st_dev == out_stat.st_dev &&
+        in_stat.st_ino == out_stat.st_ino) {
+        err = -EINVAL;
+        goto out_close;
+    }
+
+    if (ftruncate(fd, 0) < 0) {
+        err = -errno;
+        goto out_close;
+    }
+
+    iov[iov_count].iov_base = table;
+    iov[iov_count].iov_len = table_size;
+    iov_count++;
+
+    i = 0;
+    if (pack->blackthorne) {
+        chunk = &pack->chunks[0];
+        if (chunk->size > table_size) {
+            err = write_iov(fd, iov, iov_count);
+            if (!err)
+                err = copy_range(fd, pack->fd, table_size,
+                                 chunk->size - table_size);
+            if (err)
+                goto out_close;
+            iov_count = 0;
+        }
+        i = 1;
+    }
+
+    while (i < pack->num_chunks) {
+        chunk = &pack->chunks[i];
+
+        if (!chunk_in_file(pack, chunk)) {
+            /* Gather changed chunks and write them together */
+            iov[iov_count].iov_base = chunk->data;
+            iov[iov_count].iov_len = chunk->size;
+            iov_count++;
+            i++;
+            continue;
+        }
+
+        err = write_iov(fd, iov, iov_count);
+        if (err)
+            goto out_close;
+        iov_count = 0;
+
+        /* Unchanged chunks are contiguous in the pack file */
+        run_start = chunk->start;
+        run_size = 0;
+        while (i < pack->num_chunks && chunk_in_file(pack, &pack->chunks[i]))
+            run_size += pack->chunks[i++].size;
+
+        err = copy_range(fd, pack->fd, run_start, run_size);
+        if (err)
+            goto out_close;
+    }
+
+    err = write_iov(fd, iov, iov_count);
+
+out_close:
+    if (close(fd) < 0 && !err)
+        err = -errno;
+out:
+    free(iov);
+    free(table);
+    return err;
+}
+
+/*
+ * Add the move for a run of unchanged chunks. Runs moving towards the
+ * start of the file are moved first, in order, and runs moving towards the
+ * end are moved after them in reverse order. That way no run overwrites
+ * another run that has not been moved yet.
+ */
+static void add_run_move(struct lv_journal_step *steps, size_t *num_left,
+                         size_t *num_right, size_t max_moves, uint32_t src,
+                         uint64_t dst, uint64_t len)
+{
+    struct lv_journal_step *step;
+
+    if (len == 0 || src == dst)
+        return;
+
+    if (dst < src)
+        step = &steps[(*num_left)++];
+    else
+        step = &steps[max_moves - ++(*num_right)];
+
+    step->type = LV_JOURNAL_MOVE;
+    step->src = src;
+    step->dst = dst;
+    step->len = len;
+}
+
+int lv_pack_save_in_place(struct lv_pack *pack, const char *filename)
+{
+    struct lv_journal_step *steps = NULL, *step;
+    struct lv_chunk *chunk;
+    struct stat in_stat, out_stat;
+    uint32_t *table = NULL, run_src = 0;
+    size_t table_size, i, first, max_moves, num_left = 0, num_right = 0;
+    size_t num_steps, payload_size = 0;
+    uint64_t offset, run_dst = 0, run_len = 0;
+    uint8_t *payload = NULL;
+    int err;
+
+    /* The file must be the one the pack was loaded from */
+    if (!pack->fd_open || fstat(pack->fd, &in_stat) < 0 ||
+        stat(filename, &out_stat) < 0 || in_stat.st_dev != out_stat.st_dev ||
+        in_stat.st_ino != out_stat.st_ino)
+        return -EINVAL;
+
+    err = build_chunk_table(pack, &table, &table_size);
+    if (err)
+        return err;
+
+    /* At most one move per run, one write per chunk and the table */
+    max_moves = pack->num_chunks;
+    steps = calloc(max_moves + pack->num_chunks + 1, sizeof(*steps));
+    if (!steps) {
+        err = -ENOMEM;
+        goto out;
+    }
+
+    offset = table_size;
+    first = 0;
+    if (pack->blackthorne) {
+        /* Chunk zero is the header, which stays where it is */
+        offset = max(table_size, pack->chunks[0].size);
+        first = 1;
+    }
+
+    for (i = first; i < pack->num_chunks; i++) {
+        chunk = &pack->chunks[i];
+
+        if (chunk->replaced) {
+            add_run_move(steps, &num_left, &num_right, max_moves,
+                         run_src, run_dst, run_len);
+            run_len = 0;
+            payload_size += chunk->size;
+        } else {
+            if (run_len == 0) {
+                run_src = chunk->start;
+                run_dst = offset;
+            }
+            run_len += chunk->size;
+        }
+        offset += chunk->size;
+    }
+    add_run_move(steps, &num_left, &num_right, max_moves,
+                 run_src, run_dst, run_len);
+
+    /* Close the gap between the two groups of moves */
+    memmove(&steps[num_left], &steps[max_moves - num_right],
+            num_right * sizeof(*steps));
+    num_steps = num_left + num_right;
+
+    payload = malloc(payload_size + table_size);
+    if (!payload) {
+        err = -ENOMEM;
+        goto out;
+    }
+
+    /* The replaced chunks are written once everything else has moved */
+    payload_size = 0;
+    offset = pack->blackthorne ? max(table_size, pack->chunks[0].size) :
+        table_size;
+    for (i = first; i < pack->num_chunks; i++) {
+        chunk = &pack->chunks[i];
+
+        if (chunk->replaced) {
+            step = &steps[num_steps++];
+            step->type = LV_JOURNAL_WRITE;
+            step->src = payload_size;
+            step->dst = offset;
+            step->len = chunk->size;
+
+            memcpy(payload + payload_size, chunk->data, chunk->size);
+            payload_size += chunk->size;
+        }
+        offset += chunk->size;
+    }
+
+    step = &steps[num_steps++];
+    step->type = LV_JOURNAL_WRITE;
+    step->src = payload_size;
+    step->dst = 0;
+    step->len = table_size;
+    memcpy(payload + payload_size, table, table_size);
+    payload_size += table_size;
+
+    err = lv_journal_apply(filename, steps, num_steps, payload, payload_size,
+                           offset);
+
+out:
+    free(payload);
+    free(steps);
+    free(table);
+    return err;
+}
+
+int lv_pack_recover(const char *filename)
+{
+    int err;
+
+    err = lv_journal_recover(filename);
+    return err < 0 ? err : 0;
+}
+
+struct hash_job {
+    struct lv_chunk *chunk;
+    bool            decompressed;
+};
+
+static void hash_chunk(void *arg)
+{
+    struct hash_job *job = arg;
+    struct lv_chunk *chunk = job->chunk;
+    const uint8_t *data;
+
+    chunk->raw_hash = lv_hash(chunk->data, chunk->size);
+    chunk->hash = chunk->raw_hash;
+    chunk->canonical = chunk->index;
+
+    job->decompressed = lv_decompress_chunk_borrow(chunk, &data) == 0;
+    if (job->decompressed) {
+        chunk->hash = lv_hash(data, chunk->decompressed_size);
+        lv_decompress_chunk_put(chunk, data);
+    }
+}
+
+static int compare_chunk_hashes(const void *a, const void *b)
+{
+    const struct lv_chunk_hash *hash_a = a, *hash_b = b;
+
+    if (hash_a->hash != hash_b->hash)
+        return hash_a->hash < hash_b->hash ? -1 : 1;
+    return (hash_a->chunk_index > hash_b->chunk_index) -
+        (hash_a->chunk_index < hash_b->chunk_index);
+}
+
+/*
+ * Set the canonical chunk for each chunk in a run of index entries with the
+ * same hash. Chunks are only treated as duplicates if their data matches.
+ */
+static int find_duplicates(struct lv_pack *pack,
+                           const struct lv_chunk_hash *entries, size_t count)
+{
+    struct lv_chunk *first, *chunk;
+    const uint8_t *first_data, *data;
+    size_t i;
+    int err = 0;
+
+    first = &pack->chunks[entries[0].chunk_index];
+    if (lv_decompress_chunk_borrow(first, &first_data))
+        return -1;
+
+    for (i = 1; i < count; i++) {
+        chunk = &pack->chunks[entries[i].chunk_index];
+        if (chunk->decompressed_size != first->decompressed_size)
+            continue;
+
+        if (lv_decompress_chunk_borrow(chunk, &data)) {
+            err = -1;
+            break;
+        }
+        if (memcmp(data, first_data, chunk->decompressed_size) == 0)
+            chunk->canonical = first->index;
+        lv_decompress_chunk_put(chunk, data);
+    }
+
+    lv_decompress_chunk_put(first, first_data);
+    return err;
+}
+
+int lv_pack_hash_chunks(struct lv_pack *pack, unsigned num_threads)
+{
+    struct lv_workqueue wq;
+    struct hash_job *jobs;
+    size_t i, start, num_entries = 0;
+    int err = -1;
+
+    if (pack->hash_index)
+        return 0;
+
+    jobs = calloc(pack->num_chunks, sizeof(*jobs));
+    if (!jobs)
+        return -1;
+
+    /* Loading chunks is not thread safe, so load them all first */
+    for (i = 0; i < pack->num_chunks; i++) {
+        jobs[i].chunk = lv_pack_get_chunk(pack, i);
+        if (!jobs[i].chunk)
+            goto out;
+    }
+
+    if (lv_workqueue_init(&wq, num_threads))
+        goto out;
+    for (i = 0; i < pack->num_chunks; i++) {
+        if (lv_workqueue_add(&wq, hash_chunk, &jobs[i])) {
+            lv_workqueue_free(&wq);
+            goto out;
+        }
+    }
+    lv_workqueue_free(&wq);
+
+    pack->hash_index = malloc(pack->num_chunks * sizeof(*pack->hash_index));
+    if (!pack->hash_index)
+        goto out;
+
+    for (i = 0; i < pack->num_chunks; i++) {
+        pack->chunks[i].hashed = true;
+        if (!jobs[i].decompressed)
+            continue;
+
+        pack->hash_index[num_entries].hash = pack->chunks[i].hash;
+        pack->hash_index[num_entries].chunk_index = i;
+        num_entries++;
+    }
+
+    qsort(pack->hash_index, num_entries, sizeof(*pack->hash_index),
+          compare_chunk_hashes);
+    pack->num_hash_entries = num_entries;
+
+    for (start = 0; start < num_entries; start = i) {
+        for (i = start + 1; i < num_entries &&
+                 pack->hash_index[i].hash == pack->hash_index[start].hash; i++)
+            ;
+        if (i - start > 1 &&
+            find_duplicates(pack, &pack->hash_index[start], i - start))
+            goto out;
+    }
+
+    err = 0;
+out:
+    if (err) {
+        free(pack->hash_index);
+        pack->hash_index = NULL;
+        pack->num_hash_entries = 0;
+    }
+    free(jobs);
+    return err;
+}
+
+size_t lv_pack_find_hash(struct lv_pack *pack, uint64_t hash,
+                         const struct lv_chunk_hash **r_entries)
+{
+    size_t low = 0, high = pack->num_hash_entries, mid, count;
+
+    /* Find the first entry with the hash */
+    while (low < high) {
+        mid = low + (high - low) / 2;
+        if (pack->hash_index[mid].hash < hash)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+
+    for (count = 0; low + count < pack->num_hash_entries &&
+             pack->hash_index[low + count].hash == hash; count++)
+        ;
+
+    *r_entries = &pack->hash_index[low];
+    return count;
+}
+
+size_t lv_decompress_chunk_size(struct lv_chunk *chunk)
+{
+    return chunk->decompressed_size;
+}
+
+int lv_decompress_chunk_into(struct lv_chunk *chunk, uint8_t *dst,
+                             size_t dst_size)
+{
+    if (chunk->size < chunk->data_offset ||
+        dst_size < chunk->decompressed_size)
+        return -1;
+
+    if (chunk->storage == LV_CHUNK_STORAGE_STORED) {
+        if (!stored_chunk_valid(chunk))
             return -1;
+        memcpy(dst, chunk->data + chunk->data_offset,
+               chunk->decompressed_size);
+        return 0;
+    }
+
+    /* Skip the header in the chunk */
+    return lv_decompress(chunk->data + chunk->data_offset,
+                         chunk->size - chunk->data_offset,
+                         dst, chunk->decompressed_size);
+}
 
-        memcpy(chunk->data, buf.data + chunk->start, chunk->size);
+int lv_decompress_chunk_stream(struct lv_chunk *chunk,
+                               struct lv_decompress_stream *stream)
+{
+    if (chunk->size < chunk->data_offset ||
+        chunk->storage == LV_CHUNK_STORAGE_STORED)
+        return -1;
+
+    lv_decompress_stream_init(stream);
+    lv_decompress_stream_input(stream, chunk->data + chunk->data_offset,
+                               chunk->size - chunk->data_offset);
+    return 0;
+}
+
+int lv_decompress_chunk_range(struct lv_chunk *chunk, size_t offset,
+                              uint8_t *dst, size_t dst_size)
+{
+    const uint8_t *src;
+    size_t src_size;
+
+    if (chunk->size < chunk->data_offset)
+        return -1;
+
+    src = (const uint8_t *)chunk->data + chunk->data_offset;
+    src_size = chunk->size - chunk->data_offset;
+
+    if (chunk->storage == LV_CHUNK_STORAGE_STORED) {
+        if (offset > src_size || dst_size > src_size - offset)
+            return -1;
+        memcpy(dst, src + offset, dst_size);
+        return 0;
     }
 
+    /*
+     * Chunks no larger than the checkpoint interval only get a checkpoint
+     * at the start, which is cheap to build.
+     */
+    if (!chunk->checkpoints) {
+        chunk->checkpoints = malloc(sizeof(*chunk->checkpoints));
+        if (!chunk->checkpoints)
+            return -1;
+        if (lv_decompress_index_build(chunk->checkpoints, src, src_size,
+                                      chunk->decompressed_size,
+                                      LV_PACK_CHECKPOINT_INTERVAL)) {
+            free(chunk->checkpoints);
+            chunk->checkpoints = NULL;
+            return -1;
+        }
+    }
+
+    return lv_decompress_range(chunk->checkpoints, src, src_size, offset,
+                               dst, dst_size);
+}
+
+int lv_decompress_chunk_borrow(struct lv_chunk *chunk, const uint8_t **r_data)
+{
+    uint8_t *data;
+
+    if (chunk->storage == LV_CHUNK_STORAGE_STORED) {
+        if (!stored_chunk_valid(chunk))
+            return -1;
+        *r_data = (const uint8_t *)chunk->data + chunk->data_offset;
+        return 0;
+    }
+
+    if (lv_decompress_chunk(chunk, &data))
+        return -1;
+    *r_data = data;
     return 0;
 }
 
-struct lv_chunk *lv_pack_get_chunk(struct lv_pack *pack, unsigned chunk_index)
+void lv_decompress_chunk_put(struct lv_chunk *chunk, const uint8_t *data)
 {
-    if (chunk_index >= pack->num_chunks)
-        return NULL;
-    return &pack->chunks[chunk_index];
+    if (chunk->storage != LV_CHUNK_STORAGE_STORED)
+        free((void *)data);
 }
 
 int lv_decompress_chunk(struct lv_chunk *chunk, uint8_t **dst)
@@ -139,9 +1334,26 @@ int lv_decompress_chunk(struct lv_chunk *chunk, uint8_t **dst)
     if (!(*dst))
         return -1;
 
-    /* Skip the header in the chunk */
-    lv_decompress(chunk->data + chunk->data_offset,
-                  chunk->size - chunk->data_offset,
-                  *dst, chunk->decompressed_size);
+    if (lv_decompress_chunk_into(chunk, *dst, chunk->decompressed_size)) {
+        free(*dst);
+        *dst = NULL;
+        return -1;
+    }
+
+    return 0;
+}
+
+int lv_decompress_chunk_arena(struct lv_chunk *chunk, struct lv_arena *arena,
+                              uint8_t **dst)
+{
+    *dst = lv_arena_alloc(arena, chunk->decompressed_size);
+    if (!(*dst))
+        return -1;
+
+    if (lv_decompress_chunk_into(chunk, *dst, chunk->decompressed_size)) {
+        *dst = NULL;
+        return -1;
+    }
+
     return 0;
 }
@@ -20,6 +20,12 @@
 #include <stdint.h>
 #include <stdio.h>
 
+struct lv_decompress_stream;
+struct lv_decompress_index;
+struct lv_arena;
+struct lv_resource;
+struct lv_workqueue;
+
 /**
  * \defgroup lv_pack Pack file
  * \{
@@ -29,6 +35,15 @@
  * LZSS compression.
  */
 
+/** How a chunk's data is stored in the data file. */
+enum {
+    /** The data following the chunk's size header is LZSS compressed. */
+    LV_CHUNK_STORAGE_COMPRESSED,
+
+    /** The data following the chunk's size header is stored as is. */
+    LV_CHUNK_STORAGE_STORED,
+};
+
 /** Representation of a single data file chunk. */
 struct lv_chunk {
     /** Chunk index. */
@@ -57,6 +72,90 @@ struct lv_chunk {
      * is not used.
      */
     size_t           decompressed_size;
+
+    /**
+     * How the chunk's data is stored (LV_CHUNK_STORAGE_*). This is
+     * detected when the chunk is loaded, unless it has been declared with
+     * \ref lv_pack_set_chunk_storage. Chunks whose data is exactly the
+     * decompressed size are detected as stored.
+     */
+    unsigned         storage;
+
+    /** Set if the storage kind was declared rather than detected. */
+    bool             storage_declared;
+
+    /**
+     * Set if the chunk data is allocated and owned by the chunk. Otherwise
+     * the data points into the pack file's data.
+     */
+    bool             owned;
+
+    /**
+     * Set once the chunk's header and data have been loaded. Chunks in
+     * lazily loaded packs are loaded by \ref lv_pack_get_chunk.
+     */
+    bool             loaded;
+
+    /** Set if the chunk data has been replaced. */
+    bool             replaced;
+
+    /** Decompressed data cached by \ref lv_pack_cache_get, or NULL. */
+    uint8_t          *cache_data;
+
+    /** Number of references to the cached decompressed data. */
+    unsigned         cache_refs;
+
+    /** Unreferenced cache entries, most recently used first. */
+    struct lv_chunk  *cache_prev, *cache_next;
+
+    /**
+     * Checkpoint index for random access to the decompressed data, or
+     * NULL. Built by \ref lv_decompress_chunk_range when first needed.
+     */
+    struct lv_decompress_index *checkpoints;
+
+    /** Hash of the raw chunk data. See \ref lv_pack_hash_chunks. */
+    uint64_t         raw_hash;
+
+    /**
+     * Hash of the decompressed chunk data, or of the raw data if the chunk
+     * cannot be decompressed.
+     */
+    uint64_t         hash;
+
+    /**
+     * Index of the first chunk with the same decompressed data. This is
+     * the chunk's own index if no earlier chunk has the same data. Only
+     * valid while the pack has a hash index.
+     */
+    unsigned         canonical;
+
+    /** Set once the hashes are valid. Replacing the chunk clears this. */
+    bool             hashed;
+};
+
+/** Entry in a pack's content hash index. */
+struct lv_chunk_hash {
+    /** Hash of the chunk's decompressed data. */
+    uint64_t         hash;
+
+    /** Index of the chunk. */
+    unsigned         chunk_index;
+};
+
+/** Decompressed chunk cache statistics. */
+struct lv_pack_cache_stats {
+    /** Number of lookups that found the chunk already decompressed. */
+    unsigned long    hits;
+
+    /** Number of lookups that had to decompress the chunk. */
+    unsigned long    misses;
+
+    /** Number of decompressed chunks evicted to stay within the budget. */
+    unsigned long    evictions;
+
+    /** Total size of the cached decompressed data. */
+    size_t           size;
 };
 
 /** Representation of the The Lost Vikings DATA.DAT pack file. */
@@ -69,10 +168,95 @@ struct lv_pack {
 
     /** Number of chunks. */
     size_t           num_chunks;
+
+    /** Pack file data. Unmodified chunks point directly into this. */
+    void             *data;
+
+    /** Size of the pack file data. */
+    size_t           size;
+
+    /** Is the pack file data memory mapped, rather than read into memory? */
+    bool             mapped;
+
+    /**
+     * Pack file descriptor. Used to read lazily loaded chunks and to copy
+     * unchanged chunks when saving the pack. Only valid if fd_open is set.
+     */
+    int              fd;
+
+    /** Is fd open? A zeroed pack which was never loaded has no file. */
+    bool             fd_open;
+
+    /**
+     * Maximum size of unreferenced decompressed data kept in the cache.
+     * See \ref lv_pack_cache_set_budget.
+     */
+    size_t           cache_budget;
+
+    /** Cache statistics. */
+    struct lv_pack_cache_stats cache_stats;
+
+    /** Unreferenced cache entries, most and least recently used. */
+    struct lv_chunk  *cache_head, *cache_tail;
+
+    /**
+     * Chunks which can be decompressed, sorted by the hash of their
+     * decompressed data and then by chunk index. Built by
+     * \ref lv_pack_hash_chunks, or NULL.
+     */
+    struct lv_chunk_hash *hash_index;
+
+    /** Number of entries in the hash index. */
+    size_t           num_hash_entries;
+
+    /** Resources shared between levels. See \ref lv_resource. */
+    struct lv_resource *resources;
+
+    /**
+     * Set if the chunks were set up from the pack's index file, so their
+     * headers do not need to be read when they are loaded.
+     */
+    bool             indexed;
 };
 
 /**
- * Load a Lost Vikings pack file (DATA.DAT).
+ * Number of decompressed bytes between checkpoints in a chunk's random
+ * access index.
+ */
+#define LV_PACK_CHECKPOINT_INTERVAL (16 * 1024)
+
+/** Default decompressed chunk cache budget for a newly loaded pack. */
+#define LV_PACK_DEFAULT_CACHE_BUDGET   (1024 * 1024)
+
+/** Read the pack file into memory rather than memory mapping it. */
+#define LV_PACK_LOAD_NO_MMAP      (1 << 0)
+
+/** Hint that most chunks will be accessed in order, e.g. for repacking. */
+#define LV_PACK_LOAD_SEQUENTIAL   (1 << 1)
+
+/** Hint that only a few chunks will be accessed, e.g. for viewers. */
+#define LV_PACK_LOAD_RANDOM       (1 << 2)
+
+/**
+ * Only read the chunk offset table when loading. Each chunk's header and
+ * data are loaded on the first call to \ref lv_pack_get_chunk for it. A
+ * chunk's start and size are set from the offset table, but its
+ * decompressed size and storage kind come from the chunk header, so they
+ * are not valid until then.
+ */
+#define LV_PACK_LOAD_LAZY         (1 << 3)
+
+/**
+ * Use the pack's index file if it is up to date, see \ref lv_index. The
+ * chunk sizes, decompressed sizes, storage kinds and any content hashes are
+ * then valid without reading any chunk data, even for lazily loaded packs.
+ * The pack is loaded normally if there is no usable index.
+ */
+#define LV_PACK_LOAD_INDEX        (1 << 4)
+
+/**
+ * Load a Lost Vikings pack file (DATA.DAT). The pack file is memory mapped
+ * read-only and the chunk data is not copied.
  *
  * \param filename    Filename.
  * \param pack        Pack file structure.
@@ -82,7 +266,26 @@ struct lv_pack {
 int lv_pack_load(const char *filename, struct lv_pack *pack, bool blackthorne);
 
 /**
- * Get a chunk from a pack file.
+ * Load a Lost Vikings pack file (DATA.DAT) with load flags.
+ *
+ * \param filename    Filename.
+ * \param pack        Pack file structure.
+ * \param blackthorne Is the pack file in the Blackthorne format?
+ * \param flags       LV_PACK_LOAD_* flags.
+ * \returns           0 for success.
+ */
+int lv_pack_load_flags(const char *filename, struct lv_pack *pack,
+                       bool blackthorne, unsigned flags);
+
+/**
+ * Free a pack file, including any replaced chunk data.
+ *
+ * \param pack        Pack file.
+ */
+void lv_pack_free(struct lv_pack *pack);
+
+/**
+ * Get a chunk from a pack file. The chunk is loaded if needed.
  *
  * \param pack        Pack file.
  * \param chunk_index Index of the chunk to get.
@@ -91,7 +294,249 @@ int lv_pack_load(const char *filename, struct lv_pack *pack, bool blackthorne);
 struct lv_chunk *lv_pack_get_chunk(struct lv_pack *pack, unsigned chunk_index);
 
 /**
- * Decompress the data for a chunk.
+ * Release the data for a chunk which is no longer needed. The chunk will be
+ * loaded again by the next \ref lv_pack_get_chunk call. Replaced chunks are
+ * not released.
+ *
+ * \param pack        Pack file.
+ * \param chunk       Chunk to release.
+ */
+void lv_pack_release_chunk(struct lv_pack *pack, struct lv_chunk *chunk);
+
+/**
+ * Replace the data for a chunk. The chunk takes ownership of the data,
+ * which must have been allocated with malloc. The data should include
+ * the chunk's decompressed size header, which is used to update the
+ * chunk's decompressed size. Cached decompressed data and shared resources
+ * for the chunk are dropped. The chunk cannot be replaced while it has
+ * cache references, in which case the caller keeps ownership of the data.
+ *
+ * \param pack        Pack file.
+ * \param chunk       Chunk to replace.
+ * \param data        New chunk data.
+ * \param size        Size of the new chunk data.
+ * \returns           0 for success, or -EBUSY if the chunk's data is
+ *                    referenced.
+ */
+int lv_pack_replace_chunk(struct lv_pack *pack, struct lv_chunk *chunk,
+                          void *data, size_t size);
+
+/**
+ * Write a pack file, in the same format as the pack was loaded from. The
+ * chunk offsets are recalculated, but the chunks' start offsets are left
+ * referring to the loaded pack file. Chunks which have not been replaced
+ * are copied directly from the loaded pack file, so the cost of saving is
+ * mostly the size of the replaced chunks. The output file must not be the
+ * loaded pack file.
+ *
+ * \param pack        Pack file.
+ * \param filename    Filename to write to.
+ * \returns           0 for success, or a negative errno value.
+ */
+int lv_pack_save(struct lv_pack *pack, const char *filename);
+
+/**
+ * Save a pack back to the file it was loaded from, changing only what has
+ * to change. The offset table and the replaced chunks are rewritten, and
+ * the unchanged chunks after a replaced chunk are moved if its size
+ * changed. The update is recorded in a journal file named after the pack
+ * file with a ".journal" suffix, so if it is interrupted it can be
+ * finished by \ref lv_pack_recover.
+ *
+ * The pack file is changed underneath the loaded pack, so the pack must be
+ * freed and loaded again before it is used after this.
+ *
+ * \param pack        Pack file.
+ * \param filename    Filename the pack was loaded from.
+ * \returns           0 for success, or a negative errno value.
+ */
+int lv_pack_save_in_place(struct lv_pack *pack, const char *filename);
+
+/**
+ * Finish an in-place save of a pack file which was interrupted, for
+ * example by a crash. This should be called before loading a pack file
+ * which may have been saved in place. It does nothing if there is no
+ * unfinished save.
+ *
+ * \param filename    Pack filename.
+ * \returns           0 for success, or a negative errno value.
+ */
+int lv_pack_recover(const char *filename);
+
+/**
+ * Declare how a chunk's data is stored, overriding the detected storage
+ * kind. A compressed chunk whose data happens to be exactly its
+ * decompressed size would otherwise be detected as stored.
+ *
+ * The storage cannot be changed while the chunk's data is in use, so this
+ * should be called before \ref lv_pack_cache_get for the chunk, or after
+ * every reference has been released with \ref lv_pack_cache_put.
+ *
+ * \param pack        Pack file.
+ * \param chunk_index Index of the chunk.
+ * \param storage     Storage kind (LV_CHUNK_STORAGE_*).
+ * \returns           0 for success, -EINVAL if the chunk index is invalid,
+ *                    or -EBUSY if the chunk's data is referenced.
+ */
+int lv_pack_set_chunk_storage(struct lv_pack *pack, unsigned chunk_index,
+                              unsigned storage);
+
+/**
+ * Set the maximum size of unreferenced decompressed chunk data kept by the
+ * pack's cache. Least recently used chunks are evicted to stay within the
+ * budget. A budget of zero disables caching of unreferenced chunks.
+ *
+ * \param pack        Pack file.
+ * \param budget      Cache budget in bytes.
+ */
+void lv_pack_cache_set_budget(struct lv_pack *pack, size_t budget);
+
+/**
+ * Get the decompressed data for a chunk from the pack's cache,
+ * decompressing it if needed. The returned data is shared and must not be
+ * modified. Each call must be balanced by a call to \ref lv_pack_cache_put.
+ * The data for stored chunks is not copied or counted against the cache
+ * budget, and the chunk is not released while it is referenced.
+ *
+ * \param pack        Pack file.
+ * \param chunk_index Index of the chunk to get.
+ * \param r_size      Returned decompressed size. May be NULL.
+ * \returns           Decompressed data or NULL on error.
+ */
+const uint8_t *lv_pack_cache_get(struct lv_pack *pack, unsigned chunk_index,
+                                 size_t *r_size);
+
+/**
+ * Drop a reference to a chunk's cached decompressed data. Puts for an
+ * invalid chunk index or an unreferenced chunk are ignored.
+ *
+ * \param pack        Pack file.
+ * \param chunk_index Index of the chunk.
+ */
+void lv_pack_cache_put(struct lv_pack *pack, unsigned chunk_index);
+
+/**
+ * Get the decompressed data for several chunks from the pack's cache, as
+ * if by calling \ref lv_pack_cache_get for each. Chunks which are not
+ * cached are decompressed in parallel on a work queue. The chunks are
+ * loaded on the calling thread, which must be the only thread using the
+ * pack. This waits for all of the work on the queue, including any work
+ * the caller queued beforehand.
+ *
+ * \param pack          Pack file.
+ * \param chunk_indices Indices of the chunks to get. May contain
+ *                      duplicates, each of which takes a reference.
+ * \param r_data        Returned decompressed data for each chunk, or NULL
+ *                      for chunks which could not be loaded. A reference
+ *                      is only taken to chunks with non-NULL data.
+ * \param count         Number of chunks.
+ * \param wq            Work queue to decompress the chunks on.
+ * \returns             0 if every chunk was loaded, or -1 if any failed.
+ */
+int lv_pack_cache_get_many(struct lv_pack *pack, const unsigned *chunk_indices,
+                           const uint8_t **r_data, size_t count,
+                           struct lv_workqueue *wq);
+
+/**
+ * Hash the raw and decompressed data of every chunk, and build the pack's
+ * content hash index. The chunks are hashed in parallel. Each chunk's
+ * canonical index is set to the first chunk with identical decompressed
+ * data, which is checked by comparing the data rather than trusting the
+ * hashes. Replacing a chunk drops the index. Nothing is done if the pack
+ * already has a hash index, for example one loaded from its index file.
+ *
+ * \param pack        Pack file.
+ * \param num_threads Number of threads to use, or 0 for one per CPU.
+ * \returns           0 for success.
+ */
+int lv_pack_hash_chunks(struct lv_pack *pack, unsigned num_threads);
+
+/**
+ * Find the chunks whose decompressed data has a given hash.
+ * \ref lv_pack_hash_chunks must have been called first.
+ *
+ * \param pack        Pack file.
+ * \param hash        Hash of the decompressed data.
+ * \param r_entries   Returned hash index entries, sorted by chunk index.
+ * \returns           Number of entries, which is zero if none match.
+ */
+size_t lv_pack_find_hash(struct lv_pack *pack, uint64_t hash,
+                         const struct lv_chunk_hash **r_entries);
+
+/**
+ * Get the size of the buffer needed to decompress a chunk.
+ *
+ * \param chunk   Chunk to get the decompressed size of.
+ * \returns       Decompressed size in bytes.
+ */
+size_t lv_decompress_chunk_size(struct lv_chunk *chunk);
+
+/**
+ * Decompress the data for a chunk into a caller provided buffer.
+ *
+ * \param chunk    Chunk to decompress.
+ * \param dst      Destination buffer to decompress into.
+ * \param dst_size Size of the destination buffer. This must be at least
+ *                 \ref lv_decompress_chunk_size bytes.
+ * \returns        0 for success.
+ */
+int lv_decompress_chunk_into(struct lv_chunk *chunk, uint8_t *dst,
+                             size_t dst_size);
+
+/**
+ * Initialise an incremental decoder to decompress a compressed chunk.
+ * Stored chunks cannot be streamed and should be read directly. Decompressed
+ * data can then be read in pieces using \ref lv_decompress_stream_read,
+ * for up to \ref lv_decompress_chunk_size bytes. The chunk's data must not
+ * be released or replaced while the decoder is in use.
+ *
+ * \param chunk   Chunk to decompress.
+ * \param stream  Decoder to initialise.
+ * \returns       0 for success.
+ */
+int lv_decompress_chunk_stream(struct lv_chunk *chunk,
+                               struct lv_decompress_stream *stream);
+
+/**
+ * Decompress part of a chunk's data. The first time this is called for a
+ * chunk a checkpoint index is built. For chunks larger than
+ * \ref LV_PACK_CHECKPOINT_INTERVAL this decompresses the whole chunk once.
+ * Later calls only decompress from the nearest checkpoint before the
+ * requested range.
+ *
+ * \param chunk    Chunk to decompress.
+ * \param offset   Offset in the decompressed data to start at.
+ * \param dst      Destination buffer to decompress into.
+ * \param dst_size Number of bytes to decompress.
+ * \returns        0 for success.
+ */
+int lv_decompress_chunk_range(struct lv_chunk *chunk, size_t offset,
+                              uint8_t *dst, size_t dst_size);
+
+/**
+ * Get the decompressed data for a chunk without copying it if possible.
+ * Stored chunks return a pointer to the chunk's data, and compressed
+ * chunks are decompressed into a new buffer. Either way the data must be
+ * given back with \ref lv_decompress_chunk_put.
+ *
+ * \param chunk   Chunk to get the data for.
+ * \param r_data  Returned decompressed data. This must not be modified.
+ * \returns       0 for success.
+ */
+int lv_decompress_chunk_borrow(struct lv_chunk *chunk, const uint8_t **r_data);
+
+/**
+ * Give back data returned by \ref lv_decompress_chunk_borrow.
+ *
+ * \param chunk   Chunk the data is for.
+ * \param data    Data to give back.
+ */
+void lv_decompress_chunk_put(struct lv_chunk *chunk, const uint8_t *data);
+
+/**
+ * Decompress the data for a chunk. Stored chunks are copied, since callers
+ * free the returned buffer. Use \ref lv_decompress_chunk_borrow to read a
+ * stored chunk's data without copying it.
  *
  * \param chunk   Chunk to decompress.
  * \param dst     Destination buffer to decompress into. This buffer will
@@ -100,6 +545,17 @@ struct lv_chunk *lv_pack_get_chunk(struct lv_pack *pack, unsigned chunk_index);
  */
 int lv_decompress_chunk(struct lv_chunk *chunk, uint8_t **dst);
 
+/**
+ * Decompress the data for a chunk into memory allocated from an arena.
+ *
+ * \param chunk   Chunk to decompress.
+ * \param arena   Arena to allocate the decompressed data from.
+ * \param dst     Returned decompressed data. It is freed with the arena.
+ * \returns       0 for success.
+ */
+int lv_decompress_chunk_arena(struct lv_chunk *chunk, struct lv_arena *arena,
+                              uint8_t **dst);
+
 /** \} */
 
 #endif /* _LV_PACK_H */
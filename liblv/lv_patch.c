@@ -0,0 +1,444 @@
+/*
+ * This file is part of The Lost Vikings Library/Tools
+ *
+ * Ryan Mallon, 2016, <rmallon@gmail.com>
+ *
+ * To the extent possible under law, the author(s) have dedicated all
+ * copyright and related and neighboring rights to this software to
+ * the public domain worldwide. This software is distributed without
+ * any warranty.  You should have received a copy of the CC0 Public
+ * Domain Dedication along with this software. If not, see
+ *
+ * <http://creativecommons.org/publicdomain/zero/1.0/>.
+ *
+ */
+
+#include <sys/types.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+
+#include "lv_patch.h"
+#include "lv_pack.h"
+#include "lv_hash.h"
+#include "lv_resource.h"
+#include "lv_workqueue.h"
+#include "buffer.h"
+
+/*
+ * Patch file layout. All values are little endian.
+ *
+ *   header
+ *   entries, each followed by its data
+ *
+ * Entries are in increasing chunk index order, and each chunk has at most
+ * one entry.
+ */
+#define PATCH_MAGIC         0x5450564c /* "LVPT" */
+#define PATCH_VERSION       1
+#define PATCH_BLACKTHORNE   (1 << 0)
+
+/* Changed chunks which are cheaper to store as a range of bytes */
+#define PATCH_RANGE_OVERHEAD 64
+
+enum {
+    /* The new chunk data follows the entry */
+    PATCH_ENTRY_DATA,
+
+    /* The new chunk is a copy of original chunk arg */
+    PATCH_ENTRY_COPY,
+
+    /* The new chunk is the original chunk with the bytes at offset arg */
+    PATCH_ENTRY_RANGE,
+};
+
+struct patch_header {
+    uint32_t    magic;
+    uint32_t    version;
+    uint32_t    flags;
+    uint32_t    num_chunks;
+    uint32_t    num_entries;
+};
+
+struct patch_entry {
+    uint32_t    chunk_index;
+    uint32_t    type;
+    uint64_t    old_hash;
+    uint64_t    new_hash;
+    uint32_t    arg;
+    uint32_t    size;
+};
+
+/* Comparison of a single chunk, run on the work queue */
+struct diff_job {
+    struct lv_chunk *old_chunk;
+    struct lv_chunk *new_chunk;
+    uint64_t        old_hash;
+    uint64_t        new_hash;
+    bool            changed;
+
+    /* Range of bytes which differ, for chunks which did not change size */
+    size_t          range_start, range_end;
+};
+
+static void diff_chunk(void *arg)
+{
+    struct diff_job *job = arg;
+    const uint8_t *old_data = job->old_chunk->data;
+    const uint8_t *new_data = job->new_chunk->data;
+    size_t size = job->new_chunk->size;
+
+    job->old_hash = lv_hash(old_data, job->old_chunk->size);
+    job->new_hash = lv_hash(new_data, size);
+
+    /* Only chunks with matching hashes need their bytes compared */
+    job->changed = job->old_hash != job->new_hash ||
+        job->old_chunk->size != size || memcmp(old_data, new_data, size);
+    if (!job->changed || job->old_chunk->size != size)
+        return;
+
+    for (job->range_start = 0; old_data[job->range_start] ==
+             new_data[job->range_start]; job->range_start++)
+        ;
+    for (job->range_end = size; old_data[job->range_end - 1] ==
+             new_data[job->range_end - 1]; job->range_end--)
+        ;
+}
+
+static int compare_diff_jobs(const void *a, const void *b)
+{
+    const struct diff_job *job_a = *(struct diff_job **)a;
+    const struct diff_job *job_b = *(struct diff_job **)b;
+
+    if (job_a->old_hash != job_b->old_hash)
+        return job_a->old_hash < job_b->old_hash ? -1 : 1;
+    return (job_a->old_chunk->index > job_b->old_chunk->index) -
+        (job_a->old_chunk->index < job_b->old_chunk->index);
+}
+
+/* Find an original chunk with the same data as a new chunk */
+static struct lv_chunk *find_old_chunk(struct diff_job **sorted,
+                                       size_t num_chunks,
+                                       struct lv_chunk *chunk, uint64_t hash)
+{
+    size_t low = 0, high = num_chunks, mid;
+    struct lv_chunk *old_chunk;
+
+    while (low < high) {
+        mid = low + (high - low) / 2;
+        if (sorted[mid]->old_hash < hash)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+
+    for (; low < num_chunks && sorted[low]->old_hash == hash; low++) {
+        old_chunk = sorted[low]->old_chunk;
+        if (old_chunk->size == chunk->size &&
+            memcmp(old_chunk->data, chunk->data, chunk->size) == 0)
+            return old_chunk;
+    }
+
+    return NULL;
+}
+
+static int write_entry(FILE *fd, struct diff_job *job, uint32_t type,
+                       uint32_t arg, const void *data, size_t size)
+{
+    uint8_t entry[sizeof(struct patch_entry)];
+
+    put_le32(&entry[0], job->new_chunk->index);
+    put_le32(&entry[4], type);
+    put_le64(&entry[8], job->old_hash);
+    put_le64(&entry[16], job->new_hash);
+    put_le32(&entry[24], arg);
+    put_le32(&entry[28], size);
+
+    if (fwrite(entry, sizeof(entry), 1, fd) != 1 ||
+        (size && fwrite(data, size, 1, fd) != 1))
+        return -EIO;
+    return 0;
+}
+
+static int write_patch(struct lv_pack *new_pack, struct diff_job *jobs,
+                       struct diff_job **sorted, const char *filename,
+                       struct lv_patch_stats *stats)
+{
+    uint8_t header[sizeof(struct patch_header)];
+    struct lv_chunk *chunk, *old_chunk;
+    struct diff_job *job;
+    size_t i, range_size;
+    FILE *fd;
+    int err = 0;
+
+    fd = fopen(filename, "w");
+    if (!fd)
+        return -errno;
+
+    put_le32(&header[0], PATCH_MAGIC);
+    put_le32(&header[4], PATCH_VERSION);
+    put_le32(&header[8], new_pack->blackthorne ? PATCH_BLACKTHORNE : 0);
+    put_le32(&header[12], new_pack->num_chunks);
+    put_le32(&header[16], stats->num_changed);
+    if (fwrite(header, sizeof(header), 1, fd) != 1)
+        err = -EIO;
+
+    for (i = 0; !err && i < new_pack->num_chunks; i++) {
+        job = &jobs[i];
+        if (!job->changed)
+            continue;
+
+        chunk = job->new_chunk;
+        range_size = job->range_end - job->range_start;
+        old_chunk = find_old_chunk(sorted, new_pack->num_chunks, chunk,
+                                   job->new_hash);
+
+        if (old_chunk) {
+            err = write_entry(fd, job, PATCH_ENTRY_COPY, old_chunk->index,
+                              NULL, 0);
+            stats->num_copies++;
+        } else if (job->old_chunk->size == chunk->size &&
+                   range_size + PATCH_RANGE_OVERHEAD < chunk->size) {
+            err = write_entry(fd, job, PATCH_ENTRY_RANGE, job->range_start,
+                              chunk->data + job->range_start, range_size);
+            stats->num_ranges++;
+        } else {
+            err = write_entry(fd, job, PATCH_ENTRY_DATA, 0, chunk->data,
+                              chunk->size);
+        }
+    }
+
+    if (!err && fflush(fd) != 0)
+        err = -errno;
+    stats->size = ftell(fd);
+    if (fclose(fd) != 0 && !err)
+        err = -errno;
+    return err;
+}
+
+int lv_patch_create(struct lv_pack *old_pack, struct lv_pack *new_pack,
+                    const char *filename, unsigned num_threads,
+                    struct lv_patch_stats *stats)
+{
+    struct lv_patch_stats local_stats;
+    struct diff_job *jobs, **sorted = NULL;
+    struct lv_workqueue wq;
+    size_t i;
+    int err = -ENOMEM;
+
+    if (old_pack->num_chunks != new_pack->num_chunks ||
+        old_pack->blackthorne != new_pack->blackthorne)
+        return -EINVAL;
+
+    if (!stats)
+        stats = &local_stats;
+    memset(stats, 0, sizeof(*stats));
+
+    jobs = calloc(new_pack->num_chunks, sizeof(*jobs));
+    sorted = malloc(new_pack->num_chunks * sizeof(*sorted));
+    if (!jobs || !sorted)
+        goto out;
+
+    /* Loading chunks is not thread safe, so load them all first */
+    err = -EIO;
+    for (i = 0; i < new_pack->num_chunks; i++) {
+        jobs[i].old_chunk = lv_pack_get_chunk(old_pack, i);
+        jobs[i].new_chunk = lv_pack_get_chunk(new_pack, i);
+        if (!jobs[i].old_chunk || !jobs[i].new_chunk)
+            goto out;
+        sorted[i] = &jobs[i];
+    }
+
+    err = lv_workqueue_init(&wq, num_threads);
+    if (err)
+        goto out;
+    for (i = 0; i < new_pack->num_chunks; i++) {
+        err = lv_workqueue_add(&wq, diff_chunk, &jobs[i]);
+        if (err)
+            break;
+    }
+    lv_workqueue_free(&wq);
+    if (err)
+        goto out;
+
+    /*
+     * Blackthorne's chunk zero is the offset table, which is rebuilt when
+     * the patched pack is saved.
+     */
+    if (new_pack->blackthorne)
+        jobs[0].changed = false;
+
+    for (i = 0; i < new_pack->num_chunks; i++)
+        if (jobs[i].changed)
+            stats->num_changed++;
+
+    /* Sorted by original hash to find changed chunks which are copies */
+    qsort(sorted, new_pack->num_chunks, sizeof(*sorted), compare_diff_jobs);
+
+    err = write_patch(new_pack, jobs, sorted, filename, stats);
+
+out:
+    free(sorted);
+    free(jobs);
+    return err;
+}
+
+/* Build the new data for a chunk from a patch entry */
+static int patch_chunk(struct lv_pack *pack, const struct patch_entry *entry,
+                       const uint8_t *data, uint8_t **r_data, size_t *r_size)
+{
+    struct lv_chunk *chunk, *src;
+    uint8_t *new_data;
+    size_t size;
+
+    chunk = lv_pack_get_chunk(pack, entry->chunk_index);
+    if (!chunk || lv_hash(chunk->data, chunk->size) != entry->old_hash)
+        return -EINVAL;
+
+    switch (entry->type) {
+    case PATCH_ENTRY_DATA:
+        size = entry->size;
+        new_data = malloc(size);
+        if (!new_data)
+            return -ENOMEM;
+        memcpy(new_data, data, size);
+        break;
+
+    case PATCH_ENTRY_COPY:
+        src = lv_pack_get_chunk(pack, entry->arg);
+        if (!src)
+            return -EINVAL;
+        size = src->size;
+        new_data = malloc(size);
+        if (!new_data)
+            return -ENOMEM;
+        memcpy(new_data, src->data, size);
+        break;
+
+    case PATCH_ENTRY_RANGE:
+        if (entry->arg > chunk->size ||
+            entry->size > chunk->size - entry->arg)
+            return -EINVAL;
+        size = chunk->size;
+        new_data = malloc(size);
+        if (!new_data)
+            return -ENOMEM;
+        memcpy(new_data, chunk->data, size);
+        memcpy(new_data + entry->arg, data, entry->size);
+        break;
+
+    default:
+        return -EINVAL;
+    }
+
+    if (lv_hash(new_data, size) != entry->new_hash) {
+        free(new_data);
+        return -EINVAL;
+    }
+
+    *r_data = new_data;
+    *r_size = size;
+    return 0;
+}
+
+int lv_patch_apply(struct lv_pack *pack, const char *filename,
+                   unsigned *r_changed)
+{
+    struct patch_header header;
+    struct patch_entry *entries = NULL;
+    uint8_t **new_data = NULL;
+    size_t *new_sizes = NULL;
+    struct buffer buf;
+    unsigned i, num_done = 0;
+    int err;
+
+    err = buffer_init_from_file(&buf, filename);
+    if (err)
+        return err;
+
+    err = -EINVAL;
+    if (buf.size < sizeof(header))
+        goto out;
+
+    buffer_get_le32(&buf, &header.magic);
+    buffer_get_le32(&buf, &header.version);
+    buffer_get_le32(&buf, &header.flags);
+    buffer_get_le32(&buf, &header.num_chunks);
+    buffer_get_le32(&buf, &header.num_entries);
+
+    if (header.magic != PATCH_MAGIC || header.version != PATCH_VERSION ||
+        header.num_chunks != pack->num_chunks ||
+        !!(header.flags & PATCH_BLACKTHORNE) != pack->blackthorne ||
+        header.num_entries > pack->num_chunks)
+        goto out;
+
+    err = -ENOMEM;
+    entries = calloc(header.num_entries, sizeof(*entries));
+    new_data = calloc(header.num_entries, sizeof(*new_data));
+    new_sizes = calloc(header.num_entries, sizeof(*new_sizes));
+    if (!entries || !new_data || !new_sizes)
+        goto out;
+
+    /*
+     * Build all of the new chunks before replacing any of them, since
+     * copies refer to the original chunks.
+     */
+    for (i = 0; i < header.num_entries; i++) {
+        err = -EINVAL;
+        if (buf.size - buffer_offset(&buf) < sizeof(struct patch_entry))
+            goto out;
+
+        buffer_get_le32(&buf, &entries[i].chunk_index);
+        buffer_get_le32(&buf, &entries[i].type);
+        buffer_get_le64(&buf, &entries[i].old_hash);
+        buffer_get_le64(&buf, &entries[i].new_hash);
+        buffer_get_le32(&buf, &entries[i].arg);
+        buffer_get_le32(&buf, &entries[i].size);
+
+        if (entries[i].size > buf.size - buffer_offset(&buf))
+            goto out;
+        if (i > 0 && entries[i].chunk_index <= entries[i - 1].chunk_index)
+            goto out;
+
+        err = patch_chunk(pack, &entries[i], buf.p, &new_data[i],
+                          &new_sizes[i]);
+        if (err)
+            goto out;
+        buffer_seek(&buf, buffer_offset(&buf) + entries[i].size);
+    }
+
+    /* Referenced chunks cannot be replaced, so check before changing any */
+    for (i = 0; i < header.num_entries; i++) {
+        lv_resource_drop_chunk(pack, entries[i].chunk_index);
+        if (pack->chunks[entries[i].chunk_index].cache_refs) {
+            err = -EBUSY;
+            goto out;
+        }
+    }
+
+    for (i = 0; i < header.num_entries; i++) {
+        err = lv_pack_replace_chunk(pack,
+                                    &pack->chunks[entries[i].chunk_index],
+                                    new_data[i], new_sizes[i]);
+        if (err)
+            goto out;
+        new_data[i] = NULL;
+        num_done++;
+    }
+
+    if (r_changed)
+        *r_changed = num_done;
+    err = 0;
+
+out:
+    for (i = 0; new_data && i < header.num_entries; i++)
+        free(new_data[i]);
+    free(new_sizes);
+    free(new_data);
+    free(entries);
+    free(buf.data);
+    return err;
+}
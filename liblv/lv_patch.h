@@ -0,0 +1,87 @@
+/*
+ * This file is part of The Lost Vikings Library/Tools
+ *
+ * Ryan Mallon, 2016, <rmallon@gmail.com>
+ *
+ * To the extent possible under law, the author(s) have dedicated all
+ * copyright and related and neighboring rights to this software to
+ * the public domain worldwide. This software is distributed without
+ * any warranty.  You should have received a copy of the CC0 Public
+ * Domain Dedication along with this software. If not, see
+ *
+ * <http://creativecommons.org/publicdomain/zero/1.0/>.
+ *
+ */
+
+#ifndef _LV_PATCH_H
+#define _LV_PATCH_H
+
+#include <stddef.h>
+
+struct lv_pack;
+
+/**
+ * \defgroup lv_patch Pack patches
+ * \{
+ *
+ * A patch holds the chunks which differ between two packs with the same
+ * number of chunks. Changed chunks are stored as they appear in the new
+ * pack, so compressed chunks stay compressed. A changed chunk which is
+ * identical to some chunk of the original pack is stored as a reference
+ * to it. A chunk which only changes in a small range of bytes, which is
+ * typical of stored chunks, is stored as just that range.
+ *
+ * Every entry records hashes of the original and new chunk data, so a
+ * patch is only applied to the pack it was made from.
+ */
+
+/** Statistics for a created patch. */
+struct lv_patch_stats {
+    /** Number of chunks which differ. */
+    unsigned         num_changed;
+
+    /** Number of changed chunks stored as references to original chunks. */
+    unsigned         num_copies;
+
+    /** Number of changed chunks stored as a range of changed bytes. */
+    unsigned         num_ranges;
+
+    /** Size of the patch file. */
+    size_t           size;
+};
+
+/**
+ * Create a patch which changes one pack into another. The chunks are
+ * compared in parallel. Only the raw chunk data is compared, so no
+ * chunks are decompressed.
+ *
+ * \param old_pack    Original pack.
+ * \param new_pack    Changed pack. It must have the same number of chunks
+ *                    and be in the same format as the original pack.
+ * \param filename    Patch file to write.
+ * \param num_threads Number of threads to use, or 0 for one per CPU.
+ * \param stats       Returned statistics. May be NULL.
+ * \returns           0 for success, or a negative errno value.
+ */
+int lv_patch_create(struct lv_pack *old_pack, struct lv_pack *new_pack,
+                    const char *filename, unsigned num_threads,
+                    struct lv_patch_stats *stats);
+
+/**
+ * Apply a patch to a pack. The changed chunks are replaced in memory and
+ * the pack can then be written with \ref lv_pack_save or
+ * \ref lv_pack_save_in_place. Nothing is changed if the patch does not
+ * match the pack, or if any of the chunks it changes are referenced in the
+ * pack's cache.
+ *
+ * \param pack        Pack to patch.
+ * \param filename    Patch file.
+ * \param r_changed   Returned number of chunks changed. May be NULL.
+ * \returns           0 for success, or a negative errno value.
+ */
+int lv_patch_apply(struct lv_pack *pack, const char *filename,
+                   unsigned *r_changed);
+
+/** \} */
+
+#endif /* _LV_PATCH_H */
@@ -0,0 +1,228 @@
+/*
+ * This file is part of The Lost Vikings Library/Tools
+ *
+ * Ryan Mallon, 2016, <rmallon@gmail.com>
+ *
+ * To the extent possible under law, the author(s) have dedicated all
+ * copyright and related and neighboring rights to this software to
+ * the public domain worldwide. This software is distributed without
+ * any warranty.  You should have received a copy of the CC0 Public
+ * Domain Dedication along with this software. If not, see
+ *
+ * <http://creativecommons.org/publicdomain/zero/1.0/>.
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "lv_resource.h"
+#include "lv_pack.h"
+#include "lv_level.h"
+#include "lv_sprite.h"
+#include "lv_arena.h"
+
+static struct lv_resource *find_resource(struct lv_pack *pack, unsigned kind,
+                                         unsigned chunk_index, unsigned format,
+                                         size_t width, size_t height)
+{
+    struct lv_resource *res;
+
+    for (res = pack->resources; res; res = res->next)
+        if (res->kind == kind && res->chunk_index == chunk_index &&
+            res->format == format && res->width == width &&
+            res->height == height)
+            return res;
+
+    return NULL;
+}
+
+static struct lv_resource *new_resource(unsigned kind, unsigned chunk_index,
+                                        unsigned format, size_t width,
+                                        size_t height)
+{
+    struct lv_resource *res;
+
+    res = calloc(1, sizeof(*res));
+    if (!res)
+        return NULL;
+
+    res->kind = kind;
+    res->chunk_index = chunk_index;
+    res->format = format;
+    res->width = width;
+    res->height = height;
+    return res;
+}
+
+static void add_resource(struct lv_pack *pack, struct lv_resource *res)
+{
+    res->refs = 1;
+    res->next = pack->resources;
+    pack->resources = res;
+}
+
+static void free_resource(struct lv_pack *pack, struct lv_resource *res)
+{
+    if (res->kind == LV_RESOURCE_SPRITE_SET && res->sprite_set.planar_data)
+        lv_pack_cache_put(pack, res->chunk_index);
+    lv_arena_free(&res->arena);
+    free(res);
+}
+
+static void unlink_resource(struct lv_pack *pack, struct lv_resource *res)
+{
+    struct lv_resource **p;
+
+    for (p = &pack->resources; *p; p = &(*p)->next) {
+        if (*p == res) {
+            *p = res->next;
+            break;
+        }
+    }
+    res->next = NULL;
+}
+
+struct lv_resource *lv_resource_find(struct lv_pack *pack, unsigned kind,
+                                     unsigned chunk_index)
+{
+    struct lv_resource *res;
+
+    for (res = pack->resources; res; res = res->next)
+        if (res->kind == kind && res->chunk_index == chunk_index)
+            return res;
+
+    return NULL;
+}
+
+struct lv_resource *lv_resource_get_prefabs(struct lv_pack *pack,
+                                            unsigned chunk_index)
+{
+    struct lv_resource *res;
+    struct lv_chunk *chunk;
+
+    res = find_resource(pack, LV_RESOURCE_PREFABS, chunk_index, 0, 0, 0);
+    if (res) {
+        res->refs++;
+        return res;
+    }
+
+    chunk = lv_pack_get_chunk(pack, chunk_index);
+    if (!chunk)
+        return NULL;
+
+    res = new_resource(LV_RESOURCE_PREFABS, chunk_index, 0, 0, 0);
+    if (!res)
+        return NULL;
+
+    /* Each 8 byte prefab entry is parsed into a 12 byte structure */
+    lv_arena_init(&res->arena, chunk->decompressed_size * 2);
+    if (lv_load_tile_prefabs(pack, &res->arena, &res->prefabs,
+                             &res->num_prefabs, chunk_index)) {
+        free_resource(pack, res);
+        return NULL;
+    }
+
+    add_resource(pack, res);
+    return res;
+}
+
+struct lv_resource *lv_resource_get_sprite_set(struct lv_pack *pack,
+                                               unsigned chunk_index,
+                                               unsigned format,
+                                               size_t sprite_width,
+                                               size_t sprite_height)
+{
+    struct lv_resource *res;
+    const uint8_t *data;
+    size_t size;
+
+    if (format == LV_SPRITE_FORMAT_PACKED32) {
+        sprite_width = 32;
+        sprite_height = 32;
+    }
+
+    res = find_resource(pack, LV_RESOURCE_SPRITE_SET, chunk_index, format,
+                        sprite_width, sprite_height);
+    if (res) {
+        res->refs++;
+        return res;
+    }
+
+    res = new_resource(LV_RESOURCE_SPRITE_SET, chunk_index, format,
+                       sprite_width, sprite_height);
+    if (!res)
+        return NULL;
+
+    /*
+     * The sprite data is borrowed from the pack's cache until the resource
+     * is freed, so only the sprite pointers are allocated from the arena.
+     */
+    data = lv_pack_cache_get(pack, chunk_index, &size);
+    if (!data) {
+        free(res);
+        return NULL;
+    }
+
+    lv_arena_init(&res->arena, size / 8);
+    if (lv_sprite_init_set(&res->sprite_set, &res->arena, format,
+                           sprite_width, sprite_height, chunk_index,
+                           data, size)) {
+        lv_pack_cache_put(pack, chunk_index);
+        lv_arena_free(&res->arena);
+        free(res);
+        return NULL;
+    }
+
+    add_resource(pack, res);
+    return res;
+}
+
+void lv_resource_put(struct lv_pack *pack, struct lv_resource *res)
+{
+    if (--res->refs == 0 && res->stale)
+        free_resource(pack, res);
+}
+
+void lv_resource_trim(struct lv_pack *pack)
+{
+    struct lv_resource **p, *res;
+
+    for (p = &pack->resources; *p; ) {
+        res = *p;
+        if (res->refs == 0) {
+            *p = res->next;
+            free_resource(pack, res);
+        } else {
+            p = &res->next;
+        }
+    }
+}
+
+void lv_resource_drop_chunk(struct lv_pack *pack, unsigned chunk_index)
+{
+    struct lv_resource *res, *next;
+
+    for (res = pack->resources; res; res = next) {
+        next = res->next;
+        if (res->chunk_index != chunk_index)
+            continue;
+
+        unlink_resource(pack, res);
+        if (res->refs == 0)
+            free_resource(pack, res);
+        else
+            res->stale = true;
+    }
+}
+
+void lv_resource_free_all(struct lv_pack *pack)
+{
+    struct lv_resource *res, *next;
+
+    for (res = pack->resources; res; res = next) {
+        next = res->next;
+        free_resource(pack, res);
+    }
+    pack->resources = NULL;
+}
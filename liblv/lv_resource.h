@@ -0,0 +1,167 @@
+/*
+ * This file is part of The Lost Vikings Library/Tools
+ *
+ * Ryan Mallon, 2016, <rmallon@gmail.com>
+ *
+ * To the extent possible under law, the author(s) have dedicated all
+ * copyright and related and neighboring rights to this software to
+ * the public domain worldwide. This software is distributed without
+ * any warranty.  You should have received a copy of the CC0 Public
+ * Domain Dedication along with this software. If not, see
+ *
+ * <http://creativecommons.org/publicdomain/zero/1.0/>.
+ *
+ */
+
+#ifndef _LV_RESOURCE_H
+#define _LV_RESOURCE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "lv_level.h"
+#include "lv_sprite.h"
+#include "lv_arena.h"
+
+/**
+ * \defgroup lv_resource Shared resources
+ * \{
+ *
+ * Levels in the same world share tile prefabs and sprite sets. Parsed
+ * resources are kept by the pack, keyed by chunk index and kind, and are
+ * borrowed by each level which uses them rather than being loaded again.
+ * Raw chunk data such as palettes, tilesets and object databases is shared
+ * using the pack's decompressed chunk cache instead (see
+ * \ref lv_pack_cache_get).
+ *
+ * Unreferenced resources stay cached until \ref lv_resource_trim is
+ * called, their chunk is replaced, or the pack is freed.
+ */
+
+/** Resource kinds. */
+enum {
+    /** Tile prefab table. */
+    LV_RESOURCE_PREFABS,
+
+    /** Sprite set of a given format and sprite size. */
+    LV_RESOURCE_SPRITE_SET,
+};
+
+/** A resource parsed from a chunk. Resources must not be modified. */
+struct lv_resource {
+    /** Resource kind (LV_RESOURCE_*). */
+    unsigned               kind;
+
+    /** Chunk the resource was loaded from. */
+    unsigned               chunk_index;
+
+    /** Sprite format and size, for sprite sets. */
+    unsigned               format;
+    size_t                 width, height;
+
+    /** Number of references. */
+    unsigned               refs;
+
+    /**
+     * Set if the resource's chunk has been replaced. The resource is freed
+     * when its last reference is dropped.
+     */
+    bool                   stale;
+
+    /** Tile prefabs, for prefab tables. */
+    struct lv_tile_prefab  *prefabs;
+
+    /** Number of tile prefabs. */
+    size_t                 num_prefabs;
+
+    /** Sprite set, for sprite sets. */
+    struct lv_sprite_set   sprite_set;
+
+    /**
+     * Arena which the resource's data is allocated from. Sprite sets only
+     * allocate their sprite pointers, and borrow the sprite data from the
+     * pack's cache.
+     */
+    struct lv_arena        arena;
+
+    /** Next resource in the pack's list. */
+    struct lv_resource     *next;
+};
+
+/**
+ * Find a cached resource of any format without taking a reference, for
+ * example to check whether a chunk needs to be loaded.
+ *
+ * \param pack        Pack file.
+ * \param kind        Resource kind (LV_RESOURCE_*).
+ * \param chunk_index Chunk index.
+ * \returns           Resource, or NULL if none is cached.
+ */
+struct lv_resource *lv_resource_find(struct lv_pack *pack, unsigned kind,
+                                     unsigned chunk_index);
+
+/**
+ * Get a tile prefab table, loading it if it is not already cached. Each
+ * call must be balanced by a call to \ref lv_resource_put.
+ *
+ * \param pack        Pack file.
+ * \param chunk_index Index of the prefab chunk.
+ * \returns           Resource, or NULL on failure.
+ */
+struct lv_resource *lv_resource_get_prefabs(struct lv_pack *pack,
+                                            unsigned chunk_index);
+
+/**
+ * Get a sprite set, loading it if it is not already cached. Each call must
+ * be balanced by a call to \ref lv_resource_put.
+ *
+ * \param pack          Pack file.
+ * \param chunk_index   Index of the sprite set chunk.
+ * \param format        Sprite format.
+ * \param sprite_width  Sprite width. Ignored for packed 32x32 sprites.
+ * \param sprite_height Sprite height. Ignored for packed 32x32 sprites.
+ * \returns             Resource, or NULL on failure.
+ */
+struct lv_resource *lv_resource_get_sprite_set(struct lv_pack *pack,
+                                               unsigned chunk_index,
+                                               unsigned format,
+                                               size_t sprite_width,
+                                               size_t sprite_height);
+
+/**
+ * Drop a reference to a resource.
+ *
+ * \param pack        Pack file.
+ * \param res         Resource.
+ */
+void lv_resource_put(struct lv_pack *pack, struct lv_resource *res);
+
+/**
+ * Free every unreferenced resource.
+ *
+ * \param pack        Pack file.
+ */
+void lv_resource_trim(struct lv_pack *pack);
+
+/**
+ * Forget the resources loaded from a chunk, for example because the chunk
+ * has been replaced. Referenced resources are freed once they are put.
+ * Sprite sets borrow their chunk's cached data, so they must not be
+ * referenced when their chunk is replaced.
+ *
+ * \param pack        Pack file.
+ * \param chunk_index Chunk index.
+ */
+void lv_resource_drop_chunk(struct lv_pack *pack, unsigned chunk_index);
+
+/**
+ * Free all of a pack's resources. This is used by \ref lv_pack_free, so
+ * any levels using the resources must be freed before the pack.
+ *
+ * \param pack        Pack file.
+ */
+void lv_resource_free_all(struct lv_pack *pack);
+
+/** \} */
+
+#endif /* _LV_RESOURCE_H */
@@ -19,6 +19,7 @@
 
 #include "lv_sprite.h"
 #include "lv_pack.h"
+#include "lv_arena.h"
 #include "common.h"
 #include "buffer.h"
 
@@ -279,9 +280,10 @@ void lv_sprite_draw(const uint8_t *sprite, size_t width, size_t height,
     }
 }
 
-void lv_sprite_load_set(struct lv_sprite_set *set, unsigned format,
-                        size_t sprite_width, size_t sprite_height,
-                        struct lv_chunk *chunk)
+int lv_sprite_init_set(struct lv_sprite_set *set, struct lv_arena *arena,
+                       unsigned format, size_t sprite_width,
+                       size_t sprite_height, unsigned chunk_index,
+                       const uint8_t *data, size_t size)
 {
     size_t sprite_data_size;
     struct buffer buf;
@@ -289,20 +291,24 @@ void lv_sprite_load_set(struct lv_sprite_set *set, unsigned format,
     int i;
 
     memset(set, 0, sizeof(*set));
-    set->chunk_index = chunk->index;
+    set->chunk_index = chunk_index;
     set->format = format;
+    set->planar_data = (uint8_t *)data;
+    set->data_size = size;
 
     switch (format) {
     case LV_SPRITE_FORMAT_RAW:
     case LV_SPRITE_FORMAT_UNPACKED:
         sprite_data_size = lv_sprite_data_size(format, sprite_width,
                                                sprite_height);
-        set->num_sprites = chunk->decompressed_size / sprite_data_size;
-
-        lv_decompress_chunk(chunk, &set->planar_data);
-        set->data_size = chunk->decompressed_size;
-
-        set->sprites = calloc(set->num_sprites, sizeof(uint8_t *));
+        if (sprite_data_size == 0)
+            return -1;
+        set->num_sprites = size / sprite_data_size;
+
+        set->sprites = lv_arena_calloc(arena, set->num_sprites,
+                                       sizeof(uint8_t *));
+        if (!set->sprites)
+            return -1;
         for (i = 0; i < set->num_sprites; i++)
             set->sprites[i] = set->planar_data + (sprite_data_size * i);
 
@@ -315,9 +321,6 @@ void lv_sprite_load_set(struct lv_sprite_set *set, unsigned format,
          *
          * Sprite width and height are ignored for this format.
          */
-        lv_decompress_chunk(chunk, &set->planar_data);
-        set->data_size = chunk->decompressed_size;
-
         buffer_init_from_data(&buf, set->planar_data, set->data_size);
         set->num_sprites = 0;
 
@@ -332,7 +335,10 @@ void lv_sprite_load_set(struct lv_sprite_set *set, unsigned format,
         }
 
         /* Second pass to load the sprite offsets */
-        set->sprites = calloc(set->num_sprites, sizeof(uint8_t *));
+        set->sprites = lv_arena_calloc(arena, set->num_sprites,
+                                       sizeof(uint8_t *));
+        if (!set->sprites)
+            return -1;
         buffer_seek(&buf, 0);
         for (i = 0; i < set->num_sprites; i++) {
             buffer_get_le16(&buf, &offset);
@@ -340,4 +346,73 @@ void lv_sprite_load_set(struct lv_sprite_set *set, unsigned format,
         }
         break;
     }
+
+    return 0;
+}
+
+int lv_sprite_load_set(struct lv_sprite_set *set, struct lv_arena *arena,
+                       unsigned format, size_t sprite_width,
+                       size_t sprite_height, struct lv_chunk *chunk)
+{
+    uint8_t *data;
+
+    if (lv_decompress_chunk_arena(chunk, arena, &data))
+        return -1;
+
+    return lv_sprite_init_set(set, arena, format, sprite_width,
+                              sprite_height, chunk->index, data,
+                              chunk->decompressed_size);
+}
+
+int lv_sprite_load_single(struct lv_chunk *chunk, unsigned format,
+                          size_t sprite_width, size_t sprite_height,
+                          unsigned sprite_index, uint8_t **r_data,
+                          size_t *r_size)
+{
+    size_t offset, size;
+    uint8_t header[4];
+    uint16_t first_offset, end_offset;
+
+    switch (format) {
+    case LV_SPRITE_FORMAT_RAW:
+    case LV_SPRITE_FORMAT_UNPACKED:
+        size = lv_sprite_data_size(format, sprite_width, sprite_height);
+        offset = size * sprite_index;
+        break;
+
+    case LV_SPRITE_FORMAT_PACKED32:
+        /*
+         * The offset table has an entry for each sprite plus a final end
+         * offset, so each sprite ends where the next one starts.
+         */
+        if (lv_decompress_chunk_range(chunk, 0, header, 2))
+            return -1;
+        first_offset = header[0] | (header[1] << 8);
+        if ((sprite_index + 2) * 2 > first_offset)
+            return -1;
+
+        if (lv_decompress_chunk_range(chunk, sprite_index * 2, header, 4))
+            return -1;
+        offset = header[0] | (header[1] << 8);
+        end_offset = header[2] | (header[3] << 8);
+        if (end_offset < offset)
+            return -1;
+        size = end_offset - offset;
+        break;
+
+    default:
+        return -1;
+    }
+
+    *r_data = malloc(size);
+    if (!*r_data)
+        return -1;
+    if (lv_decompress_chunk_range(chunk, offset, *r_data, size)) {
+        free(*r_data);
+        *r_data = NULL;
+        return -1;
+    }
+
+    *r_size = size;
+    return 0;
 }
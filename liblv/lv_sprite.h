@@ -20,6 +20,7 @@
 #include <stdint.h>
 
 struct lv_chunk;
+struct lv_arena;
 
 /**
  * \defgroup lv_sprite Sprites
@@ -173,9 +174,60 @@ void lv_sprite_draw(const uint8_t *sprite, size_t width, size_t height,
                     uint8_t *dst, unsigned dst_x, unsigned dst_y,
                     size_t dst_width);
 
-void lv_sprite_load_set(struct lv_sprite_set *set, unsigned format,
-                        size_t sprite_width, size_t sprite_height,
-                        struct lv_chunk *chunk);
+/**
+ * Initialise a set of sprites from already decompressed sprite data. The
+ * data is borrowed by the set and must outlive it. The sprite pointers are
+ * allocated from an arena, and are freed with it.
+ *
+ * \param set           Sprite set to initialise.
+ * \param arena         Arena to allocate the sprite pointers from.
+ * \param format        Sprite format.
+ * \param sprite_width  Sprite width. Ignored for packed 32x32 sprites.
+ * \param sprite_height Sprite height. Ignored for packed 32x32 sprites.
+ * \param chunk_index   Index of the chunk the data is from.
+ * \param data          Decompressed sprite data.
+ * \param size          Size of the sprite data.
+ * \returns             0 for success, or -1 on failure.
+ */
+int lv_sprite_init_set(struct lv_sprite_set *set, struct lv_arena *arena,
+                       unsigned format, size_t sprite_width,
+                       size_t sprite_height, unsigned chunk_index,
+                       const uint8_t *data, size_t size);
+
+/**
+ * Load a set of sprites from a chunk. The sprite data and the sprite
+ * pointers are allocated from an arena, and are freed with it.
+ *
+ * \param set           Sprite set to load.
+ * \param arena         Arena to allocate the set's data from.
+ * \param format        Sprite format.
+ * \param sprite_width  Sprite width. Ignored for packed 32x32 sprites.
+ * \param sprite_height Sprite height. Ignored for packed 32x32 sprites.
+ * \param chunk         Sprite set chunk.
+ * \returns             0 for success, or -1 on failure.
+ */
+int lv_sprite_load_set(struct lv_sprite_set *set, struct lv_arena *arena,
+                       unsigned format, size_t sprite_width,
+                       size_t sprite_height, struct lv_chunk *chunk);
+
+/**
+ * Load a single sprite from a sprite set chunk. Only the part of the chunk
+ * needed for the sprite is decompressed, which is much faster than loading
+ * the whole set when only one sprite is needed from a large chunk.
+ *
+ * \param chunk         Sprite set chunk.
+ * \param format        Sprite format.
+ * \param sprite_width  Sprite width. Ignored for packed 32x32 sprites.
+ * \param sprite_height Sprite height. Ignored for packed 32x32 sprites.
+ * \param sprite_index  Index of the sprite in the set.
+ * \param r_data        Returned sprite data. The caller must free it.
+ * \param r_size        Returned size of the sprite data.
+ * \returns             0 for success, or -1 on failure.
+ */
+int lv_sprite_load_single(struct lv_chunk *chunk, unsigned format,
+                          size_t sprite_width, size_t sprite_height,
+                          unsigned sprite_index, uint8_t **r_data,
+                          size_t *r_size);
 
 /* \} */
 
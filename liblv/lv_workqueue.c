@@ -0,0 +1,174 @@
+/*
+ * This file is part of The Lost Vikings Library/Tools
+ *
+ * Ryan Mallon, 2016, <rmallon@gmail.com>
+ *
+ * To the extent possible under law, the author(s) have dedicated all
+ * copyright and related and neighboring rights to this software to
+ * the public domain worldwide. This software is distributed without
+ * any warranty.  You should have received a copy of the CC0 Public
+ * Domain Dedication along with this software. If not, see
+ *
+ * <http://creativecommons.org/publicdomain/zero/1.0/>.
+ *
+ */
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include "lv_workqueue.h"
+
+unsigned lv_workqueue_num_cpus(void)
+{
+    long num_cpus;
+
+    num_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    return num_cpus > 0 ? num_cpus : 1;
+}
+
+/* Must be called with the lock held */
+static struct lv_work *dequeue_work(struct lv_workqueue *wq)
+{
+    struct lv_work *work;
+
+    work = wq->head;
+    if (work) {
+        wq->head = work->next;
+        if (!wq->head)
+            wq->tail = NULL;
+    }
+
+    return work;
+}
+
+/* Run a piece of work with the lock held, dropping it while running */
+static void run_work(struct lv_workqueue *wq, struct lv_work *work)
+{
+    pthread_mutex_unlock(&wq->lock);
+    work->func(work->arg);
+    free(work);
+    pthread_mutex_lock(&wq->lock);
+
+    if (--wq->pending == 0)
+        pthread_cond_broadcast(&wq->done_cond);
+}
+
+static void *worker_thread(void *arg)
+{
+    struct lv_workqueue *wq = arg;
+    struct lv_work *work;
+
+    pthread_mutex_lock(&wq->lock);
+    while (1) {
+        work = dequeue_work(wq);
+        if (work) {
+            run_work(wq, work);
+            continue;
+        }
+
+        if (wq->stop)
+            break;
+        pthread_cond_wait(&wq->work_cond, &wq->lock);
+    }
+    pthread_mutex_unlock(&wq->lock);
+
+    return NULL;
+}
+
+int lv_workqueue_init(struct lv_workqueue *wq, unsigned num_threads)
+{
+    int err;
+
+    memset(wq, 0, sizeof(*wq));
+    pthread_mutex_init(&wq->lock, NULL);
+    pthread_cond_init(&wq->work_cond, NULL);
+    pthread_cond_init(&wq->done_cond, NULL);
+
+    if (num_threads == 0)
+        num_threads = lv_workqueue_num_cpus();
+    if (num_threads == 1)
+        return 0;
+
+    wq->threads = calloc(num_threads - 1, sizeof(*wq->threads));
+    if (!wq->threads) {
+        lv_workqueue_free(wq);
+        return -ENOMEM;
+    }
+
+    for (; wq->num_threads < num_threads - 1; wq->num_threads++) {
+        err = pthread_create(&wq->threads[wq->num_threads], NULL,
+                             worker_thread, wq);
+        if (err) {
+            lv_workqueue_free(wq);
+            return -err;
+        }
+    }
+
+    return 0;
+}
+
+void lv_workqueue_free(struct lv_workqueue *wq)
+{
+    unsigned i;
+
+    lv_workqueue_wait(wq);
+
+    pthread_mutex_lock(&wq->lock);
+    wq->stop = true;
+    pthread_cond_broadcast(&wq->work_cond);
+    pthread_mutex_unlock(&wq->lock);
+
+    for (i = 0; i < wq->num_threads; i++)
+        pthread_join(wq->threads[i], NULL);
+    free(wq->threads);
+
+    pthread_cond_destroy(&wq->done_cond);
+    pthread_cond_destroy(&wq->work_cond);
+    pthread_mutex_destroy(&wq->lock);
+    memset(wq, 0, sizeof(*wq));
+}
+
+int lv_workqueue_add(struct lv_workqueue *wq, lv_work_func_t func, void *arg)
+{
+    struct lv_work *work;
+
+    work = malloc(sizeof(*work));
+    if (!work)
+        return -ENOMEM;
+
+    work->func = func;
+    work->arg = arg;
+    work->next = NULL;
+
+    pthread_mutex_lock(&wq->lock);
+    if (wq->tail)
+        wq->tail->next = work;
+    else
+        wq->head = work;
+    wq->tail = work;
+    wq->pending++;
+    pthread_cond_signal(&wq->work_cond);
+    pthread_mutex_unlock(&wq->lock);
+
+    return 0;
+}
+
+void lv_workqueue_wait(struct lv_workqueue *wq)
+{
+    struct lv_work *work;
+
+    pthread_mutex_lock(&wq->lock);
+    while (wq->pending) {
+        /* Help out with the queued work rather than just sleeping */
+        work = dequeue_work(wq);
+        if (work)
+            run_work(wq, work);
+        else
+            pthread_cond_wait(&wq->done_cond, &wq->lock);
+    }
+    pthread_mutex_unlock(&wq->lock);
+}
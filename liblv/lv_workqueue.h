@@ -0,0 +1,115 @@
+/*
+ * This file is part of The Lost Vikings Library/Tools
+ *
+ * Ryan Mallon, 2016, <rmallon@gmail.com>
+ *
+ * To the extent possible under law, the author(s) have dedicated all
+ * copyright and related and neighboring rights to this software to
+ * the public domain worldwide. This software is distributed without
+ * any warranty.  You should have received a copy of the CC0 Public
+ * Domain Dedication along with this software. If not, see
+ *
+ * <http://creativecommons.org/publicdomain/zero/1.0/>.
+ *
+ */
+
+#ifndef _LV_WORKQUEUE_H
+#define _LV_WORKQUEUE_H
+
+#include <pthread.h>
+#include <stdbool.h>
+
+/**
+ * \defgroup lv_workqueue Work queue
+ * \{
+ *
+ * A simple thread pool for running independent pieces of work, such as
+ * compressing or decompressing chunks, in parallel.
+ */
+
+/** Function run for a piece of work. */
+typedef void (*lv_work_func_t)(void *arg);
+
+/** A queued piece of work. */
+struct lv_work {
+    lv_work_func_t  func;
+    void            *arg;
+    struct lv_work  *next;
+};
+
+/** Work queue and its pool of worker threads. */
+struct lv_workqueue {
+    /** Worker threads. */
+    pthread_t       *threads;
+
+    /** Number of worker threads. */
+    unsigned        num_threads;
+
+    /** Protects all of the fields below. */
+    pthread_mutex_t lock;
+
+    /** Signalled when work is queued, or when the workers should exit. */
+    pthread_cond_t  work_cond;
+
+    /** Signalled when all of the queued work has completed. */
+    pthread_cond_t  done_cond;
+
+    /** Queued work, oldest first. */
+    struct lv_work  *head, *tail;
+
+    /** Number of queued and running pieces of work. */
+    unsigned        pending;
+
+    /** Set to tell the workers to exit. */
+    bool            stop;
+};
+
+/**
+ * Get the number of online CPUs.
+ *
+ * \returns Number of online CPUs, at least 1.
+ */
+unsigned lv_workqueue_num_cpus(void);
+
+/**
+ * Create a work queue. The thread calling \ref lv_workqueue_wait also
+ * runs queued work, so num_threads - 1 worker threads are created. A work
+ * queue with a single thread runs all of its work in
+ * \ref lv_workqueue_wait.
+ *
+ * \param wq          Work queue to initialise.
+ * \param num_threads Number of threads to run work on. Zero uses the
+ *                    number of online CPUs.
+ * \returns           0 for success, or a negative errno value.
+ */
+int lv_workqueue_init(struct lv_workqueue *wq, unsigned num_threads);
+
+/**
+ * Stop the worker threads and free a work queue. Any queued work is run
+ * before the workers exit.
+ *
+ * \param wq    Work queue.
+ */
+void lv_workqueue_free(struct lv_workqueue *wq);
+
+/**
+ * Queue a piece of work. Work may be run in any order, and on any thread.
+ *
+ * \param wq    Work queue.
+ * \param func  Function to run.
+ * \param arg   Argument passed to the function.
+ * \returns     0 for success, or a negative errno value.
+ */
+int lv_workqueue_add(struct lv_workqueue *wq, lv_work_func_t func, void *arg);
+
+/**
+ * Wait for all queued work to complete. The calling thread runs queued
+ * work while it waits.
+ *
+ * \param wq    Work queue.
+ */
+void lv_workqueue_wait(struct lv_workqueue *wq);
+
+/** \} */
+
+#endif /* _LV_WORKQUEUE_H */
@@ -13,27 +13,57 @@
  *
  */
 
+#include <sys/stat.h>
 #include <stdbool.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <string.h>
+#include <ctype.h>
 #include <getopt.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
 
 #include <liblv/lv_compress.h>
 #include <liblv/lv_pack.h>
+#include <liblv/lv_workqueue.h>
+#include <liblv/lv_patch.h>
+#include <liblv/lv_index.h>
 #include <liblv/buffer.h>
 #include <liblv/common.h>
 
-typedef void (*operation_func_t)(struct lv_chunk *chunk, const char *filename);
+struct operation;
+
+typedef void (*operation_func_t)(struct operation *op, struct lv_chunk *chunk);
 
 struct operation {
     operation_func_t  func;
     unsigned          chunk_index;
     const char        *filename;
+
+    /* Compressed replacement data, prepared before the operations run */
+    uint8_t           *data;
+    size_t            size;
+    const char        *error;
+
+    /* Order the operation was given in */
+    unsigned          seq;
+
+    /* Replacement which is replaced again before the chunk is read */
+    bool              skip;
+
+    /* One of several decompressions of the chunk between replacements */
+    bool              shared;
+
     struct operation  *next;
 };
 
 static struct lv_pack pack;
-static struct operation *operation_list;
+static struct operation *operation_list, **operation_tail = &operation_list;
+static unsigned num_operations;
+static struct lv_compress_params compress_params;
+static unsigned num_jobs;
 
 static void fatal_error(const char *msg)
 {
@@ -41,62 +71,153 @@ static void fatal_error(const char *msg)
     exit(EXIT_FAILURE);
 }
 
-static void op_replace_compress(struct lv_chunk *chunk, const char *filename)
+/*
+ * Read and compress a replacement chunk. This is run on the work queue
+ * for all replaced chunks before any of the operations are done. Errors
+ * are recorded in the operation and reported once the queue has finished.
+ */
+static void compress_replacement(void *arg)
 {
+    struct operation *op = arg;
     struct buffer src_buf;
-    size_t dst_max_size, dst_size;
+    size_t dst_max_size, dst_size, header_size;
     uint8_t *dst;
     int err;
 
-    printf("Replacing compressed chunk %.4x with %s\n", chunk->index, filename);
-
-    err = buffer_init_from_file(&src_buf, filename);
-    if (err)
-        fatal_error("Cannot open file for compressed replacement");
+    err = buffer_init_from_file(&src_buf, op->filename);
+    if (err) {
+        op->error = "Cannot open file for compressed replacement";
+        return;
+    }
 
-    dst_max_size = 2 * src_buf.size;
+    /* Worst case is a control byte for every 8 literal bytes */
+    header_size = pack.blackthorne ? 4 : 2;
+    dst_max_size = header_size + src_buf.size + (src_buf.size / 8) + 1;
     dst = calloc(1, dst_max_size);
-    if (!dst)
-        fatal_error("Cannot allocate memory for compression buffer");
+    if (!dst) {
+        op->error = "Cannot allocate memory for compression buffer";
+        goto out;
+    }
 
-    /* Compressed chunks start with LE16 decompressed size minus 1 */
-    dst[0] = (src_buf.size - 1);
-    dst[1] = (src_buf.size - 1) >> 8;
+    /*
+     * Compressed chunks start with the decompressed size. The Lost Vikings
+     * uses LE16 size minus 1, Blackthorne uses LE32 size.
+     */
+    if (pack.blackthorne) {
+        dst[0] = src_buf.size;
+        dst[1] = src_buf.size >> 8;
+        dst[2] = src_buf.size >> 16;
+        dst[3] = src_buf.size >> 24;
+    } else {
+        if (src_buf.size == 0 || src_buf.size > 0x10000) {
+            op->error = "Replacement chunk size is invalid";
+            goto out;
+        }
+        dst[0] = (src_buf.size - 1);
+        dst[1] = (src_buf.size - 1) >> 8;
+    }
 
-    dst_size = lv_compress(src_buf.data, src_buf.size,
-                           dst + 2, dst_max_size - 2);
+    dst_size = lv_compress_ex(src_buf.data, src_buf.size,
+                              dst + header_size, dst_max_size - header_size,
+                              &compress_params);
+    if (dst_size == 0 && src_buf.size != 0) {
+        op->error = "Cannot compress chunk";
+        goto out;
+    }
 
-    free(chunk->data);
-    chunk->data = dst;
-    chunk->size = dst_size;
+    op->data = dst;
+    op->size = dst_size + header_size;
+    dst = NULL;
+
+out:
+    free(dst);
+    free(src_buf.data);
+}
+
+static void op_replace_compress(struct operation *op, struct lv_chunk *chunk)
+{
+    printf("Replacing compressed chunk %.4x with %s\n",
+           chunk->index, op->filename);
+
+    if (lv_pack_replace_chunk(&pack, chunk, op->data, op->size))
+        fatal_error("Cannot replace chunk which is in use");
+    op->data = NULL;
 }
 
-static void op_extract_decompress(struct lv_chunk *chunk, const char *filename)
+static void op_replace_raw(struct operation *op, struct lv_chunk *chunk)
 {
-    uint8_t *data;
+    struct buffer buf;
+
+    printf("Replacing raw chunk %.4x with %s\n", chunk->index, op->filename);
+
+    if (buffer_init_from_file(&buf, op->filename))
+        fatal_error("Cannot open file for raw replacement");
+
+    if (lv_pack_replace_chunk(&pack, chunk, buf.data, buf.size))
+        fatal_error("Cannot replace chunk which is in use");
+}
+
+static void op_extract_decompress(struct operation *op, struct lv_chunk *chunk)
+{
+    struct lv_decompress_stream stream;
+    const uint8_t *data;
+    uint8_t buf[4096];
+    size_t size, count;
     FILE *fd;
 
     printf("Extracting and decompressing chunk %.4x to %s\n",
-           chunk->index, filename);
-
-    lv_decompress_chunk(chunk, &data);
+           chunk->index, op->filename);
 
-    fd = fopen(filename, "w");
+    fd = fopen(op->filename, "w");
     if (!fd)
         fatal_error("Cannot open file for chunk decompression");
 
-    fwrite(data, 1, chunk->decompressed_size, fd);
+    /*
+     * Chunks decompressed more than once are held in the cache by
+     * do_operations, so they are only decompressed once.
+     */
+    if (op->shared) {
+        data = lv_pack_cache_get(&pack, chunk->index, &size);
+        if (!data)
+            fatal_error("Cannot decompress chunk");
+        fwrite(data, 1, size, fd);
+        lv_pack_cache_put(&pack, chunk->index);
+        fclose(fd);
+        return;
+    }
+
+    /* Stored chunks are written out directly */
+    if (chunk->storage == LV_CHUNK_STORAGE_STORED) {
+        fwrite(chunk->data + chunk->data_offset, 1,
+               lv_decompress_chunk_size(chunk), fd);
+        fclose(fd);
+        return;
+    }
+
+    if (lv_decompress_chunk_stream(chunk, &stream))
+        fatal_error("Cannot decompress chunk");
+
+    /* Stream the chunk to the file through a small fixed size buffer */
+    size = lv_decompress_chunk_size(chunk);
+    while (size) {
+        count = lv_decompress_stream_read(&stream, buf,
+                                          min(size, sizeof(buf)));
+        if (count == 0)
+            fatal_error("Cannot decompress chunk");
+
+        fwrite(buf, 1, count, fd);
+        size -= count;
+    }
     fclose(fd);
-    free(data);
 }
 
-static void op_extract_raw(struct lv_chunk *chunk, const char *filename)
+static void op_extract_raw(struct operation *op, struct lv_chunk *chunk)
 {
     FILE *fd;
 
-    printf("Extracting raw chunk %.4x to %s\n", chunk->index, filename);
+    printf("Extracting raw chunk %.4x to %s\n", chunk->index, op->filename);
 
-    fd = fopen(filename, "w");
+    fd = fopen(op->filename, "w");
     if (!fd)
         fatal_error("Cannot open file for raw extract");
 
@@ -104,6 +225,259 @@ static void op_extract_raw(struct lv_chunk *chunk, const char *filename)
     fclose(fd);
 }
 
+/* A chunk being written out by --extract-all */
+struct extract_job {
+    struct lv_chunk *chunk;
+    bool            raw;
+    char            *filename;
+    int             err;
+};
+
+static int write_file(const char *filename, const void *data, size_t size)
+{
+    ssize_t count;
+    int fd, err = 0;
+
+    fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+        return -errno;
+
+    while (size) {
+        count = write(fd, data, size);
+        if (count < 0 && errno == EINTR)
+            continue;
+        if (count < 0) {
+            err = -errno;
+            break;
+        }
+
+        data += count;
+        size -= count;
+    }
+
+    if (close(fd) < 0 && !err)
+        err = -errno;
+    return err;
+}
+
+/*
+ * Decompress a chunk and write it out. This is run on the work queue, so
+ * the decompression and the file writes for different chunks overlap.
+ */
+static void extract_chunk(void *arg)
+{
+    struct extract_job *job = arg;
+    struct lv_chunk *chunk = job->chunk;
+    const uint8_t *data;
+
+    if (job->raw) {
+        job->err = write_file(job->filename, chunk->data, chunk->size);
+        return;
+    }
+
+    if (lv_decompress_chunk_borrow(chunk, &data)) {
+        job->err = -EINVAL;
+        return;
+    }
+
+    job->err = write_file(job->filename, data, lv_decompress_chunk_size(chunk));
+    lv_decompress_chunk_put(chunk, data);
+}
+
+static void extract_all(const char *dirname, bool raw)
+{
+    struct extract_job *jobs;
+    struct lv_workqueue wq;
+    unsigned num_extracted = 0;
+    bool failed = false;
+    int i;
+
+    if (mkdir(dirname, 0755) < 0 && errno != EEXIST)
+        fatal_error("Cannot create extraction directory");
+
+    jobs = calloc(pack.num_chunks, sizeof(*jobs));
+    if (!jobs)
+        fatal_error("Cannot allocate memory for extraction");
+
+    /* Chunks are loaded up front, since loading is not thread safe */
+    for (i = 0; i < pack.num_chunks; i++) {
+        jobs[i].chunk = lv_pack_get_chunk(&pack, i);
+        if (!jobs[i].chunk)
+            fatal_error("Cannot load chunk");
+
+        jobs[i].raw = raw;
+        jobs[i].filename = malloc(strlen(dirname) + 16);
+        if (!jobs[i].filename)
+            fatal_error("Cannot allocate memory for filename");
+        sprintf(jobs[i].filename, "%s/%.4x.%s", dirname, i,
+                raw ? "raw" : "bin");
+    }
+
+    if (lv_workqueue_init(&wq, num_jobs))
+        fatal_error("Cannot create work queue");
+    for (i = 0; i < pack.num_chunks; i++)
+        if (lv_workqueue_add(&wq, extract_chunk, &jobs[i]))
+            extract_chunk(&jobs[i]);
+    lv_workqueue_free(&wq);
+
+    /* Errors are only reported once every chunk has been written */
+    for (i = 0; i < pack.num_chunks; i++) {
+        if (jobs[i].err == -EINVAL)
+            printf("Cannot decompress chunk %.4x, skipping\n", i);
+        else if (jobs[i].err)
+            printf("Cannot write %s: %s\n", jobs[i].filename,
+                   strerror(-jobs[i].err));
+        else
+            num_extracted++;
+
+        if (jobs[i].err && jobs[i].err != -EINVAL)
+            failed = true;
+        free(jobs[i].filename);
+    }
+    free(jobs);
+
+    if (failed)
+        fatal_error("Cannot write extracted chunks");
+
+    printf("Extracted %u %s chunks to %s\n", num_extracted,
+           raw ? "raw" : "decompressed", dirname);
+}
+
+/* Report chunks with identical decompressed data */
+static void dedup_report(void)
+{
+    size_t file_saved = 0, mem_saved = 0, num_dups = 0, num_groups = 0;
+    struct lv_chunk *chunk, *dup;
+    unsigned *num_copies;
+    bool raw_same;
+    int i, j;
+
+    if (lv_pack_hash_chunks(&pack, num_jobs))
+        fatal_error("Cannot hash chunks");
+
+    num_copies = calloc(pack.num_chunks, sizeof(*num_copies));
+    if (!num_copies)
+        fatal_error("Cannot allocate memory for dedup report");
+    for (i = 0; i < pack.num_chunks; i++)
+        if (pack.chunks[i].canonical != i)
+            num_copies[pack.chunks[i].canonical]++;
+
+    printf("Duplicate chunks:\n");
+    for (i = 0; i < pack.num_chunks; i++) {
+        if (!num_copies[i])
+            continue;
+
+        chunk = &pack.chunks[i];
+        printf("  [%4x] hash=%.16llx, size=%6zx, decompressed_size=%6zx, copies:",
+               i, (unsigned long long)chunk->hash, chunk->size,
+               chunk->decompressed_size);
+
+        raw_same = true;
+        for (j = i + 1; j < pack.num_chunks; j++) {
+            dup = &pack.chunks[j];
+            if (dup->canonical != i)
+                continue;
+
+            printf(" %.4x", j);
+            if (dup->raw_hash != chunk->raw_hash)
+                raw_same = false;
+            file_saved += dup->size;
+            mem_saved += dup->decompressed_size;
+        }
+        printf("%s\n", raw_same ? "" : " (compressed differently)");
+
+        num_dups += num_copies[i];
+        num_groups++;
+    }
+
+    printf("%zd duplicate chunks of %zd chunks in %zd groups\n",
+           num_dups, pack.num_chunks, num_groups);
+    printf("Sharing them would save %zd bytes of file data and %zd bytes of\n"
+           "decompressed data\n", file_saved, mem_saved);
+    free(num_copies);
+}
+
+static void create_patch(const char *arg, bool blackthorne)
+{
+    struct lv_patch_stats stats;
+    struct lv_pack new_pack;
+    const char *p, *patch_file;
+    char *new_file;
+    int err;
+
+    p = strchr(arg, ':');
+    if (!p)
+        fatal_error("Bad argument format");
+
+    new_file = strndup(arg, p - arg);
+    patch_file = p + 1;
+    if (!new_file)
+        fatal_error("Cannot allocate memory for filename");
+
+    err = lv_pack_load_flags(new_file, &new_pack, blackthorne,
+                             LV_PACK_LOAD_SEQUENTIAL | LV_PACK_LOAD_LAZY |
+                             LV_PACK_LOAD_INDEX);
+    if (err)
+        fatal_error("Cannot load new data file");
+
+    err = lv_patch_create(&pack, &new_pack, patch_file, num_jobs, &stats);
+    if (err == -EINVAL)
+        fatal_error("Data files have different numbers of chunks");
+    if (err) {
+        printf("Cannot write %s: %s\n", patch_file, strerror(-err));
+        exit(EXIT_FAILURE);
+    }
+
+    printf("Created patch %s: %u changed chunks (%u copies, %u ranges), %zd bytes\n",
+           patch_file, stats.num_changed, stats.num_copies, stats.num_ranges,
+           stats.size);
+
+    lv_pack_free(&new_pack);
+    free(new_file);
+}
+
+static void apply_patch(const char *patch_file)
+{
+    unsigned num_changed;
+    int err;
+
+    err = lv_patch_apply(&pack, patch_file, &num_changed);
+    if (err == -EINVAL)
+        fatal_error("Patch does not match the data file");
+    if (err) {
+        printf("Cannot read %s: %s\n", patch_file, strerror(-err));
+        exit(EXIT_FAILURE);
+    }
+
+    printf("Applied patch %s: %u changed chunks\n", patch_file, num_changed);
+}
+
+static void write_index(const char *data_file)
+{
+    int err;
+
+    err = lv_index_write(&pack, data_file);
+    if (err) {
+        printf("Cannot write index for %s: %s\n", data_file, strerror(-err));
+        exit(EXIT_FAILURE);
+    }
+
+    printf("Wrote index %s%s\n", data_file, LV_INDEX_SUFFIX);
+}
+
+static unsigned arg_get_compression(const char *arg)
+{
+    if (strcmp(arg, "greedy") == 0)
+        return LV_COMPRESS_GREEDY;
+    if (strcmp(arg, "lazy") == 0)
+        return LV_COMPRESS_LAZY;
+    if (strcmp(arg, "optimal") == 0)
+        return LV_COMPRESS_OPTIMAL;
+
+    fatal_error("Bad compression level");
+    return 0;
+}
+
 static void arg_get_chunk_and_filename(const char *arg, unsigned *chunk_index,
 				       const char **filename)
 {
@@ -117,18 +491,140 @@ static void arg_get_chunk_and_filename(const char *arg, unsigned *chunk_index,
     *filename = p + 1;
 }
 
+static bool op_is_replace(struct operation *op)
+{
+    return op->func == op_replace_compress || op->func == op_replace_raw;
+}
+
+static int compare_operations(const void *a, const void *b)
+{
+    const struct operation *op_a = *(struct operation **)a;
+    const struct operation *op_b = *(struct operation **)b;
+
+    if (op_a->chunk_index != op_b->chunk_index)
+        return op_a->chunk_index < op_b->chunk_index ? -1 : 1;
+    return op_a->seq < op_b->seq ? -1 : op_a->seq > op_b->seq;
+}
+
+/*
+ * Plan the operations for a single chunk. Replacements which are replaced
+ * again before anything reads the chunk are skipped, so they are never
+ * compressed. Decompressions which happen more than once between
+ * replacements share a single decompression.
+ */
+static void plan_chunk_operations(struct operation **ops, unsigned num_ops)
+{
+    bool replaced_later = false;
+    unsigned i, j, start, count;
+
+    for (i = num_ops; i-- > 0; ) {
+        if (op_is_replace(ops[i])) {
+            ops[i]->skip = replaced_later;
+            replaced_later = true;
+        } else {
+            replaced_later = false;
+        }
+    }
+
+    for (start = 0; start < num_ops; start = i + 1) {
+        count = 0;
+        for (i = start; i < num_ops && !op_is_replace(ops[i]); i++)
+            if (ops[i]->func == op_extract_decompress)
+                count++;
+
+        if (count > 1)
+            for (j = start; j < i; j++)
+                ops[j]->shared = ops[j]->func == op_extract_decompress;
+    }
+}
+
 static void do_operations(void)
 {
-    struct operation *op;
+    struct operation **ops, *op;
+    unsigned i, start, num_replaced = 0, cached_index = 0;
+    struct lv_workqueue wq;
     struct lv_chunk *chunk;
+    bool cached = false;
+
+    if (!num_operations)
+        return;
+
+    /*
+     * Operations on different chunks are independent, so the operations
+     * are grouped by chunk. The operations for each chunk are still done
+     * in the order they were given.
+     */
+    ops = malloc(num_operations * sizeof(*ops));
+    if (!ops)
+        fatal_error("Cannot allocate memory for operations");
+    for (i = 0, op = operation_list; op; op = op->next, i++) {
+        if (op->chunk_index >= pack.num_chunks)
+            fatal_error("Bad chunk index");
+        ops[i] = op;
+    }
+    qsort(ops, num_operations, sizeof(*ops), compare_operations);
+
+    for (start = 0; start < num_operations; start = i) {
+        for (i = start; i < num_operations &&
+                 ops[i]->chunk_index == ops[start]->chunk_index; i++)
+            ;
+        plan_chunk_operations(&ops[start], i - start);
+    }
+
+    /*
+     * Compressing replacement chunks is the slow part, so compress them
+     * all in parallel first. The replacements are then applied in order,
+     * so the result is the same as doing everything serially.
+     */
+    for (i = 0; i < num_operations; i++)
+        if (ops[i]->func == op_replace_compress && !ops[i]->skip)
+            num_replaced++;
+
+    /* A single replacement can use all of the threads itself */
+    if (num_replaced == 1)
+        compress_params.num_threads = num_jobs ? num_jobs :
+                                      lv_workqueue_num_cpus();
+
+    if (lv_workqueue_init(&wq, num_jobs))
+        fatal_error("Cannot create work queue");
+    for (i = 0; i < num_operations; i++)
+        if (ops[i]->func == op_replace_compress && !ops[i]->skip &&
+            lv_workqueue_add(&wq, compress_replacement, ops[i]))
+            compress_replacement(ops[i]);
+    lv_workqueue_free(&wq);
+
+    for (i = 0; i < num_operations; i++)
+        if (ops[i]->error)
+            fatal_error(ops[i]->error);
+
+    for (i = 0; i < num_operations; i++) {
+        op = ops[i];
+        if (op->skip)
+            continue;
+
+        /* Release a shared decompression before the chunk changes */
+        if (cached && (op->chunk_index != cached_index || op_is_replace(op))) {
+            lv_pack_cache_put(&pack, cached_index);
+            cached = false;
+        }
 
-    for (op = operation_list; op; op = op->next) {
         chunk = lv_pack_get_chunk(&pack, op->chunk_index);
         if (!chunk)
             fatal_error("Bad chunk index");
 
-        op->func(chunk, op->filename);
+        if (op->shared && !cached) {
+            if (!lv_pack_cache_get(&pack, op->chunk_index, NULL))
+                fatal_error("Cannot decompress chunk");
+            cached_index = op->chunk_index;
+            cached = true;
+        }
+
+        op->func(op, chunk);
     }
+
+    if (cached)
+        lv_pack_cache_put(&pack, cached_index);
+    free(ops);
 }
 
 static void add_operation(operation_func_t func, unsigned chunk_index,
@@ -143,49 +639,166 @@ static void add_operation(operation_func_t func, unsigned chunk_index,
     op->func = func;
     op->chunk_index = chunk_index;
     op->filename = filename;
+    op->seq = num_operations++;
 
-    op->next = operation_list;
-    operation_list = op;
+    *operation_tail = op;
+    operation_tail = &op->next;
 }
 
-static void repack(const char *filename)
+/*
+ * Add a replace operation for each file in a directory. Files are named
+ * with the chunk index in hex, optionally followed by an extension. For
+ * example 001f.bin replaces chunk 0x1f.
+ */
+static void add_replace_dir(const char *dirname)
 {
-    uint32_t final;
-    FILE *fd;
-    int i;
+    struct dirent **entries;
+    unsigned chunk_index;
+    char *filename, *end;
+    int i, num_entries;
+
+    num_entries = scandir(dirname, &entries, NULL, alphasort);
+    if (num_entries < 0)
+        fatal_error("Cannot open replacement directory");
+
+    for (i = 0; i < num_entries; i++) {
+        chunk_index = strtoul(entries[i]->d_name, &end, 16);
+        if (end != entries[i]->d_name && (*end == '\0' || *end == '.')) {
+            filename = malloc(strlen(dirname) + strlen(entries[i]->d_name) + 2);
+            if (!filename)
+                fatal_error("Cannot allocate memory for filename");
+            sprintf(filename, "%s/%s", dirname, entries[i]->d_name);
+
+            add_operation(op_replace_compress, chunk_index, filename);
+        }
+        free(entries[i]);
+    }
+    free(entries);
+}
+static const struct {
+    const char      *name;
+    operation_func_t func;
+} ops_file_commands[] = {
+    {"extract",     op_extract_raw},
+    {"decompress",  op_extract_decompress},
+    {"replace",     op_replace_compress},
+    {"replace-raw", op_replace_raw},
+};
 
-    /* Recalculate chunk base offsets */
-    for (i = 1; i < pack.num_chunks; i++)
-        pack.chunks[i].start = pack.chunks[i - 1].start +
-            pack.chunks[i - 1].size;
+/*
+ * Read operations from a file, or stdin if the filename is "-". Each line
+ * is a command, a chunk index and a filename, for example:
+ *
+ *   decompress 4 erik.img
+ *   replace 0x1c level1.map
+ *
+ * Blank lines and lines starting with '#' are ignored. Returns true if
+ * any of the operations replace a chunk.
+ */
+static bool add_ops_file(const char *filename)
+{
+    char *line = NULL, *p, *end, *chunk_arg, *cmd;
+    unsigned chunk_index, line_num = 0, i;
+    bool has_replace = false;
+    size_t line_size = 0;
+    ssize_t len;
+    FILE *fd;
 
-    fd = fopen(filename, "w");
+    fd = strcmp(filename, "-") == 0 ? stdin : fopen(filename, "r");
     if (!fd)
-        fatal_error("Cannot open file for repack");
+        fatal_error("Cannot open operations file");
 
-    /* Write out the chunk headers */
-    for (i = 0; i < pack.num_chunks; i++)
-        fwrite(&pack.chunks[i].start, sizeof(pack.chunks[i].start), 1, fd);
-    final = pack.chunks[i - 1].start + pack.chunks[i - 1].size;
-    fwrite(&final, sizeof(final), 1, fd);
+    while ((len = getline(&line, &line_size, fd)) >= 0) {
+        line_num++;
+        while (len > 0 && isspace(line[len - 1]))
+            line[--len] = '\0';
 
-    /* Write out the chunk data */
-    for (i = 0; i < pack.num_chunks; i++)
-        fwrite(pack.chunks[i].data, pack.chunks[i].size, 1, fd);
+        p = line;
+        while (isspace(*p))
+            p++;
+        if (*p == '\0' || *p == '#')
+            continue;
 
-    fclose(fd);
+        cmd = strsep(&p, " \t");
+        while (p && isspace(*p))
+            p++;
+        chunk_arg = strsep(&p, " \t");
+        while (p && isspace(*p))
+            p++;
+
+        if (!chunk_arg || !p || *p == '\0') {
+            printf("%s:%u: Expected a command, chunk and filename\n",
+                   filename, line_num);
+            fatal_error("Bad operations file");
+        }
+
+        chunk_index = strtoul(chunk_arg, &end, 0);
+        if (*chunk_arg == '\0' || *end != '\0') {
+            printf("%s:%u: Bad chunk index %s\n", filename, line_num,
+                   chunk_arg);
+            fatal_error("Bad operations file");
+        }
+
+        for (i = 0; i < ARRAY_SIZE(ops_file_commands); i++)
+            if (strcmp(cmd, ops_file_commands[i].name) == 0)
+                break;
+        if (i == ARRAY_SIZE(ops_file_commands)) {
+            printf("%s:%u: Unknown command %s\n", filename, line_num, cmd);
+            fatal_error("Bad operations file");
+        }
+
+        add_operation(ops_file_commands[i].func, chunk_index, strdup(p));
+        if (ops_file_commands[i].func == op_replace_compress ||
+            ops_file_commands[i].func == op_replace_raw)
+            has_replace = true;
+    }
+
+    free(line);
+    if (fd != stdin)
+        fclose(fd);
+    return has_replace;
 }
 
+
 static int usage(const char *progname, int status)
 {
     printf("Usage: %s [OPTIONS...] DATA_FILE\n", progname);
     printf("\nOptions:\n");
     printf("  -B, --blackthorne                     Pack file is Blackthorne format\n");
     printf("  -l, --list-chunks                     List chunks in data file\n");
+    printf("  -D, --dedup-report                    Report chunks with identical decompressed\n");
+    printf("                                        data and how much sharing them would save\n");
     printf("  -r, --replace-chunk=CHUNK:FILENAME    Replace a chunk\n");
+    printf("  -w, --replace-raw-chunk=CHUNK:FILENAME\n");
+    printf("                                        Replace a chunk with raw chunk data\n");
     printf("  -e, --extract-chunk=CHUNK:FILENAME    Extract raw chunk\n");
     printf("  -d, --decompress-chunk=CHUNK:FILENAME Decompress and extract chunk\n");
+    printf("  -x, --extract-all=DIR                 Decompress and extract every chunk to\n");
+    printf("                                        DIR, named by chunk index in hex\n");
+    printf("  -X, --extract-all-raw=DIR             Extract every raw chunk to DIR\n");
     printf("  -o, --output-file=FILENAME            Output file to write to for repacking\n");
+    printf("  -p, --create-patch=NEW_FILE:PATCH     Create a patch which changes DATA_FILE\n");
+    printf("                                        into NEW_FILE\n");
+    printf("  -a, --apply-patch=PATCH               Apply a patch to DATA_FILE\n");
+    printf("  -O, --ops=FILE                        Read operations from FILE, or stdin if\n");
+    printf("                                        FILE is -. Each line is one of:\n");
+    printf("                                          extract CHUNK FILENAME\n");
+    printf("                                          decompress CHUNK FILENAME\n");
+    printf("                                          replace CHUNK FILENAME\n");
+    printf("                                          replace-raw CHUNK FILENAME\n");
+    printf("  -i, --in-place                        Update the data file in place rather\n");
+    printf("                                        than writing a new output file\n");
+    printf("  -I, --write-index                     Write an index next to the data file so\n");
+    printf("                                        that it can be opened without reading\n");
+    printf("                                        the chunks. Includes the hashes if -D\n");
+    printf("                                        is also given\n");
+    printf("  -R, --replace-dir=DIR                 Replace the chunks for each file in DIR.\n");
+    printf("                                        Files are named by chunk index in hex\n");
+    printf("  -c, --compression=LEVEL               Compression for replaced chunks:\n");
+    printf("                                        greedy (default), lazy or optimal\n");
+    printf("  -j, --jobs=N                          Number of threads used to compress\n");
+    printf("                                        replaced chunks and extract all chunks.\n");
+    printf("                                        Default is one per CPU\n");
     printf("  -?, --help                            Help\n");
 
     exit(status);
@@ -197,6 +810,9 @@ static int usage(const char *progname, int status)
  * List all of the chunks in the pack file:
  *   ./pack_tool DATA.DAT -l
  *
+ * Report duplicated chunks:
+ *   ./pack_tool DATA.DAT -D
+ *
  * Extract and decompress chunk 4 (Erik HUD image, raw 32x24)
  *   ./pack_tool DATA.DAT -d4:erik.img
  *
@@ -204,25 +820,70 @@ static int usage(const char *progname, int status)
  *
  *   ./pack_tool DATA.DAT -r4:erik_new.img -o DATA_NEW.DAT
  *
+ * Replace chunk 4 using the slower, but smallest, compression:
+ *
+ *   ./pack_tool DATA.DAT -c optimal -r4:erik_new.img -o DATA_NEW.DAT
+ *
+ * Replace every chunk with a file in the mod directory (e.g. mod/0004.img)
+ * using four threads:
+ *
+ *   ./pack_tool DATA.DAT -j4 -R mod -o DATA_NEW.DAT
+ *
+ * Decompress every chunk into the chunks directory (e.g. chunks/0004.bin):
+ *
+ *   ./pack_tool DATA.DAT -x chunks
+ *
+ * Apply a list of operations from a file, writing the pack once:
+ *
+ *   ./pack_tool DATA.DAT --ops release.ops -o DATA_NEW.DAT
+ *
+ * Create a patch for a modified pack file, and apply it to the original:
+ *
+ *   ./pack_tool DATA.DAT -p DATA_MOD.DAT:mod.lvpatch
+ *   ./pack_tool DATA.DAT -a mod.lvpatch -i
+ *
+ * Replace chunk 4 in the existing pack file:
+ *
+ *   ./pack_tool DATA.DAT -r4:erik_new.img -i
+ *
+ * Write an index with content hashes, so later runs open the pack quickly:
+ *
+ *   ./pack_tool DATA.DAT -D -I
+ *
  */
 int main(int argc, char **argv)
 {
     const struct option long_options[] = {
         {"blackthorne",       no_argument,       0, 'B'},
         {"list-chunks",       no_argument,       0, 'l'},
+        {"dedup-report",      no_argument,       0, 'D'},
         {"extract-raw-chunk", required_argument, 0, 'e'},
         {"decompress-chunk",  required_argument, 0, 'd'},
+        {"extract-all",       required_argument, 0, 'x'},
+        {"extract-all-raw",   required_argument, 0, 'X'},
         {"replace-chunk",     required_argument, 0, 'r'},
+        {"replace-raw-chunk", required_argument, 0, 'w'},
+        {"replace-dir",       required_argument, 0, 'R'},
+        {"ops",               required_argument, 0, 'O'},
+        {"create-patch",      required_argument, 0, 'p'},
+        {"apply-patch",       required_argument, 0, 'a'},
         {"output-file",       required_argument, 0, 'o'},
+        {"in-place",          no_argument,       0, 'i'},
+        {"write-index",       no_argument,       0, 'I'},
+        {"compression",       required_argument, 0, 'c'},
+        {"jobs",              required_argument, 0, 'j'},
         {"help",              no_argument,       0, '?'},
         {NULL, 0, 0, 0},
     };
-    const char *short_options = "Ble:d:r:o:?";
+    const char *short_options = "BlDe:d:x:X:r:w:R:O:p:a:o:iIc:j:?";
     struct lv_chunk *chunk;
     unsigned chunk_index;
-    int i, option_index, c;
+    int i, option_index, c, err;
     bool blackthorne = false, list_chunks = false, needs_repack = false;
+    bool in_place = false, dedup = false, index = false;
     const char *filename, *data_file = NULL, *outfile = NULL;
+    const char *extract_dir = NULL, *extract_raw_dir = NULL;
+    const char *create_patch_arg = NULL, *patch_file = NULL;
 
     while (1) {
         c = getopt_long(argc, argv, short_options, long_options, &option_index);
@@ -238,12 +899,32 @@ int main(int argc, char **argv)
             list_chunks = true;
             break;
 
+        case 'D':
+            dedup = true;
+            break;
+
         case 'r':
             arg_get_chunk_and_filename(optarg, &chunk_index, &filename);
             add_operation(op_replace_compress, chunk_index, filename);
             needs_repack = true;
             break;
 
+        case 'w':
+            arg_get_chunk_and_filename(optarg, &chunk_index, &filename);
+            add_operation(op_replace_raw, chunk_index, filename);
+            needs_repack = true;
+            break;
+
+        case 'R':
+            add_replace_dir(optarg);
+            needs_repack = true;
+            break;
+
+        case 'O':
+            if (add_ops_file(optarg))
+                needs_repack = true;
+            break;
+
         case 'e':
             arg_get_chunk_and_filename(optarg, &chunk_index, &filename);
             add_operation(op_extract_raw, chunk_index, filename);
@@ -254,10 +935,43 @@ int main(int argc, char **argv)
             add_operation(op_extract_decompress, chunk_index, filename);
             break;
 
+        case 'x':
+            extract_dir = optarg;
+            break;
+
+        case 'X':
+            extract_raw_dir = optarg;
+            break;
+
+        case 'p':
+            create_patch_arg = optarg;
+            break;
+
+        case 'a':
+            patch_file = optarg;
+            needs_repack = true;
+            break;
+
         case 'o':
             outfile = optarg;
             break;
 
+        case 'i':
+            in_place = true;
+            break;
+
+        case 'I':
+            index = true;
+            break;
+
+        case 'c':
+            compress_params.parser = arg_get_compression(optarg);
+            break;
+
+        case 'j':
+            num_jobs = strtoul(optarg, NULL, 0);
+            break;
+
         case '?':
             usage(argv[0], EXIT_SUCCESS);
             break;
@@ -276,22 +990,81 @@ int main(int argc, char **argv)
         usage(argv[0], EXIT_FAILURE);
     }
 
-    lv_pack_load(data_file, &pack, blackthorne);
+    if (in_place && outfile) {
+        printf("Cannot use an output file when updating in place\n");
+        usage(argv[0], EXIT_FAILURE);
+    }
+    if (needs_repack && !outfile && !in_place) {
+        printf("No output file specified\n");
+        usage(argv[0], EXIT_FAILURE);
+    }
+
+    /* Finish any in-place update which was interrupted */
+    err = lv_pack_recover(data_file);
+    if (err)
+        fatal_error("Cannot recover interrupted update of data file");
+
+    /*
+     * Only the chunks being used are loaded, since saving copies the other
+     * chunks directly from the data file. If there is an index then even
+     * listing the chunks does not need to read them.
+     */
+    err = lv_pack_load_flags(data_file, &pack, blackthorne,
+                             LV_PACK_LOAD_RANDOM | LV_PACK_LOAD_LAZY |
+                             LV_PACK_LOAD_INDEX);
+    if (err)
+        fatal_error("Cannot load data file");
 
     if (list_chunks) {
         printf("%zd chunks:\n", pack.num_chunks);
         for (i = 0; i < pack.num_chunks; i++) {
-            chunk = &pack.chunks[i];
+            chunk = lv_pack_get_chunk(&pack, i);
+            if (!chunk)
+                fatal_error("Cannot load chunk");
 
-            printf("  [%4x] start=%6x, size=%6zx, decompressed_size=%6zx, flag=%d\n",
+            printf("  [%4x] start=%6x, size=%6zx, decompressed_size=%6zx, flag=%d%s\n",
                    i, chunk->start, chunk->size, chunk->decompressed_size,
-                   chunk->flag);
+                   chunk->flag,
+                   chunk->storage == LV_CHUNK_STORAGE_STORED ? ", stored" : "");
         }
     }
 
+    if (dedup)
+        dedup_report();
+
+    /* An in-place update changes the data file, so index it afterwards */
+    if (index && !(needs_repack && in_place))
+        write_index(data_file);
+    if (create_patch_arg)
+        create_patch(create_patch_arg, blackthorne);
+    if (patch_file)
+        apply_patch(patch_file);
+
     do_operations();
-    if (needs_repack)
-        repack(outfile);
+    if (extract_dir)
+        extract_all(extract_dir, false);
+    if (extract_raw_dir)
+        extract_all(extract_raw_dir, true);
+    if (needs_repack) {
+        if (in_place) {
+            outfile = data_file;
+            err = lv_pack_save_in_place(&pack, data_file);
+        } else {
+            err = lv_pack_save(&pack, outfile);
+        }
+        if (err) {
+            printf("Cannot write %s: %s\n", outfile, strerror(-err));
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (index && needs_repack && in_place) {
+        lv_pack_free(&pack);
+        err = lv_pack_load_flags(data_file, &pack, blackthorne,
+                                 LV_PACK_LOAD_RANDOM | LV_PACK_LOAD_LAZY);
+        if (err)
+            fatal_error("Cannot load updated data file");
+        write_index(data_file);
+    }
 
     exit(EXIT_SUCCESS);
 }
@@ -24,6 +24,7 @@
 #include <liblv/lv_pack.h>
 #include <liblv/lv_sprite.h>
 #include <liblv/lv_level.h>
+#include <liblv/lv_arena.h>
 #include <liblv/common.h>
 
 #define SCREEN_WIDTH	(64 * 16)
@@ -57,6 +58,7 @@ static void load_palette_from_level(struct lv_pack *pack, SDL_Surface *surf,
         sdl_pal[i].g = level.palette[(i * 3) + 1] << 2;
         sdl_pal[i].b = level.palette[(i * 3) + 2] << 2;
     }
+    lv_level_free(pack, &level);
 
     SDL_SetPalette(surf, SDL_LOGPAL | SDL_PHYSPAL, sdl_pal, 0, 256);
 }
@@ -65,16 +67,15 @@ static void load_palette_from_chunk(struct lv_pack *pack, SDL_Surface *surf,
                                     unsigned chunk_index, bool uncompressed)
 {
     SDL_Color sdl_pal[256];
-    uint8_t *pal_data;
+    const uint8_t *pal_data;
     size_t pal_size;
     struct lv_chunk *chunk;
     int i;
 
-    chunk = lv_pack_get_chunk(pack, chunk_index);
     if (uncompressed)
-        pal_data = chunk->data + 4;
-    else
-        lv_decompress_chunk(chunk, &pal_data);
+        lv_pack_set_chunk_storage(pack, chunk_index, LV_CHUNK_STORAGE_STORED);
+    chunk = lv_pack_get_chunk(pack, chunk_index);
+    pal_data = lv_pack_cache_get(pack, chunk_index, NULL);
     pal_size = chunk->decompressed_size - 1;
 
     for (i = 0; i < pal_size / 3; i++) {
@@ -84,6 +85,8 @@ static void load_palette_from_chunk(struct lv_pack *pack, SDL_Surface *surf,
     }
 
     SDL_SetPalette(surf, SDL_LOGPAL | SDL_PHYSPAL, sdl_pal, 0, pal_size / 3);
+
+    lv_pack_cache_put(pack, chunk_index);
 }
 
 static void usage(const char *progname, int status)
@@ -101,6 +104,7 @@ static void usage(const char *progname, int status)
     printf("  -s, --splash                Chunk is a splash screen image\n");
     printf("  -w, --width=WIDTH           Sprite width\n");
     printf("  -h, --height=HEIGHT         Sprite height\n");
+    printf("  -n, --sprite=INDEX          Only load and show sprite INDEX\n");
 
     printf("  -W, --screen-width=WIDTH    Screen width (default=%d)\n", SCREEN_WIDTH);
     printf("  -H, --screen-height=HEIGHT  Screen height (default=%d)\n", SCREEN_HEIGHT);
@@ -131,6 +135,9 @@ static void usage(const char *progname, int status)
  * View Erik HUD image:
  *   ./sprite_view DATA.DAT 4 -l1 -fraw -w32 -h24
  *
+ * View only the fifth Erik sprite:
+ *   ./sprite_view DATA.DAT 224 -l1 -fpacked32 -b0xb0 -n4
+ *
  * Blackthorne Examples
  * --------------------
  *
@@ -151,23 +158,28 @@ int main(int argc, char **argv)
         {"splash",        no_argument,       0, 's'},
         {"width",         required_argument, 0, 'w'},
         {"height",        required_argument, 0, 'h'},
+        {"sprite",        required_argument, 0, 'n'},
         {"screen-width",  required_argument, 0, 'W'},
         {"screen-height", required_argument, 0, 'H'},
         {"help",          no_argument,       0, '?'},
         {NULL, 0, 0, 0},
     };
-    const char *short_options = "Bf:l:p:b:usw:h:?";
+    const char *short_options = "Bf:l:p:b:usw:h:n:?";
     const char *pack_filename = NULL;
     SDL_Surface *screen;
-    uint8_t *sprite_data;
+    const uint8_t *sprite_data;
+    uint8_t *single_data;
     struct lv_pack pack;
     struct lv_chunk *chunk;
     struct lv_sprite_set sprite_set;
+    struct lv_arena arena;
     bool blackthorne = false, uncompressed = false, splash = false;
     size_t sprite_width = 32, sprite_height = 32,
-        screen_width = SCREEN_WIDTH, screen_height = SCREEN_HEIGHT, data_size;
+        screen_width = SCREEN_WIDTH, screen_height = SCREEN_HEIGHT, data_size,
+        single_size;
     unsigned format = LV_SPRITE_FORMAT_RAW, chunk_index, level_num = 0, x, y;
-    int c, i, option_index, pal_base = 0, pal_chunk_index = -1;
+    int c, i, option_index, pal_base = 0, pal_chunk_index = -1,
+        sprite_index = -1;
 
     while (1) {
         c = getopt_long(argc, argv, short_options, long_options, &option_index);
@@ -203,6 +215,10 @@ int main(int argc, char **argv)
             sprite_height = strtoul(optarg, NULL, 0);
             break;
 
+        case 'n':
+            sprite_index = strtoul(optarg, NULL, 0);
+            break;
+
         case 'f':
             for (i = 0; i < ARRAY_SIZE(format_names); i++) {
                 if (strcmp(optarg, format_names[i]) == 0) {
@@ -250,7 +266,11 @@ int main(int argc, char **argv)
         usage(argv[0], EXIT_FAILURE);
     }
 
-    lv_pack_load(pack_filename, &pack, blackthorne);
+    lv_pack_load_flags(pack_filename, &pack, blackthorne,
+                       LV_PACK_LOAD_RANDOM | LV_PACK_LOAD_LAZY |
+                       LV_PACK_LOAD_INDEX);
+    if (uncompressed)
+        lv_pack_set_chunk_storage(&pack, chunk_index, LV_CHUNK_STORAGE_STORED);
     chunk = lv_pack_get_chunk(&pack, chunk_index);
 
     screen = SDL_SetVideoMode(screen_width, screen_height, 8, SDL_INIT_VIDEO);
@@ -272,17 +292,27 @@ int main(int argc, char **argv)
         sprite_height = data_size / sprite_width;
         printf("Recaculated height: %zd\n", sprite_height);
 
-        if (uncompressed)
-            sprite_data = chunk->data + chunk->data_offset;
-        else
-            lv_decompress_chunk(chunk, &sprite_data);
-
+        lv_decompress_chunk_borrow(chunk, &sprite_data);
         lv_sprite_draw(sprite_data, sprite_width, sprite_height, format,
                        pal_base, false, false, screen->pixels, 0, 0, screen->w);
+        lv_decompress_chunk_put(chunk, sprite_data);
 
 
+    } else if (sprite_index >= 0) {
+        /* Only decompress the part of the chunk needed for the sprite */
+        if (lv_sprite_load_single(chunk, format, sprite_width, sprite_height,
+                                  sprite_index, &single_data, &single_size)) {
+            printf("Cannot load sprite %d\n", sprite_index);
+            exit(EXIT_FAILURE);
+        }
+        lv_sprite_draw(single_data, sprite_width, sprite_height, format,
+                       pal_base, false, false, screen->pixels, 0, 0,
+                       screen->w);
+        free(single_data);
+
     } else {
-        lv_sprite_load_set(&sprite_set, format,
+        lv_arena_init(&arena, 0);
+        lv_sprite_load_set(&sprite_set, &arena, format,
                            sprite_width, sprite_height, chunk);
         printf("%zd sprites\n", sprite_set.num_sprites);
         for (i = 0, x = 0, y = 0; i < sprite_set.num_sprites; i++) {
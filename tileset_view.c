@@ -86,16 +86,20 @@ static void draw_prefab(SDL_Surface *surf, SDL_Surface *surf_tileset,
 static SDL_Surface *load_tileset(unsigned chunk_index)
 {
     SDL_Surface *surf;
-    struct lv_chunk *chunk;
-    size_t num_tiles;
-    uint8_t *data, *pixels;
+    const uint8_t *data;
+    size_t num_tiles, size;
+    uint8_t *pixels;
     int i;
 
-    chunk = lv_pack_get_chunk(&pack, chunk_index);
-    lv_decompress_chunk(chunk, &data);
+    /* Tilesets are shared between levels, so borrow the cached copy */
+    data = lv_pack_cache_get(&pack, chunk_index, &size);
+    if (!data) {
+        printf("Failed to load tileset chunk %.4x\n", chunk_index);
+        exit(EXIT_FAILURE);
+    }
 
     /* Tilesets are 8x8 */
-    num_tiles = chunk->decompressed_size / TILE_DATA_SIZE;
+    num_tiles = size / TILE_DATA_SIZE;
 
     surf = sdl_create_surf(screen, num_tiles * TILE_SIZE, TILE_SIZE);
     if (!surf) {
@@ -111,7 +115,7 @@ static SDL_Surface *load_tileset(unsigned chunk_index)
 			   false, false, pixels, i * TILE_SIZE, 0, surf->w);
     SDL_UnlockSurface(surf);
 
-    free(data);
+    lv_pack_cache_put(&pack, chunk_index);
     return surf;
 }
 
@@ -198,7 +202,9 @@ int main(int argc, char **argv)
     if (debug_flags)
         lv_debug_toggle(debug_flags);
 
-    lv_pack_load(pack_filename, &pack, blackthorne);
+    lv_pack_load_flags(pack_filename, &pack, blackthorne,
+                       LV_PACK_LOAD_RANDOM | LV_PACK_LOAD_LAZY |
+                       LV_PACK_LOAD_INDEX);
 
     level_info = lv_level_get_info(&pack, level_num);
     if (!level_info) {